@@ -0,0 +1,408 @@
+#define _GNU_SOURCE 1
+
+// Benchmark for finding the game among many processes.
+//
+// Spawns idle dummy processes and waits until they are older than RENAME_GRACE_SECONDS, like the processes of a
+// desktop that has been up for a while. Then, for every round and discovery strategy, it starts one process that
+// renames itself to sekiro.exe after a random delay and starts a thread like wine does. It reports how long every
+// strategy takes to notice the rename, and for the strategies that walk /proc how much CPU time a pass costs.
+//
+// usage: discoverybench [dummies] [rounds] [max-delay-ms] [seed]
+
+#include "../src/launcher.h"
+#include "../src/loop.h"
+#include "../src/sekiro.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TARGET_COMMAND "target"
+#define DETECTION_TIMEOUT_SECONDS 30
+
+enum strategy {
+	STRATEGY_INCREMENTAL,
+	STRATEGY_FULL,
+	STRATEGY_LAUNCHER,
+	STRATEGY_COUNT,
+};
+
+static const char *strategy_names[STRATEGY_COUNT] = {
+	[STRATEGY_INCREMENTAL] = "incremental",
+	[STRATEGY_FULL] = "full",
+	[STRATEGY_LAUNCHER] = "launcher",
+};
+
+struct strategy_results {
+	double *latencies_ms;
+	size_t latencies_length;
+	size_t passes;
+	double pass_cpu_us_total;
+	double pass_cpu_us_max;
+	double cpu_ms_total;
+};
+
+struct detection {
+	pid_t pid;
+	uint64_t detected_ns;
+	size_t passes;
+	double pass_cpu_us_total;
+	double pass_cpu_us_max;
+	double cpu_ms;
+};
+
+static uint64_t random_state = 0;
+
+static uint64_t random_next(void)
+{
+	// xorshift64*, same as scanfuzz.
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+
+	return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec now = { 0 };
+	clock_gettime(clock, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double left = *(const double *)a;
+	double right = *(const double *)b;
+
+	return (left > right) - (left < right);
+}
+
+static void *idle_thread(void *data)
+{
+	(void)data;
+	for (;;) {
+		pause();
+	}
+
+	return NULL;
+}
+
+// Runs in the exec'd target: waits, tells the benchmark when it renames itself and then looks like wine does once
+// the game is running, a process called sekiro.exe that starts threads.
+static int run_target(char *argv[])
+{
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+	long delay_ms = strtol(argv[2], NULL, 10);
+	int fd = strtol(argv[3], NULL, 10);
+	struct timespec delay = { .tv_sec = delay_ms / 1000, .tv_nsec = (delay_ms % 1000) * 1000000L };
+	while (nanosleep(&delay, &delay) == -1 && EINTR == errno);
+
+	uint64_t renamed_ns = clock_ns(CLOCK_MONOTONIC);
+	if (write(fd, &renamed_ns, sizeof(renamed_ns)) != sizeof(renamed_ns)) {
+		perror("write() failed");
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	prctl(PR_SET_NAME, "sekiro.exe");
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, idle_thread, NULL)) {
+		fprintf(stderr, "pthread_create() failed\n");
+		return EXIT_FAILURE;
+	}
+	idle_thread(NULL);
+
+	return EXIT_SUCCESS;
+}
+
+static pid_t spawn_dummy(void)
+{
+	pid_t pid = fork();
+	if (!pid) {
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		prctl(PR_SET_NAME, "dummy");
+		idle_thread(NULL);
+		_exit(EXIT_SUCCESS);
+	}
+
+	return pid;
+}
+
+static void kill_and_reap(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	while (waitpid(pid, NULL, 0) == -1 && EINTR == errno);
+}
+
+static pid_t spawn_target(char **command)
+{
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork() failed");
+		return -1;
+	}
+	if (!pid) {
+		execv(command[0], command);
+		perror("execv() failed");
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static bool detect_with_scanner(bool rescan_rejected, char **command, struct detection *detection_out)
+{
+	struct process_scanner scanner;
+	if (!process_scanner_init(&scanner)) {
+		fprintf(stderr, "process_scanner_init() failed\n");
+		return false;
+	}
+	scanner.rescan_rejected = rescan_rejected;
+
+	bool success = false;
+	pid_t target = spawn_target(command);
+	uint64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+	// Same cadence as find_sekiro().
+	struct timespec interval = { .tv_nsec = LOOP_POLL_INTERVAL_NS };
+	while (target != -1 && clock_ns(CLOCK_MONOTONIC) - start_ns < DETECTION_TIMEOUT_SECONDS * 1000000000ULL) {
+		bool found = false;
+		pid_t pid = 0;
+		uint64_t cpu_start_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+		bool passed = process_scanner_pass(&scanner, &found, &pid);
+		uint64_t detected_ns = clock_ns(CLOCK_MONOTONIC);
+		double pass_cpu_us = (clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start_ns) / 1e3;
+		if (!passed) {
+			fprintf(stderr, "process_scanner_pass() failed\n");
+			break;
+		}
+
+		detection_out->passes += 1;
+		detection_out->pass_cpu_us_total += pass_cpu_us;
+		if (pass_cpu_us > detection_out->pass_cpu_us_max) {
+			detection_out->pass_cpu_us_max = pass_cpu_us;
+		}
+		if (found) {
+			detection_out->pid = pid;
+			detection_out->detected_ns = detected_ns;
+			success = pid == target;
+			if (!success) {
+				fprintf(stderr, "found pid %ld instead of %ld, is the game running?\n", (long)pid,
+					(long)target);
+			}
+			break;
+		}
+
+		nanosleep(&interval, NULL);
+	}
+	detection_out->cpu_ms = detection_out->pass_cpu_us_total / 1e3;
+
+	if (target != -1) {
+		kill_and_reap(target);
+	}
+	process_scanner_free(&scanner);
+
+	return success;
+}
+
+static bool detect_with_launcher(char **command, struct detection *detection_out)
+{
+	struct loop loop;
+	if (!loop_init(&loop, true)) {
+		fprintf(stderr, "loop_init() failed\n");
+		return false;
+	}
+
+	struct launched_command launched = { 0 };
+	uint64_t cpu_start_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	bool success =
+		launch_and_find_sekiro(&loop, command, DETECTION_TIMEOUT_SECONDS, &launched, &detection_out->pid);
+	detection_out->detected_ns = clock_ns(CLOCK_MONOTONIC);
+	detection_out->cpu_ms = (clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start_ns) / 1e6;
+	if (!success) {
+		fprintf(stderr, "launch_and_find_sekiro() failed\n");
+	}
+
+	if (launched.child != -1) {
+		kill(launched.child, SIGKILL);
+		wait_for_command(&launched);
+	}
+	loop_free(&loop);
+
+	return success;
+}
+
+static bool run_round(enum strategy strategy, char *self, long delay_ms, struct strategy_results *results)
+{
+	int fds[2];
+	if (pipe(fds) == -1) {
+		perror("pipe() failed");
+		return false;
+	}
+	// Only the write end goes to the target.
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+	char delay[32] = "";
+	char fd[32] = "";
+	snprintf(delay, sizeof(delay), "%ld", delay_ms);
+	snprintf(fd, sizeof(fd), "%d", fds[1]);
+	char *command[] = { self, TARGET_COMMAND, delay, fd, NULL };
+
+	struct detection detection = { 0 };
+	bool success = false;
+	switch (strategy) {
+	case STRATEGY_INCREMENTAL:
+		success = detect_with_scanner(false, command, &detection);
+		break;
+	case STRATEGY_FULL:
+		success = detect_with_scanner(true, command, &detection);
+		break;
+	case STRATEGY_LAUNCHER:
+		success = detect_with_launcher(command, &detection);
+		break;
+	default:
+		fprintf(stderr, "unknown strategy\n");
+	}
+	close(fds[1]);
+
+	uint64_t renamed_ns = 0;
+	if (success && read(fds[0], &renamed_ns, sizeof(renamed_ns)) != sizeof(renamed_ns)) {
+		fprintf(stderr, "the target did not report when it renamed itself\n");
+		success = false;
+	}
+	close(fds[0]);
+	if (!success) {
+		return false;
+	}
+
+	// A pass that was already running when the rename happened can still see it, so this can't go below zero.
+	double latency_ms = detection.detected_ns > renamed_ns ? (detection.detected_ns - renamed_ns) / 1e6 : 0.0;
+	results->latencies_ms[results->latencies_length++] = latency_ms;
+	results->passes += detection.passes;
+	results->pass_cpu_us_total += detection.pass_cpu_us_total;
+	if (detection.pass_cpu_us_max > results->pass_cpu_us_max) {
+		results->pass_cpu_us_max = detection.pass_cpu_us_max;
+	}
+	results->cpu_ms_total += detection.cpu_ms;
+
+	return true;
+}
+
+static void print_results(enum strategy strategy, struct strategy_results *results)
+{
+	if (!results->latencies_length) {
+		printf("%-12s no detections\n", strategy_names[strategy]);
+		return;
+	}
+
+	double *sorted = results->latencies_ms;
+	size_t length = results->latencies_length;
+	qsort(sorted, length, sizeof(double), compare_doubles);
+	printf("%-12s latency-ms p50 %8.3f p99 %8.3f max %8.3f", strategy_names[strategy], sorted[length / 2],
+	       sorted[(size_t)((length - 1) * 0.99 + 0.5)], sorted[length - 1]);
+	if (results->passes) {
+		printf("  pass-cpu-us mean %9.1f max %9.1f", results->pass_cpu_us_total / results->passes,
+		       results->pass_cpu_us_max);
+	} else {
+		printf("  %-34s", "no /proc passes");
+	}
+	printf("  cpu-ms/detection %8.3f\n", results->cpu_ms_total / length);
+}
+
+static bool run_rounds(char *self, uint64_t rounds, long max_delay_ms, struct strategy_results *results)
+{
+	for (uint64_t round = 0; round < rounds; ++round) {
+		long delay_ms = random_next() % (max_delay_ms + 1);
+		for (int strategy = 0; strategy < STRATEGY_COUNT; ++strategy) {
+			if (!run_round(strategy, self, delay_ms, &results[strategy])) {
+				fprintf(stderr, "round %" PRIu64 " of %s failed\n", round, strategy_names[strategy]);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 4 && !strcmp(argv[1], TARGET_COMMAND)) {
+		return run_target(argv);
+	}
+
+	size_t dummies = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000;
+	uint64_t rounds = argc > 2 ? strtoull(argv[2], NULL, 10) : 20;
+	long max_delay_ms = argc > 3 ? strtol(argv[3], NULL, 10) : 200;
+	uint64_t seed = argc > 4 ? strtoull(argv[4], NULL, 10) : (uint64_t)time(NULL);
+	random_state = seed ? seed : 1;
+	if (max_delay_ms < 0) {
+		fprintf(stderr, "max-delay-ms can't be negative\n");
+		return EXIT_FAILURE;
+	}
+
+	// The target is this program again, exec'd so the launcher strategy sees a real exec.
+	char self[4096] = "";
+	ssize_t self_length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (self_length <= 0) {
+		perror("readlink() failed");
+		return EXIT_FAILURE;
+	}
+	self[self_length] = '\0';
+
+	pid_t *dummy_pids = calloc(dummies ? dummies : 1, sizeof(pid_t));
+	struct strategy_results results[STRATEGY_COUNT] = { 0 };
+	bool success = dummy_pids != NULL;
+	for (int i = 0; i < STRATEGY_COUNT && success; ++i) {
+		results[i].latencies_ms = calloc(rounds ? rounds : 1, sizeof(double));
+		success = results[i].latencies_ms != NULL;
+	}
+	if (!success) {
+		fprintf(stderr, "calloc() failed\n");
+		return EXIT_FAILURE;
+	}
+
+	size_t spawned = 0;
+	while (spawned < dummies) {
+		pid_t pid = spawn_dummy();
+		if (pid == -1) {
+			perror("fork() failed");
+			fprintf(stderr, "spawned only %zu of %zu dummies, raise the process limits for more\n", spawned,
+				dummies);
+			break;
+		}
+		dummy_pids[spawned++] = pid;
+	}
+	printf("seed %" PRIu64 ", %zu dummies, %" PRIu64 " rounds, delay up to %ld ms\n", seed, spawned, rounds,
+	       max_delay_ms);
+	fflush(stdout);
+	// Young processes are looked at on every pass, the dummies would all count as that otherwise.
+	struct timespec settle = { .tv_sec = RENAME_GRACE_SECONDS + 1 };
+	while (nanosleep(&settle, &settle) == -1 && EINTR == errno);
+
+	success = run_rounds(self, rounds, max_delay_ms, results);
+	for (int i = 0; i < STRATEGY_COUNT; ++i) {
+		print_results(i, &results[i]);
+		free(results[i].latencies_ms);
+	}
+
+	for (size_t i = 0; i < spawned; ++i) {
+		kill(dummy_pids[i], SIGKILL);
+	}
+	for (size_t i = 0; i < spawned; ++i) {
+		while (waitpid(dummy_pids[i], NULL, 0) == -1 && EINTR == errno);
+	}
+	free(dummy_pids);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,481 @@
+#define _GNU_SOURCE 1
+
+// Dumps and diffs the sections of the game's image.
+//
+// usage:
+//   dumpsection dump <mem-file> <output-directory> [<section>...]
+//   dumpsection diff <source> <source>
+//
+// <mem-file> is /proc/<pid>/mem of the game. A <source> is either a directory written by dump or a mem file, so a
+// dump can be compared against a live process. Every section is read by its own thread with large pread() calls, and
+// every page gets a hash, which is what diff compares.
+
+#include "../src/common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PAGE_SIZE 4096
+#define READ_SIZE (4 * 1024 * 1024)
+#define INDEX_FILE_NAME "sections"
+
+struct section_dump {
+	struct section_info info;
+	char file_name[16];
+	const char *mem_path;
+	const char *output_directory;
+	uint8_t *bytes;
+	uint64_t *hashes;
+	size_t hashes_length;
+	bool success;
+};
+
+struct source {
+	struct section_dump sections[MAX_SECTIONS];
+	size_t sections_length;
+};
+
+static uint64_t hash_page(const uint8_t *page, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		uint64_t word = 0;
+		memcpy(&word, page + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+	}
+	for (; i < length; ++i) {
+		hash = (hash ^ page[i]) * 0x100000001b3ULL;
+	}
+
+	return hash ^ (hash >> 29);
+}
+
+static void make_file_name(const char *name, size_t index, char *file_name, size_t file_name_size)
+{
+	// Section names start with a dot, which would make every file hidden.
+	while (*name == '.') {
+		++name;
+	}
+
+	size_t length = 0;
+	for (const char *c = name; *c && length + 1 < file_name_size; ++c) {
+		bool safe = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') ||
+			    *c == '.' || *c == '_' || *c == '-';
+		file_name[length++] = safe ? *c : '_';
+	}
+	file_name[length] = '\0';
+
+	if (!length) {
+		snprintf(file_name, file_name_size, "section%u", (unsigned)(index % MAX_SECTIONS));
+	}
+}
+
+static bool read_fully(int fd, uint8_t *destination, size_t size, size_t position)
+{
+	size_t done = 0;
+	while (done < size) {
+		size_t length = size - done < READ_SIZE ? size - done : READ_SIZE;
+		ssize_t read = pread(fd, destination + done, length, position + done);
+		if (read == -1) {
+			if (EINTR == errno) {
+				continue;
+			}
+			perror("pread() failed");
+			return false;
+		}
+		if (!read) {
+			fprintf(stderr, "pread() reached end-of-file unexpectedly\n");
+			return false;
+		}
+		done += read;
+	}
+
+	return true;
+}
+
+static bool write_fully(const char *directory, const char *file_name, const char *suffix, const void *source,
+			size_t size)
+{
+	char path[4096] = "";
+	int written = snprintf(path, sizeof(path), "%s/%s%s", directory, file_name, suffix);
+	if (written < 0 || (size_t)written >= sizeof(path)) {
+		fprintf(stderr, "path did not fit the buffer\n");
+		return false;
+	}
+
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	bool success = fwrite(source, 1, size, f) == size;
+	if (!success) {
+		fprintf(stderr, "fwrite() failed\n");
+	}
+
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
+
+static bool hash_section(struct section_dump *section)
+{
+	section->hashes_length = (section->info.size + PAGE_SIZE - 1) / PAGE_SIZE;
+	section->hashes = calloc(section->hashes_length ? section->hashes_length : 1, sizeof(uint64_t));
+	if (!section->hashes) {
+		fprintf(stderr, "calloc() failed\n");
+		return false;
+	}
+
+	for (size_t i = 0; i < section->hashes_length; ++i) {
+		size_t offset = i * PAGE_SIZE;
+		size_t length = section->info.size - offset < PAGE_SIZE ? section->info.size - offset : PAGE_SIZE;
+		section->hashes[i] = hash_page(section->bytes + offset, length);
+	}
+
+	return true;
+}
+
+static bool write_hashes(const struct section_dump *section)
+{
+	size_t size = section->hashes_length * 34;
+	char *text = malloc(size + 1);
+	if (!text) {
+		fprintf(stderr, "malloc() failed\n");
+		return false;
+	}
+
+	size_t length = 0;
+	for (size_t i = 0; i < section->hashes_length; ++i) {
+		length += snprintf(text + length, size + 1 - length, "%016zx %016" PRIx64 "\n",
+				   section->info.position + i * PAGE_SIZE, section->hashes[i]);
+	}
+
+	bool success = write_fully(section->output_directory, section->file_name, ".hashes", text, length);
+	free(text);
+
+	return success;
+}
+
+static void *dump_section(void *argument)
+{
+	struct section_dump *section = argument;
+
+	int fd = open(section->mem_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open() failed");
+		return NULL;
+	}
+
+	section->bytes = malloc(section->info.size ? section->info.size : 1);
+	if (!section->bytes) {
+		fprintf(stderr, "malloc() failed\n");
+	} else if (read_fully(fd, section->bytes, section->info.size, section->info.position) &&
+		   hash_section(section)) {
+		section->success = !section->output_directory ||
+				   (write_fully(section->output_directory, section->file_name, ".bin", section->bytes,
+						section->info.size) &&
+				    write_hashes(section));
+	}
+
+	if (close(fd) == -1) {
+		perror("close() failed");
+		section->success = false;
+	}
+
+	free(section->bytes);
+	section->bytes = NULL;
+
+	return NULL;
+}
+
+static bool is_selected(const char *name, char **selected, int selected_length)
+{
+	if (!selected_length) {
+		return true;
+	}
+
+	for (int i = 0; i < selected_length; ++i) {
+		if (!strncmp(name, selected[i], sizeof(((struct section_info *)NULL)->name) - 1)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool write_index(const struct source *source, const char *directory)
+{
+	char text[MAX_SECTIONS * 64] = "";
+	size_t length = 0;
+	for (size_t i = 0; i < source->sections_length; ++i) {
+		const struct section_dump *section = &source->sections[i];
+		length += snprintf(text + length, sizeof(text) - length, "%s %zx %zx\n", section->file_name,
+				   section->info.position, section->info.size);
+	}
+
+	return write_fully(directory, INDEX_FILE_NAME, "", text, length);
+}
+
+// Reads the selected sections of a live process in parallel, hashing them and writing them out if directory is set.
+static bool load_live(const char *mem_path, const char *directory, char **selected, int selected_length,
+		      struct source *source_out)
+{
+	FILE *f = fopen(mem_path, "rb");
+	if (!f) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	struct section_info sections[MAX_SECTIONS];
+	size_t sections_length = 0;
+	bool found = find_sections(f, sections, MAX_SECTIONS, &sections_length);
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+	}
+	if (!found) {
+		fprintf(stderr, "find_sections() failed\n");
+		return false;
+	}
+
+	source_out->sections_length = 0;
+	for (size_t i = 0; i < sections_length; ++i) {
+		if (!is_selected(sections[i].name, selected, selected_length)) {
+			continue;
+		}
+
+		struct section_dump *section = &source_out->sections[source_out->sections_length++];
+		*section = (struct section_dump){
+			.info = sections[i],
+			.mem_path = mem_path,
+			.output_directory = directory,
+		};
+		make_file_name(sections[i].name, i, section->file_name, sizeof(section->file_name));
+	}
+	if (!source_out->sections_length) {
+		fprintf(stderr, "none of the requested sections exist\n");
+		return false;
+	}
+
+	pthread_t threads[MAX_SECTIONS];
+	size_t started = 0;
+	for (; started < source_out->sections_length; ++started) {
+		if (pthread_create(&threads[started], NULL, dump_section, &source_out->sections[started])) {
+			fprintf(stderr, "pthread_create() failed\n");
+			break;
+		}
+	}
+
+	bool success = started == source_out->sections_length;
+	for (size_t i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+		if (!source_out->sections[i].success) {
+			fprintf(stderr, "failed to dump section %s\n", source_out->sections[i].info.name);
+			success = false;
+		}
+	}
+
+	if (success && directory) {
+		success = write_index(source_out, directory);
+	}
+
+	return success;
+}
+
+static bool load_hashes(const char *directory, struct section_dump *section)
+{
+	char path[4096] = "";
+	snprintf(path, sizeof(path), "%s/%s.hashes", directory, section->file_name);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	section->hashes_length = (section->info.size + PAGE_SIZE - 1) / PAGE_SIZE;
+	section->hashes = calloc(section->hashes_length ? section->hashes_length : 1, sizeof(uint64_t));
+	bool success = section->hashes != NULL;
+	for (size_t i = 0; success && i < section->hashes_length; ++i) {
+		uint64_t address = 0;
+		if (fscanf(f, "%" SCNx64 " %" SCNx64, &address, &section->hashes[i]) != 2) {
+			fprintf(stderr, "%s is truncated\n", path);
+			success = false;
+		}
+	}
+
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
+
+static bool load_directory(const char *directory, struct source *source_out)
+{
+	char path[4096] = "";
+	snprintf(path, sizeof(path), "%s/%s", directory, INDEX_FILE_NAME);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	bool success = true;
+	source_out->sections_length = 0;
+	char file_name[16] = "";
+	size_t position = 0;
+	size_t size = 0;
+	while (success && source_out->sections_length < MAX_SECTIONS &&
+	       fscanf(f, "%15s %zx %zx", file_name, &position, &size) == 3) {
+		struct section_dump *section = &source_out->sections[source_out->sections_length++];
+		*section = (struct section_dump){ .info = { .position = position, .size = size } };
+		memcpy(section->file_name, file_name, sizeof(section->file_name));
+		memcpy(section->info.name, file_name, sizeof(section->info.name) - 1);
+		success = load_hashes(directory, section);
+	}
+
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
+
+static bool load_source(const char *path, struct source *source_out)
+{
+	struct stat st;
+	if (stat(path, &st) == -1) {
+		perror("stat() failed");
+		return false;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		return load_directory(path, source_out);
+	}
+
+	return load_live(path, NULL, NULL, 0, source_out);
+}
+
+static void free_source(struct source *source)
+{
+	for (size_t i = 0; i < source->sections_length; ++i) {
+		free(source->sections[i].hashes);
+	}
+}
+
+static const struct section_dump *find_dump(const struct source *source, const char *file_name)
+{
+	for (size_t i = 0; i < source->sections_length; ++i) {
+		if (!strcmp(source->sections[i].file_name, file_name)) {
+			return &source->sections[i];
+		}
+	}
+
+	return NULL;
+}
+
+static size_t diff_section(const struct section_dump *left, const struct section_dump *right)
+{
+	size_t pages = left->hashes_length > right->hashes_length ? left->hashes_length : right->hashes_length;
+	size_t differing = 0;
+	size_t range_start = 0;
+	bool in_range = false;
+	for (size_t i = 0; i <= pages; ++i) {
+		bool differs = i < pages && (i >= left->hashes_length || i >= right->hashes_length ||
+					     left->hashes[i] != right->hashes[i]);
+		if (differs && !in_range) {
+			range_start = i;
+			in_range = true;
+		} else if (!differs && in_range) {
+			printf("%s 0x%zx-0x%zx %zu pages\n", left->file_name, left->info.position + range_start * PAGE_SIZE,
+			       left->info.position + i * PAGE_SIZE, i - range_start);
+			differing += i - range_start;
+			in_range = false;
+		}
+	}
+
+	return differing;
+}
+
+static int diff(const char *left_path, const char *right_path)
+{
+	static struct source left;
+	static struct source right;
+	if (!load_source(left_path, &left) || !load_source(right_path, &right)) {
+		fprintf(stderr, "load_source() failed\n");
+		return 2;
+	}
+
+	size_t differing = 0;
+	for (size_t i = 0; i < left.sections_length; ++i) {
+		const struct section_dump *other = find_dump(&right, left.sections[i].file_name);
+		if (!other) {
+			printf("%s only in %s\n", left.sections[i].file_name, left_path);
+			++differing;
+			continue;
+		}
+		if (other->info.position != left.sections[i].info.position) {
+			printf("%s moved from 0x%zx to 0x%zx\n", left.sections[i].file_name, left.sections[i].info.position,
+			       other->info.position);
+		}
+		differing += diff_section(&left.sections[i], other);
+	}
+	for (size_t i = 0; i < right.sections_length; ++i) {
+		if (!find_dump(&left, right.sections[i].file_name)) {
+			printf("%s only in %s\n", right.sections[i].file_name, right_path);
+			++differing;
+		}
+	}
+
+	free_source(&left);
+	free_source(&right);
+
+	return differing ? 1 : 0;
+}
+
+static int dump(const char *mem_path, const char *directory, char **selected, int selected_length)
+{
+	if (mkdir(directory, 0755) == -1 && EEXIST != errno) {
+		perror("mkdir() failed");
+		return EXIT_FAILURE;
+	}
+
+	static struct source source;
+	bool success = load_live(mem_path, directory, selected, selected_length, &source);
+	for (size_t i = 0; success && i < source.sections_length; ++i) {
+		printf("%s 0x%zx %zu bytes\n", source.sections[i].file_name, source.sections[i].info.position,
+		       source.sections[i].info.size);
+	}
+	free_source(&source);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 4 && !strcmp(argv[1], "dump")) {
+		return dump(argv[2], argv[3], argv + 4, argc - 4);
+	}
+
+	if (argc == 4 && !strcmp(argv[1], "diff")) {
+		return diff(argv[2], argv[3]);
+	}
+
+	fprintf(stderr, "usage: %s dump <mem-file> <output-directory> [<section>...]\n", argv[0]);
+	fprintf(stderr, "       %s diff <directory-or-mem-file> <directory-or-mem-file>\n", argv[0]);
+
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,309 @@
+#define _POSIX_C_SOURCE 199309L
+
+// Differential fuzzer for the pattern scanners in src/scan.c.
+//
+// Generates random buffers and wildcard patterns, plants matches at page and chunk boundaries and at the end of the
+// buffer, and checks that every backend this CPU can run, and a lookup in the q-gram index of src/qgram.c, returns the
+// same first index as the reference one. Afterwards it reports the throughput of every backend on a large buffer with
+// the match at the very end, and what the index costs to build and how long a lookup takes in comparison.
+//
+// usage: scanfuzz [iterations] [seed]
+
+#include "../src/qgram.h"
+#include "../src/scan.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAGE_SIZE 4096
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_BUFFER_SIZE (4 * CHUNK_SIZE + 3 * PAGE_SIZE)
+#define MAX_PATTERN_LENGTH 48
+#define BENCH_BUFFER_SIZE (64 * 1024 * 1024)
+#define BENCH_ROUNDS 4
+
+enum placement {
+	PLACEMENT_NONE,
+	PLACEMENT_RANDOM,
+	PLACEMENT_PAGE_BOUNDARY,
+	PLACEMENT_CHUNK_BOUNDARY,
+	PLACEMENT_END,
+	PLACEMENT_LAST_REPORTED,
+	PLACEMENT_COUNT,
+};
+
+static uint64_t random_state = 0;
+
+static uint64_t random_next(void)
+{
+	// xorshift64*, good enough and reproducible across libcs.
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+
+	return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+static size_t random_below(size_t bound)
+{
+	return bound ? random_next() % bound : 0;
+}
+
+static void fill_buffer(uint8_t *buffer, size_t buffer_size)
+{
+	// A small alphabet makes partial matches common, which is where scanners tend to go wrong.
+	size_t alphabet = random_below(4) ? 2 + random_below(6) : 256;
+	for (size_t i = 0; i < buffer_size; ++i) {
+		buffer[i] = random_below(alphabet);
+	}
+}
+
+static void make_pattern(struct ignorable_byte *pattern, size_t pattern_length, const uint8_t *buffer,
+			 size_t buffer_size)
+{
+	size_t source = random_below(buffer_size - pattern_length);
+	unsigned ignored_percent = random_below(3) ? random_below(50) : 0;
+	for (size_t i = 0; i < pattern_length; ++i) {
+		pattern[i].is_ignored = random_below(100) < ignored_percent;
+		pattern[i].value = pattern[i].is_ignored ? 0 : buffer[source + i];
+	}
+	if (random_below(4) == 0) {
+		// Make sure the pattern is unlikely to occur anywhere unless it is planted.
+		size_t i = random_below(pattern_length);
+		pattern[i].is_ignored = false;
+		pattern[i].value = 0xff;
+	}
+}
+
+static void plant(const struct ignorable_byte *pattern, size_t pattern_length, uint8_t *buffer, size_t position)
+{
+	for (size_t i = 0; i < pattern_length; ++i) {
+		if (!pattern[i].is_ignored) {
+			buffer[position + i] = pattern[i].value;
+		}
+	}
+}
+
+static size_t pick_position(enum placement placement, size_t pattern_length, size_t buffer_size)
+{
+	size_t last = buffer_size - pattern_length;
+	size_t position = 0;
+	size_t boundary = 0;
+	switch (placement) {
+	case PLACEMENT_RANDOM:
+		return random_below(last + 1);
+	case PLACEMENT_PAGE_BOUNDARY:
+		boundary = PAGE_SIZE * (1 + random_below(buffer_size / PAGE_SIZE));
+		break;
+	case PLACEMENT_CHUNK_BOUNDARY:
+		boundary = CHUNK_SIZE * (1 + random_below(buffer_size / CHUNK_SIZE + 1));
+		break;
+	case PLACEMENT_END:
+		return last;
+	case PLACEMENT_LAST_REPORTED:
+		return last ? last - 1 : 0;
+	default:
+		return 0;
+	}
+
+	// Straddle the boundary, start right on it, or end right before it.
+	size_t shift = random_below(pattern_length + 1);
+	position = boundary > shift ? boundary - shift : 0;
+
+	return position > last ? last : position;
+}
+
+static bool run_case(uint8_t *buffer, struct ignorable_byte *pattern, uint64_t iteration)
+{
+	size_t buffer_size = 0;
+	switch (random_below(4)) {
+	case 0:
+		buffer_size = PAGE_SIZE * (1 + random_below(MAX_BUFFER_SIZE / PAGE_SIZE));
+		break;
+	case 1:
+		buffer_size = CHUNK_SIZE * (1 + random_below(MAX_BUFFER_SIZE / CHUNK_SIZE));
+		break;
+	default:
+		buffer_size = 1 + random_below(MAX_BUFFER_SIZE);
+	}
+	size_t pattern_length = 1 + random_below(MAX_PATTERN_LENGTH);
+	if (pattern_length >= buffer_size) {
+		pattern_length = buffer_size > 1 ? buffer_size - 1 : 1;
+	}
+	if (buffer_size <= pattern_length) {
+		return true;
+	}
+
+	fill_buffer(buffer, buffer_size);
+	make_pattern(pattern, pattern_length, buffer, buffer_size);
+	enum placement placement = random_below(PLACEMENT_COUNT);
+	if (placement != PLACEMENT_NONE) {
+		plant(pattern, pattern_length, buffer, pick_position(placement, pattern_length, buffer_size));
+	}
+
+	size_t expected_index = 0;
+	bool expected = scan_backends[0].find(pattern, pattern_length, buffer, buffer_size, &expected_index);
+	bool success = true;
+	for (size_t i = 1; i < scan_backends_length; ++i) {
+		if (!scan_backend_supported(&scan_backends[i])) {
+			continue;
+		}
+		size_t index = 0;
+		bool found = scan_backends[i].find(pattern, pattern_length, buffer, buffer_size, &index);
+		if (found != expected || (found && index != expected_index)) {
+			fprintf(stderr,
+				"iteration %" PRIu64 ": %s returned %s/%zu, %s returned %s/%zu (buffer %zu, pattern %zu, placement %d)\n",
+				iteration, scan_backends[0].name, expected ? "found" : "not found", expected_index,
+				scan_backends[i].name, found ? "found" : "not found", index, buffer_size, pattern_length,
+				placement);
+			success = false;
+		}
+	}
+
+	struct qgram_index index = { 0 };
+	if (!qgram_build(buffer, buffer_size, &index)) {
+		return false;
+	}
+	size_t qgram_index = 0;
+	bool qgram_found = qgram_find(&index, pattern, pattern_length, &qgram_index);
+	qgram_free(&index);
+	if (qgram_found != expected || (qgram_found && qgram_index != expected_index)) {
+		fprintf(stderr,
+			"iteration %" PRIu64 ": %s returned %s/%zu, qgram returned %s/%zu (buffer %zu, pattern %zu, placement %d)\n",
+			iteration, scan_backends[0].name, expected ? "found" : "not found", expected_index,
+			qgram_found ? "found" : "not found", qgram_index, buffer_size, pattern_length, placement);
+		success = false;
+	}
+
+	return success;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool bench(void)
+{
+	uint8_t *buffer = malloc(BENCH_BUFFER_SIZE);
+	if (!buffer) {
+		fprintf(stderr, "malloc() failed\n");
+		return false;
+	}
+
+	// Roughly the byte distribution of x86 code: plenty of the pattern's own bytes, but no match until the end.
+	static const uint8_t common_bytes[] = { 0x00, 0x0f, 0x48, 0x89, 0x8b, 0xc7, 0xe8, 0xf3, 0xff, 0x4c };
+	for (size_t i = 0; i < BENCH_BUFFER_SIZE; ++i) {
+		buffer[i] = random_below(2) ? common_bytes[random_below(sizeof(common_bytes))] : random_below(256);
+	}
+
+	static const struct ignorable_byte pattern[] = {
+		{ .is_ignored = false, .value = 0xf3 }, { .is_ignored = false, .value = 0x0f },
+		{ .is_ignored = false, .value = 0x58 }, { .is_ignored = true },
+		{ .is_ignored = false, .value = 0x0f }, { .is_ignored = false, .value = 0xc6 },
+		{ .is_ignored = true },			{ .is_ignored = false, .value = 0x00 },
+		{ .is_ignored = false, .value = 0x0f }, { .is_ignored = false, .value = 0x51 },
+		{ .is_ignored = true },			{ .is_ignored = false, .value = 0xfe },
+	};
+	size_t pattern_length = sizeof(pattern) / sizeof(struct ignorable_byte);
+	plant(pattern, pattern_length, buffer, BENCH_BUFFER_SIZE - pattern_length - 1);
+
+	bool success = true;
+	double scan_elapsed = 0;
+	for (size_t i = 0; i < scan_backends_length; ++i) {
+		if (!scan_backend_supported(&scan_backends[i])) {
+			printf("%-12s not supported by this CPU\n", scan_backends[i].name);
+			continue;
+		}
+		struct timespec start = { 0 };
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int round = 0; round < BENCH_ROUNDS; ++round) {
+			size_t index = 0;
+			if (!scan_backends[i].find(pattern, pattern_length, buffer, BENCH_BUFFER_SIZE, &index) ||
+			    index != BENCH_BUFFER_SIZE - pattern_length - 1) {
+				fprintf(stderr, "%s did not find the planted pattern\n", scan_backends[i].name);
+				success = false;
+				break;
+			}
+		}
+		double elapsed = seconds_since(&start);
+		if (&scan_backends[i] == scan_selected()) {
+			scan_elapsed = elapsed / BENCH_ROUNDS;
+		}
+		printf("%-12s %10.1f MiB/s\n", scan_backends[i].name,
+		       (double)BENCH_BUFFER_SIZE * BENCH_ROUNDS / (1024 * 1024) / elapsed);
+	}
+
+	// The index pays for itself once it is built and enough patterns are looked up in it.
+	struct timespec start = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct qgram_index index = { 0 };
+	if (!qgram_build(buffer, BENCH_BUFFER_SIZE, &index)) {
+		free(buffer);
+		return false;
+	}
+	double build_elapsed = seconds_since(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int round = 0; round < BENCH_ROUNDS; ++round) {
+		size_t found_index = 0;
+		if (!qgram_find(&index, pattern, pattern_length, &found_index) ||
+		    found_index != BENCH_BUFFER_SIZE - pattern_length - 1) {
+			fprintf(stderr, "qgram did not find the planted pattern\n");
+			success = false;
+			break;
+		}
+	}
+	double find_elapsed = seconds_since(&start) / BENCH_ROUNDS;
+	printf("%-12s %10.1f ms to build, %.3f ms per lookup against %.3f ms per %s scan\n", "qgram",
+	       build_elapsed * 1e3, find_elapsed * 1e3, scan_elapsed * 1e3, scan_selected()->name);
+	if (scan_elapsed > find_elapsed) {
+		printf("%-12s pays off from %.0f patterns on\n", "qgram", build_elapsed / (scan_elapsed - find_elapsed));
+	}
+	qgram_free(&index);
+
+	free(buffer);
+
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t iterations = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000;
+	uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : (uint64_t)time(NULL);
+	random_state = seed ? seed : 1;
+	printf("seed %" PRIu64 ", %" PRIu64 " iterations\n", seed, iterations);
+
+	uint8_t *buffer = malloc(MAX_BUFFER_SIZE);
+	if (!buffer) {
+		fprintf(stderr, "malloc() failed\n");
+		return EXIT_FAILURE;
+	}
+	struct ignorable_byte pattern[MAX_PATTERN_LENGTH] = { 0 };
+
+	uint64_t failures = 0;
+	for (uint64_t i = 0; i < iterations; ++i) {
+		if (!run_case(buffer, pattern, i)) {
+			++failures;
+		}
+	}
+	free(buffer);
+
+	if (failures) {
+		fprintf(stderr, "%" PRIu64 " of %" PRIu64 " iterations disagreed with the reference\n", failures,
+			iterations);
+		return EXIT_FAILURE;
+	}
+	printf("all backends agree with %s\n", scan_backends[0].name);
+
+	if (!bench()) {
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
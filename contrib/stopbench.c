@@ -0,0 +1,411 @@
+#define _GNU_SOURCE 1
+
+// Soak benchmark for how long patching keeps the game stopped.
+//
+// Forks a stand-in for the game that maps a small PE image with the fps patterns at IMAGE_BASE, shared with the
+// benchmark, and runs a few busy threads next to a heartbeat thread. Then it patches the stand-in again and again
+// through libsekiropatch. The longest gap between two heartbeats during a cycle is how long the game was stopped, a
+// stand-in that is still stopped a little while after a cycle is stuck. Last, a session is freed halfway through
+// patching and the stand-in writes to the pattern sites, which it doesn't survive if a watchpoint was left behind.
+// Exits with a failure when the p99 or the maximum stop is over budget, when anything got stuck, when a cycle failed
+// or when the stand-in didn't survive.
+//
+// usage: stopbench [cycles] [threads] [p99-budget-ms] [max-budget-ms]
+
+#include "../include/sekiropatch.h"
+#include "../src/common.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IMAGE_SIZE (2 * 1024 * 1024)
+#define TEXT_ADDRESS 0x1000
+#define TEXT_SIZE 0x100000
+#define RDATA_ADDRESS 0x101000
+#define RDATA_SIZE 0x1000
+#define FRAMELOCK_OFFSET 0x80000
+#define FRAMELOCK_LENGTH 10
+#define SPEED_FIX_OFFSET 0xa0000
+#define SPEED_FIX_VALUE_ADDRESS (RDATA_ADDRESS + 0x100)
+// Names the stand-in's profile.
+#define TIME_DATE_STAMP 0x5eb1e000
+#define HEARTBEAT_INTERVAL_NS 100000L
+#define CYCLE_TIMEOUT_SECONDS 10
+// How long a stand-in gets to run again after a cycle before it counts as stuck.
+#define STUCK_GRACE_MS 50
+
+struct heartbeat {
+	_Atomic uint64_t last_ns;
+	_Atomic uint64_t longest_gap_ns;
+	// Has the main thread write to the framelock site on every beat.
+	_Atomic bool touch_site;
+};
+
+struct outcomes {
+	double *stops_ms;
+	double *patches_ms;
+	size_t length;
+	size_t stuck;
+	size_t failed;
+};
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double left = *(const double *)a;
+	double right = *(const double *)b;
+
+	return (left > right) - (left < right);
+}
+
+// Just enough of a PE image for find_sections() plus what set-fps looks for, the patches don't destroy the patterns
+// so the same image can be patched over and over.
+static void build_image(uint8_t *image)
+{
+	memset(image, 0xcc, IMAGE_SIZE);
+
+	image[0] = 'M';
+	image[1] = 'Z';
+	uint32_t coff_offset = 0x80;
+	memcpy(image + 0x3c, &coff_offset, sizeof(coff_offset));
+
+	uint8_t *coff = image + coff_offset;
+	memset(coff, 0, 24 + 0xf0 + 2 * 40);
+	memcpy(coff, "PE\0\0", 4);
+	uint16_t machine = 0x8664;
+	uint16_t sections = 2;
+	uint32_t time_date_stamp = TIME_DATE_STAMP;
+	uint16_t optional_size = 0xf0;
+	uint16_t optional_magic = 0x20b;
+	memcpy(coff + 4, &machine, sizeof(machine));
+	memcpy(coff + 6, &sections, sizeof(sections));
+	memcpy(coff + 8, &time_date_stamp, sizeof(time_date_stamp));
+	memcpy(coff + 20, &optional_size, sizeof(optional_size));
+	memcpy(coff + 24, &optional_magic, sizeof(optional_magic));
+
+	struct {
+		char name[8];
+		uint32_t size;
+		uint32_t address;
+		uint8_t ignored[24];
+	} headers[2] = {
+		{ .name = ".text", .size = TEXT_SIZE, .address = TEXT_ADDRESS },
+		{ .name = ".rdata", .size = RDATA_SIZE, .address = RDATA_ADDRESS },
+	};
+	memcpy(coff + 24 + optional_size, headers, sizeof(headers));
+
+	uint8_t framelock[FRAMELOCK_LENGTH] = { 0xc7, 0x43, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4c, 0x89, 0xab };
+	float delta_time = 1.0f / 60.0f;
+	memcpy(framelock + 3, &delta_time, sizeof(delta_time));
+	memcpy(image + TEXT_ADDRESS + FRAMELOCK_OFFSET, framelock, sizeof(framelock));
+
+	uint8_t speed_fix[] = { 0xf3, 0x0f, 0x58, 0xc1, 0x0f, 0xc6, 0xc0, 0x00, 0x0f, 0x51, 0xc0,
+				0xf3, 0x0f, 0x59, 0x05, 0x00, 0x00, 0x00, 0x00, 0x0f, 0x2f };
+	int32_t relative = SPEED_FIX_VALUE_ADDRESS - (TEXT_ADDRESS + SPEED_FIX_OFFSET + 15 + 4);
+	memcpy(speed_fix + 15, &relative, sizeof(relative));
+	memcpy(image + TEXT_ADDRESS + SPEED_FIX_OFFSET, speed_fix, sizeof(speed_fix));
+	float speed = 30.0f;
+	memcpy(image + SPEED_FIX_VALUE_ADDRESS, &speed, sizeof(speed));
+}
+
+static void *busy_thread(void *data)
+{
+	(void)data;
+	volatile uint64_t work = 0;
+	for (;;) {
+		for (int i = 0; i < 100000; ++i) {
+			work += i;
+		}
+		sched_yield();
+	}
+
+	return NULL;
+}
+
+static void *heartbeat_thread(void *data)
+{
+	struct heartbeat *heartbeat = data;
+	struct timespec interval = { .tv_nsec = HEARTBEAT_INTERVAL_NS };
+	for (;;) {
+		uint64_t now_ns = monotonic_ns();
+		uint64_t gap_ns = now_ns - atomic_exchange(&heartbeat->last_ns, now_ns);
+		if (gap_ns > atomic_load(&heartbeat->longest_gap_ns)) {
+			atomic_store(&heartbeat->longest_gap_ns, gap_ns);
+		}
+		// The same bytes again, a write watchpoint fires all the same.
+		if (atomic_load(&heartbeat->touch_site)) {
+			volatile uint8_t *site = (volatile uint8_t *)(IMAGE_BASE + TEXT_ADDRESS + FRAMELOCK_OFFSET);
+			for (size_t i = 0; i < FRAMELOCK_LENGTH; ++i) {
+				site[i] = site[i];
+			}
+		}
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+static pid_t spawn_stand_in(struct heartbeat *heartbeat, long threads)
+{
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork() failed");
+		return -1;
+	}
+	if (pid) {
+		return pid;
+	}
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	prctl(PR_SET_NAME, "sekiro.exe");
+	atomic_store(&heartbeat->last_ns, monotonic_ns());
+	pthread_t thread;
+	for (long i = 0; i < threads; ++i) {
+		if (pthread_create(&thread, NULL, busy_thread, NULL)) {
+			_exit(EXIT_FAILURE);
+		}
+	}
+	heartbeat_thread(heartbeat);
+	_exit(EXIT_SUCCESS);
+}
+
+static bool run_session(struct sekiropatch *session, pid_t pid)
+{
+	if (!sekiropatch_set_timeout(session, CYCLE_TIMEOUT_SECONDS) || !sekiropatch_set_cache(session, true) ||
+	    !sekiropatch_set_fps(session, 144.0f) || !sekiropatch_start(session, pid)) {
+		return false;
+	}
+
+	enum sekiropatch_status status = SEKIROPATCH_PENDING;
+	while (SEKIROPATCH_PENDING == status) {
+		struct pollfd pollfd = { .fd = sekiropatch_fd(session), .events = POLLIN };
+		if (poll(&pollfd, 1, -1) == -1 && EINTR != errno) {
+			perror("poll() failed");
+			return false;
+		}
+		status = sekiropatch_poll(session);
+	}
+	if (SEKIROPATCH_FAILED == status) {
+		fprintf(stderr, "cycle failed: %s\n", sekiropatch_error(session));
+	}
+
+	return SEKIROPATCH_DONE == status;
+}
+
+static char process_state(pid_t pid)
+{
+	char path[64] = "";
+	snprintf(path, sizeof(path), "/proc/%ld/stat", (long)pid);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return '?';
+	}
+
+	char stat[512] = "";
+	size_t read_size = fread(stat, 1, sizeof(stat) - 1, f);
+	fclose(f);
+	stat[read_size] = '\0';
+	const char *comm_end = strrchr(stat, ')');
+
+	return comm_end && comm_end[1] == ' ' ? comm_end[2] : '?';
+}
+
+static void run_cycle(struct heartbeat *heartbeat, pid_t pid, struct outcomes *outcomes)
+{
+	struct sekiropatch *session = sekiropatch_new();
+	if (!session) {
+		fprintf(stderr, "sekiropatch_new() failed\n");
+		outcomes->failed += 1;
+		return;
+	}
+
+	atomic_store(&heartbeat->longest_gap_ns, 0);
+	uint64_t start_ns = monotonic_ns();
+	bool success = run_session(session, pid);
+	uint64_t patched_ns = monotonic_ns();
+	sekiropatch_free(session);
+
+	struct timespec grace = { .tv_nsec = STUCK_GRACE_MS * 1000000L };
+	while (nanosleep(&grace, &grace) == -1 && EINTR == errno);
+
+	char state = process_state(pid);
+	if ('T' == state || 't' == state) {
+		outcomes->stuck += 1;
+		fprintf(stderr, "cycle %zu left the stand-in stopped\n", outcomes->length + outcomes->failed);
+		kill(pid, SIGCONT);
+	}
+	if (!success) {
+		outcomes->failed += 1;
+		return;
+	}
+
+	outcomes->stops_ms[outcomes->length] = atomic_load(&heartbeat->longest_gap_ns) / 1e6;
+	outcomes->patches_ms[outcomes->length] = (patched_ns - start_ns) / 1e6;
+	outcomes->length += 1;
+}
+
+// Once the profile knows where the patterns are, starting a session sets watchpoints on them in the stand-in's main
+// thread, which then writes to one of the sites after the session was freed without ever being polled.
+static bool run_abandoned_cycle(struct heartbeat *heartbeat, pid_t pid)
+{
+	struct sekiropatch *session = sekiropatch_new();
+	if (!session) {
+		fprintf(stderr, "sekiropatch_new() failed\n");
+		return false;
+	}
+	bool started = sekiropatch_set_timeout(session, CYCLE_TIMEOUT_SECONDS) && sekiropatch_set_cache(session, true) &&
+		       sekiropatch_set_fps(session, 144.0f) && sekiropatch_start(session, pid);
+	sekiropatch_free(session);
+	if (!started) {
+		fprintf(stderr, "could not start the abandoned cycle\n");
+		return false;
+	}
+
+	atomic_store(&heartbeat->touch_site, true);
+	struct timespec grace = { .tv_nsec = STUCK_GRACE_MS * 1000000L };
+	while (nanosleep(&grace, &grace) == -1 && EINTR == errno);
+	atomic_store(&heartbeat->touch_site, false);
+
+	int wstatus = 0;
+	if (waitpid(pid, &wstatus, WNOHANG) == pid) {
+		fprintf(stderr, "the stand-in died of %s after a session was freed halfway through patching\n",
+			WIFSIGNALED(wstatus) ? strsignal(WTERMSIG(wstatus)) : "exiting");
+		return false;
+	}
+	char state = process_state(pid);
+	if ('T' == state || 't' == state) {
+		fprintf(stderr, "the abandoned cycle left the stand-in stopped\n");
+		kill(pid, SIGCONT);
+		return false;
+	}
+
+	return true;
+}
+
+static void print_distribution(const char *name, double *values, size_t length)
+{
+	qsort(values, length, sizeof(double), compare_doubles);
+	printf("%-10s p50 %9.3f p99 %9.3f max %9.3f\n", name, values[length / 2],
+	       values[(size_t)((length - 1) * 0.99 + 0.5)], values[length - 1]);
+}
+
+// Keeps the profiles of the stand-in out of the real cache.
+static bool use_temporary_cache(char *directory)
+{
+	if (!mkdtemp(directory)) {
+		perror("mkdtemp() failed");
+		return false;
+	}
+	if (setenv("XDG_CACHE_HOME", directory, 1) == -1) {
+		perror("setenv() failed");
+		return false;
+	}
+
+	return true;
+}
+
+static void remove_temporary_cache(const char *directory)
+{
+	char path[256] = "";
+	snprintf(path, sizeof(path), "%s/sekirofpsunlock/%08x.profile", directory, TIME_DATE_STAMP);
+	remove(path);
+	snprintf(path, sizeof(path), "%s/sekirofpsunlock/%08x.pages", directory, TIME_DATE_STAMP);
+	remove(path);
+	snprintf(path, sizeof(path), "%s/sekirofpsunlock/latest", directory);
+	remove(path);
+	snprintf(path, sizeof(path), "%s/sekirofpsunlock", directory);
+	remove(path);
+	remove(directory);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t cycles = argc > 1 ? strtoull(argv[1], NULL, 10) : 200;
+	long threads = argc > 2 ? strtol(argv[2], NULL, 10) : 8;
+	double p99_budget_ms = argc > 3 ? strtod(argv[3], NULL) : 50.0;
+	double max_budget_ms = argc > 4 ? strtod(argv[4], NULL) : 100.0;
+	if (!cycles || threads < 0) {
+		fprintf(stderr, "usage: %s [cycles] [threads] [p99-budget-ms] [max-budget-ms]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	char cache[] = "/tmp/stopbench-XXXXXX";
+	if (!use_temporary_cache(cache)) {
+		return EXIT_FAILURE;
+	}
+
+	// Mapped before the fork, so the stand-in has the image where the game has it and both see the same heartbeat.
+	uint8_t *image = mmap((void *)IMAGE_BASE, IMAGE_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	struct heartbeat *heartbeat =
+		mmap(NULL, sizeof(struct heartbeat), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	struct outcomes outcomes = {
+		.stops_ms = calloc(cycles, sizeof(double)),
+		.patches_ms = calloc(cycles, sizeof(double)),
+	};
+	if (image != (void *)IMAGE_BASE || heartbeat == MAP_FAILED || !outcomes.stops_ms || !outcomes.patches_ms) {
+		fprintf(stderr, "failed to set up the stand-in's memory\n");
+		remove_temporary_cache(cache);
+		return EXIT_FAILURE;
+	}
+	build_image(image);
+
+	pid_t pid = spawn_stand_in(heartbeat, threads);
+	if (pid == -1) {
+		remove_temporary_cache(cache);
+		return EXIT_FAILURE;
+	}
+	printf("%zu cycles against a stand-in with %ld busy threads\n", cycles, threads);
+	fflush(stdout);
+
+	for (size_t i = 0; i < cycles; ++i) {
+		run_cycle(heartbeat, pid, &outcomes);
+	}
+	bool survived = run_abandoned_cycle(heartbeat, pid);
+
+	kill(pid, SIGKILL);
+	while (waitpid(pid, NULL, 0) == -1 && EINTR == errno);
+	remove_temporary_cache(cache);
+
+	bool success = !outcomes.stuck && !outcomes.failed && outcomes.length && survived;
+	if (outcomes.length) {
+		print_distribution("stop-ms", outcomes.stops_ms, outcomes.length);
+		print_distribution("patch-ms", outcomes.patches_ms, outcomes.length);
+		double p99_ms = outcomes.stops_ms[(size_t)((outcomes.length - 1) * 0.99 + 0.5)];
+		double max_ms = outcomes.stops_ms[outcomes.length - 1];
+		if (p99_ms > p99_budget_ms) {
+			printf("p99 stop of %.3f ms is over the budget of %.3f ms\n", p99_ms, p99_budget_ms);
+			success = false;
+		}
+		if (max_ms > max_budget_ms) {
+			printf("longest stop of %.3f ms is over the budget of %.3f ms\n", max_ms, max_budget_ms);
+			success = false;
+		}
+	}
+	printf("stuck %zu failed %zu abandoned %s\n", outcomes.stuck, outcomes.failed, survived ? "ok" : "failed");
+
+	free(outcomes.stops_ms);
+	free(outcomes.patches_ms);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,105 @@
+#define _POSIX_C_SOURCE 200809L
+
+// Prints a trace written by SEKIROFPSUNLOCK_TRACE as text, one event per line with the milliseconds since the first
+// one and the time since the previous one.
+//
+// usage: tracedecode <trace-file>
+
+#include "../src/loop.h"
+#include "../src/trace.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *status_names[] = {
+	[LOOP_CONTINUE] = "continue",
+	[LOOP_DONE] = "done",
+	[LOOP_FAILED] = "failed",
+	[LOOP_TIMEOUT] = "timeout",
+	[LOOP_INTERRUPTED] = "interrupted",
+	[LOOP_EXITED] = "exited",
+};
+
+static void print_record(const struct trace_record *record, uint64_t first_ns, uint64_t previous_ns)
+{
+	printf("%12.6f ms %+11.6f ms  ", (record->ns - first_ns) / 1e6, (record->ns - previous_ns) / 1e6);
+
+	const struct trace_event_info *info = trace_event_info(record->event);
+	if (!info) {
+		printf("unknown-%" PRIu32 "\n", record->event);
+		return;
+	}
+	printf("%-9s", info->name);
+
+	for (size_t i = 0; i < TRACE_ARGS && info->args[i]; ++i) {
+		uint64_t value = record->args[i];
+		if (TRACE_STEP_END == record->event && value < sizeof(status_names) / sizeof(status_names[0])) {
+			printf(" %s=%s", info->args[i], status_names[value]);
+		} else if (info->hex & (1U << i)) {
+			printf(" %s=0x%" PRIx64, info->args[i], value);
+		} else {
+			printf(" %s=%" PRIu64, info->args[i], value);
+		}
+	}
+	putchar('\n');
+}
+
+static bool decode(FILE *in, const char *name)
+{
+	struct trace_header header;
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))) {
+		fprintf(stderr, "%s is not a trace\n", name);
+		return false;
+	}
+	if (header.version != TRACE_VERSION || header.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s is version %" PRIu32 " with %" PRIu32 " byte records, this reads version %d with %zu\n",
+			name, header.version, header.record_size, TRACE_VERSION, sizeof(struct trace_record));
+		return false;
+	}
+	if (header.dropped) {
+		printf("%" PRIu64 " older events were overwritten\n", header.dropped);
+	}
+
+	uint64_t first_ns = 0;
+	uint64_t previous_ns = 0;
+	for (uint64_t i = 0; i < header.records_length; ++i) {
+		struct trace_record record;
+		if (fread(&record, sizeof(record), 1, in) != 1) {
+			fprintf(stderr, "%s ends after %" PRIu64 " of %" PRIu64 " events\n", name, i, header.records_length);
+			return false;
+		}
+		if (!i) {
+			first_ns = record.ns;
+			previous_ns = record.ns;
+		}
+		print_record(&record, first_ns, previous_ns);
+		previous_ns = record.ns;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace-file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if (!in) {
+		perror("fopen() failed");
+		return EXIT_FAILURE;
+	}
+
+	bool success = decode(in, argv[1]);
+
+	if (fclose(in) == EOF) {
+		perror("fclose() failed");
+		return EXIT_FAILURE;
+	}
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Patches Sekiro from inside another program, the sekirofpsunlock command is built on top of this.
+//
+// A session finds the game (or takes its pid), attaches to it, waits for every requested patch site to show up, applies
+// the patches and detaches again. Add the descriptor from sekiropatch_fd() to your own event loop and call
+// sekiropatch_poll() whenever it is readable, until it stops returning SEKIROPATCH_PENDING. Waiting is left to your
+// loop, but the calls do block for short stretches. They wait for the game to stop when attaching and before each
+// write, which usually takes well under a millisecond. sekiropatch_poll() also reads the game's memory, a few
+// milliseconds per section.
+//
+// The game is traced with ptrace() while a session runs, so all calls have to come from the same thread and the
+// program must not reap it with waitpid(-1, ...) in the meantime. Diagnostics go to stderr, sekiropatch_error()
+// sums up why a session failed. Nothing touches the filesystem or the process' exit handlers unless
+// sekiropatch_set_cache() or sekiropatch_enable_tracing() ask for it.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sekiropatch;
+
+enum sekiropatch_status {
+	SEKIROPATCH_PENDING,
+	SEKIROPATCH_DONE,
+	SEKIROPATCH_FAILED,
+};
+
+struct sekiropatch *sekiropatch_new(void);
+// Lets the game go if the session is still attached to it.
+void sekiropatch_free(struct sekiropatch *session);
+
+// How long to wait for the game and for each patch site, 30 seconds unless set.
+bool sekiropatch_set_timeout(struct sekiropatch *session, time_t seconds);
+// Patches are applied in the order they are added, all of them before sekiropatch_start().
+bool sekiropatch_set_fps(struct sekiropatch *session, float fps);
+bool sekiropatch_set_resolution(struct sekiropatch *session, uint32_t screen_width, uint32_t game_width,
+				uint32_t game_height);
+// Off unless set. Reads and writes $XDG_CACHE_HOME/sekirofpsunlock (~/.cache/sekirofpsunlock by default): the unpack
+// profile of each game build and its .pages file, the `latest` symlink to the last one used, and the scan kernel
+// stored by `sekirofpsunlock self-bench`. Later launches idle until the patterns are due and look for them where
+// they were last time.
+bool sekiropatch_set_cache(struct sekiropatch *session, bool enabled);
+// Keeps a trace of the patching for the whole process if SEKIROFPSUNLOCK_TRACE names a file, and writes it there
+// from an atexit() handler. The handler can't be taken back, so the library must not be dlclose()d after this.
+void sekiropatch_enable_tracing(void);
+
+// Starts with pid, or looks for the game first when pid is 0. With a pid, it attaches right away and waits for the
+// game to stop.
+bool sekiropatch_start(struct sekiropatch *session, pid_t pid);
+// Readable whenever sekiropatch_poll() has something to do.
+int sekiropatch_fd(const struct sekiropatch *session);
+enum sekiropatch_status sekiropatch_poll(struct sekiropatch *session);
+
+// The game's pid once it was found, 0 before.
+pid_t sekiropatch_pid(const struct sekiropatch *session);
+// Why the session failed, an empty string if it didn't.
+const char *sekiropatch_error(const struct sekiropatch *session);
+
+#ifdef __cplusplus
+}
+#endif
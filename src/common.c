@@ -1,17 +1,16 @@
-#define _POSIX_C_SOURCE 1
+#define _POSIX_C_SOURCE 200809L
 
 #include "common.h"
 
+#include "trace.h"
+
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
 #include <inttypes.h>
-#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
-
-#define IMAGE_BASE 0x140000000
+#include <unistd.h>
 
 struct dos_header {
 	uint16_t magic;
@@ -74,18 +73,6 @@ static bool string_to_uintmax(const char *s, int base, uintmax_t *value_out)
 	return true;
 }
 
-static bool same_pattern(const struct ignorable_byte *pattern_bytes, const size_t pattern_bytes_length, const uint8_t *bytes, const size_t bytes_length)
-{
-	for (size_t i = 0; i < pattern_bytes_length && i < bytes_length; ++i) {
-		const struct ignorable_byte ignorable_byte = pattern_bytes[i];
-		if (!ignorable_byte.is_ignored && bytes[i] != ignorable_byte.value) {
-			return false;
-		}
-	}
-
-	return true;
-}
-
 bool string_to_uint32(const char *s, int base, uint32_t *value_out)
 {
        uintmax_t large = 0;
@@ -104,34 +91,41 @@ bool string_to_uint32(const char *s, int base, uint32_t *value_out)
        return true;
 }
 
-bool find_section_info(const char *name, FILE *f, size_t *position_out, size_t *size_out)
+static bool read_coff_header(FILE *f, struct dos_header *dos_header_out, struct coff_header *coff_header_out)
 {
-	size_t name_length = strlen(name);
-	assert(name_length < 9);
-
-	struct dos_header dos_header = { 0 };
-	if (!seek_and_read_bytes((uint8_t *)&dos_header, sizeof(dos_header), IMAGE_BASE, f)) {
+	if (!seek_and_read_bytes((uint8_t *)dos_header_out, sizeof(*dos_header_out), IMAGE_BASE, f)) {
 		fprintf(stderr, "failed to read dos header\n");
 		return false;
 	}
 
-	if (dos_header.magic != 0x5a4d) {
+	if (dos_header_out->magic != 0x5a4d) {
 		fprintf(stderr, "dos magic does not match\n");
 		return false;
 	}
 
-	struct coff_header coff_header = { 0 };
-	if (!seek_and_read_bytes((uint8_t *)&coff_header, sizeof(coff_header),
-				 IMAGE_BASE + dos_header.coff_header_offset, f)) {
+	if (!seek_and_read_bytes((uint8_t *)coff_header_out, sizeof(*coff_header_out),
+				 IMAGE_BASE + dos_header_out->coff_header_offset, f)) {
 		fprintf(stderr, "failed to read coff header\n");
 		return false;
 	}
 
-	if (coff_header.signature != 0x4550) {
+	if (coff_header_out->signature != 0x4550) {
 		fprintf(stderr, "pe signature does not match\n");
 		return false;
 	}
 
+	return true;
+}
+
+bool find_sections(FILE *f, struct section_info *sections_out, size_t sections_capacity, size_t *sections_length_out)
+{
+	struct dos_header dos_header = { 0 };
+	struct coff_header coff_header = { 0 };
+	if (!read_coff_header(f, &dos_header, &coff_header)) {
+		fprintf(stderr, "read_coff_header() failed\n");
+		return false;
+	}
+
 	struct coff_optional_header coff_optional_header = { 0 };
 	if (!seek_and_read_bytes((uint8_t *)&coff_optional_header, sizeof(coff_optional_header),
 				 IMAGE_BASE + dos_header.coff_header_offset + sizeof(coff_header), f)) {
@@ -144,6 +138,11 @@ bool find_section_info(const char *name, FILE *f, size_t *position_out, size_t *
 		return false;
 	}
 
+	if (coff_header.number_of_sections > sections_capacity) {
+		fprintf(stderr, "image has %u sections, only %zu fit\n", coff_header.number_of_sections, sections_capacity);
+		return false;
+	}
+
 	struct section_header section_header = { 0 };
 	for (uint16_t i = 0; i < coff_header.number_of_sections; ++i) {
 		if (!seek_and_read_bytes((uint8_t *)&section_header, sizeof(section_header),
@@ -154,53 +153,54 @@ bool find_section_info(const char *name, FILE *f, size_t *position_out, size_t *
 			return false;
 		}
 
-		if (!strncmp(name, section_header.name, name_length)) {
-			*size_out = section_header.virtual_size;
-			*position_out = IMAGE_BASE + section_header.virtual_address;
-
-			return true;
-		}
+		memset(sections_out[i].name, 0, sizeof(sections_out[i].name));
+		memcpy(sections_out[i].name, section_header.name, sizeof(section_header.name));
+		sections_out[i].size = section_header.virtual_size;
+		sections_out[i].position = IMAGE_BASE + section_header.virtual_address;
 	}
-	fprintf(stderr, "couldn't find section with name %s\n", name);
+	*sections_length_out = coff_header.number_of_sections;
 
-	return false;
+	return true;
 }
 
-bool find_pattern(const struct ignorable_byte *pattern_bytes, const size_t pattern_bytes_length, FILE *f, uint8_t *buffer, size_t buffer_size, size_t section_position, size_t *index_out)
+// The link time of the image, it tells game builds apart.
+bool find_time_date_stamp(FILE *f, uint32_t *time_date_stamp_out)
 {
-	if (!seek_and_read_bytes(buffer, buffer_size, section_position, f)) {
-		fprintf(stderr, "seek_and_read_bytes() failed\n");
+	struct dos_header dos_header = { 0 };
+	struct coff_header coff_header = { 0 };
+	if (!read_coff_header(f, &dos_header, &coff_header)) {
+		fprintf(stderr, "read_coff_header() failed\n");
 		return false;
 	}
 
-	for (size_t i = 0; i + pattern_bytes_length < buffer_size; ++i) {
-		if (same_pattern(pattern_bytes, pattern_bytes_length, buffer + i, buffer_size - i)) {
-			*index_out = i;
-			return true;
-		}
-	}
+	*time_date_stamp_out = coff_header.time_date_stamp;
 
-	return false;
+	return true;
 }
 
-bool stop_and_wait(struct context *context)
+bool find_section_info(const char *name, FILE *f, size_t *position_out, size_t *size_out)
 {
-	if (kill(context->pid, SIGSTOP) == -1) {
-		perror("kill() failed");
+	size_t name_length = strlen(name);
+	assert(name_length < 9);
+
+	struct section_info sections[MAX_SECTIONS];
+	size_t sections_length = 0;
+	if (!find_sections(f, sections, MAX_SECTIONS, &sections_length)) {
+		fprintf(stderr, "find_sections() failed\n");
 		return false;
 	}
 
-	static_assert(!WIFSTOPPED(0), "WIFSTOPPED triggered on 0");
-	int wstatus = 0;
-	while (!WIFSTOPPED(wstatus)) {
-		pid_t pid_waited = waitpid(context->pid, &wstatus, 0);
-		if (pid_waited != context->pid) {
-			perror("waitpid() failed");
-			return false;
+	for (size_t i = 0; i < sections_length; ++i) {
+		if (!strncmp(name, sections[i].name, name_length)) {
+			*size_out = sections[i].size;
+			*position_out = sections[i].position;
+
+			return true;
 		}
 	}
+	fprintf(stderr, "couldn't find section with name %s\n", name);
 
-	return true;
+	return false;
 }
 
 bool seek_and_read_bytes(uint8_t *destination, size_t destination_length, size_t position, FILE *f)
@@ -229,7 +229,26 @@ bool seek_and_read_bytes(uint8_t *destination, size_t destination_length, size_t
 	return true;
 }
 
-bool seek_and_write_bytes(uint8_t *source, size_t source_length, size_t position, FILE *f) {
+FILE *open_process_memory(pid_t pid)
+{
+	char path[64] = "";
+	long pid_long = pid;
+	int written = snprintf(path, sizeof(path), "/proc/%ld/mem", pid_long);
+	if (written < 0 || (size_t)written >= sizeof(path)) {
+		fprintf(stderr, "snprintf() failed\n");
+		return NULL;
+	}
+
+	FILE *f = fopen(path, "r+");
+	if (!f) {
+		perror("fopen() failed");
+		return NULL;
+	}
+
+	return f;
+}
+
+bool seek_and_write_bytes(const uint8_t *source, size_t source_length, size_t position, FILE *f) {
 	long position_long = 0;
 	if (!size_t_to_long(position, &position_long)) {
 		fprintf(stderr, "size_t_to_long() failed\n");
@@ -242,15 +261,114 @@ bool seek_and_write_bytes(uint8_t *source, size_t source_length, size_t position
 	}
 
 	size_t written = fwrite(source, sizeof(uint8_t), source_length, f);
+	trace_emit(TRACE_WRITE, position, source_length, written == source_length);
 	if (written < source_length) {
 		if (feof(f)) {
 			fprintf(stderr, "fwrite() reached end-of-file unexpectedly\n");
 		} else {
 			fprintf(stderr, "fwrite() failed\n");
 		}
-		fprintf(stderr, "it's possible that the process is corrupted now, you should restart the game\n");
+		return false;
+	}
+	// The game may be running again before the stream would flush itself, and sections are read around it.
+	if (fflush(f) == EOF) {
+		perror("fflush() failed");
 		return false;
 	}
 
 	return true;
 }
+
+// What is in memory right now. The stream may still hold what an earlier read left in its buffer, so it is read around
+// when it has a descriptor. Snapshots don't, and their reads are never stale.
+static bool read_current(uint8_t *destination, size_t destination_length, size_t position, FILE *f)
+{
+	int fd = fileno(f);
+	if (fd == -1) {
+		return seek_and_read_bytes(destination, destination_length, position, f);
+	}
+
+	size_t done = 0;
+	while (done < destination_length) {
+		ssize_t read_size = pread(fd, destination + done, destination_length - done, position + done);
+		if (read_size == -1 && EINTR == errno) {
+			continue;
+		}
+		if (read_size <= 0) {
+			if (read_size == -1) {
+				perror("pread() failed");
+			} else {
+				fprintf(stderr, "pread() reached end-of-file unexpectedly\n");
+			}
+			return false;
+		}
+		done += read_size;
+	}
+
+	return true;
+}
+
+bool journal_write(struct write_journal *journal, const void *source, size_t source_length, size_t position, FILE *f)
+{
+	if (!journal) {
+		if (!seek_and_write_bytes(source, source_length, position, f)) {
+			fprintf(stderr, "it's possible that the process is corrupted now, you should restart the game\n");
+			return false;
+		}
+		return true;
+	}
+
+	if (journal->length == MAX_JOURNAL_ENTRIES || source_length > MAX_JOURNAL_BYTES) {
+		fprintf(stderr, "can't note what a write of %zu bytes overwrites, not writing\n", source_length);
+		return false;
+	}
+	struct journal_entry *entry = &journal->entries[journal->length];
+	if (!read_current(entry->bytes, source_length, position, f)) {
+		fprintf(stderr, "read_current() failed\n");
+		return false;
+	}
+	entry->position = position;
+	entry->length = source_length;
+	memcpy(entry->written, source, source_length);
+	// A write that failed may have gotten partway, so it is undone too.
+	journal->length += 1;
+
+	return seek_and_write_bytes(source, source_length, position, f);
+}
+
+bool journal_rollback(struct write_journal *journal, FILE *f)
+{
+	bool success = true;
+	for (size_t i = journal->length; i > 0; --i) {
+		const struct journal_entry *entry = &journal->entries[i - 1];
+		success = seek_and_write_bytes(entry->bytes, entry->length, entry->position, f) && success;
+	}
+	journal->length = 0;
+	if (!success) {
+		fprintf(stderr, "it's possible that the process is corrupted now, you should restart the game\n");
+	}
+
+	return success;
+}
+
+void journal_keep(const struct write_journal *journal, struct patch_targets *targets)
+{
+	for (size_t i = 0; i < journal->length; ++i) {
+		const struct journal_entry *entry = &journal->entries[i];
+		size_t j = 0;
+		while (j < targets->patched_length && (targets->patched[j].position != entry->position ||
+						       targets->patched[j].length != entry->length)) {
+			++j;
+		}
+		if (j == MAX_JOURNAL_ENTRIES) {
+			fprintf(stderr, "more than %d writes to keep track of, dropping the one at 0x%zx\n", MAX_JOURNAL_ENTRIES,
+				entry->position);
+			continue;
+		}
+		struct patched_bytes *patched = &targets->patched[j];
+		patched->position = entry->position;
+		patched->length = entry->length;
+		memcpy(patched->bytes, entry->written, entry->length);
+		targets->patched_length += j == targets->patched_length;
+	}
+}
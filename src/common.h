@@ -6,20 +6,82 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#define IMAGE_BASE 0x140000000
+#define MAX_SECTIONS 96
+// Every write of a plan fits, with room to spare.
+#define MAX_JOURNAL_ENTRIES 32
+#define MAX_JOURNAL_BYTES 8
+
 struct ignorable_byte {
 	bool is_ignored;
 	uint8_t value;
 };
 
+struct section_info {
+	char name[9];
+	size_t position;
+	size_t size;
+};
+
+// What one write left in the game's memory.
+struct patched_bytes {
+	size_t position;
+	size_t length;
+	uint8_t bytes[MAX_JOURNAL_BYTES];
+};
+
+// Where the patches wrote the values that can still be changed while the game runs, positions in the game's memory.
+// 0 for the ones that weren't written.
+struct patch_targets {
+	size_t framelock;
+	size_t speed_fix;
+	size_t resolution;
+	// Every write of the stops that were kept, the last one for each position.
+	struct patched_bytes patched[MAX_JOURNAL_ENTRIES];
+	size_t patched_length;
+};
+
+struct journal_entry {
+	size_t position;
+	size_t length;
+	uint8_t bytes[MAX_JOURNAL_BYTES];
+	uint8_t written[MAX_JOURNAL_BYTES];
+};
+
+// What the writes of one stop overwrote, so a stop that goes wrong can be undone before the game runs again.
+struct write_journal {
+	struct journal_entry entries[MAX_JOURNAL_ENTRIES];
+	size_t length;
+};
+
+struct loop;
+struct unpack_profile;
+
 struct context {
 	FILE *f;
-	pid_t pid;
+	// Watches nothing when replaying a snapshot, there is no process to stop then.
+	struct loop *loop;
 	time_t timeout;
+	// NULL when there is nothing to learn from or to predict with.
+	struct unpack_profile *profile;
+	// NULL when nothing gets rewritten later.
+	struct patch_targets *targets;
+	// Where writes note what they overwrite, NULL when they can't be undone.
+	struct write_journal *journal;
 };
 
 bool string_to_uint32(const char *s, int base, uint32_t *value_out);
+bool find_sections(FILE *f, struct section_info *sections_out, size_t sections_capacity, size_t *sections_length_out);
+bool find_time_date_stamp(FILE *f, uint32_t *time_date_stamp_out);
 bool find_section_info(const char *name, FILE *f, size_t *position_out, size_t *size_out);
-bool find_pattern(const struct ignorable_byte *pattern_bytes, const size_t pattern_bytes_length, FILE *f, uint8_t *buffer, size_t buffer_size, size_t section_position, size_t *index_out);
-bool stop_and_wait(struct context *context);
 bool seek_and_read_bytes(uint8_t *destination, size_t destination_length, size_t position, FILE *f);
-bool seek_and_write_bytes(uint8_t *source, size_t source_length, size_t position, FILE *f);
+// /proc/<pid>/mem for reading and writing, which can write to the game's code too.
+FILE *open_process_memory(pid_t pid);
+bool seek_and_write_bytes(const uint8_t *source, size_t source_length, size_t position, FILE *f);
+// Writes like seek_and_write_bytes(), after noting what was there in journal unless it is NULL. Nothing is written
+// when it can't be noted.
+bool journal_write(struct write_journal *journal, const void *source, size_t source_length, size_t position, FILE *f);
+// Puts back what journal noted, newest first, and empties it.
+bool journal_rollback(struct write_journal *journal, FILE *f);
+// Adds what the writes journal noted left behind to targets->patched.
+void journal_keep(const struct write_journal *journal, struct patch_targets *targets);
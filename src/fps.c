@@ -1,13 +1,12 @@
-#include "fps.h"
+#define _POSIX_C_SOURCE 1
 
-#include "signals.h"
+#include "fps.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <sys/ptrace.h>
-#include <time.h>
 
 static struct ignorable_byte pattern_framelock_fuzzy[] = {
 	{ .is_ignored = false, .value = 0xc7 },
@@ -88,142 +87,133 @@ static float find_speed_fix_for_refresh_rate(float frame_limit) {
 	return closest_speed_fix;
 }
 
-static bool patch_framelock(struct context *context, float fps, uint8_t *section_bytes, size_t section_bytes_size, size_t section_position)
+static bool write_framelock(FILE *f, struct write_journal *journal, size_t position, float fps)
 {
-	time_t start_time = time(NULL);
-	if ((time_t)-1 == start_time) {
-		perror("time() failed");
+	static_assert(sizeof(fps) == 4, "the game expects fps to be 4 bytes long");
+	float delta_time = 1000.0f / fps / 1000.0f;
+	if (!journal_write(journal, &delta_time, sizeof(fps), position, f)) {
+		fprintf(stderr, "journal_write() failed\n");
 		return false;
 	}
 
-	size_t pattern_framelock_index = 0;
-	time_t current_time = start_time;
-	while (true) {
-		if (got_sigterm) {
-			fprintf(stderr, "got SIGTERM, exiting\n");
-			return false;
-		}
-
-		if (got_sigchld) {
-			if (ptrace(PTRACE_CONT, context->pid, NULL, NULL) == -1) {
-				perror("ptrace(PTRACE_CONT) failed");
-				return false;
-			}
-			got_sigchld = 0;
-		}
-
-		if (find_pattern(pattern_framelock_fuzzy, sizeof(pattern_framelock_fuzzy) / sizeof(struct ignorable_byte), context->f, section_bytes, section_bytes_size, section_position, &pattern_framelock_index)) {
-			stop_and_wait(context);
-			break;
-		}
+	return true;
+}
 
-		current_time = time(NULL);
-		if ((time_t)-1 == current_time) {
-			perror("time() failed");
-			return false;
-		}
-		if ((current_time - start_time) > context->timeout) {
-			fprintf(stderr, "timeout reached while looking for framelock pattern\n");
-			return false;
-		}
+static bool write_speed_fix(FILE *f, struct write_journal *journal, size_t position, float fps)
+{
+	float framelock_speed_fix_value = find_speed_fix_for_refresh_rate(fps);
+	static_assert(sizeof(framelock_speed_fix_value) == 4, "the game expects framelock_speed_fix_value to be 4 bytes long");
+	if (!journal_write(journal, &framelock_speed_fix_value, sizeof(framelock_speed_fix_value), position, f)) {
+		fprintf(stderr, "journal_write() failed\n");
+		return false;
 	}
 
-	size_t framelock_value_index = pattern_framelock_index + 3;
-	static_assert(sizeof(fps) == 4, "the game expects fps to be 4 bytes long");
-	float delta_time = 1000.0f / fps / 1000.0f;
-	if (!seek_and_write_bytes((uint8_t *)&delta_time, sizeof(fps), section_position + framelock_value_index, context->f)) {
-		fprintf(stderr, "seek_and_write_bytes() failed\n");
+	return true;
+}
+
+static bool apply_framelock(struct context *context, const struct pattern_match *match, const void *value)
+{
+	float fps = *(const float *)value;
+	size_t framelock_value_index = match->index + 3;
+	size_t framelock_position = match->section_position + framelock_value_index;
+	if (!write_framelock(context->f, context->journal, framelock_position, fps)) {
+		fprintf(stderr, "write_framelock() failed\n");
 		return false;
 	}
+	if (context->targets) {
+		context->targets->framelock = framelock_position;
+	}
 
 	return true;
 }
 
-static bool patch_framelock_speed_fix(struct context *context, float fps, uint8_t *section_bytes, size_t section_bytes_size, size_t section_position)
+static bool apply_framelock_speed_fix(struct context *context, const struct pattern_match *match, const void *value)
 {
-	time_t start_time = time(NULL);
-	if ((time_t)-1 == start_time) {
-		perror("time() failed");
+	float fps = *(const float *)value;
+	size_t framelock_speed_fix_offset_index = match->index + 15;
+	uint32_t framelock_speed_fix_offset = *(const uint32_t *)(match->section_bytes + framelock_speed_fix_offset_index);
+	size_t framelock_speed_fix_position = match->section_position + framelock_speed_fix_offset_index + 4 + framelock_speed_fix_offset;
+	if (!write_speed_fix(context->f, context->journal, framelock_speed_fix_position, fps)) {
+		fprintf(stderr, "write_speed_fix() failed\n");
 		return false;
 	}
+	if (context->targets) {
+		context->targets->speed_fix = framelock_speed_fix_position;
+	}
 
-	size_t pattern_framelock_speed_fix_index = 0;
-	time_t current_time = start_time;
-	while (true) {
-		if (got_sigchld) {
-			if (ptrace(PTRACE_CONT, context->pid, NULL, NULL) == -1) {
-				perror("ptrace(PTRACE_CONT) failed");
-				return false;
-			}
-			got_sigchld = 0;
-		}
+	return true;
+}
 
-		if (find_pattern(pattern_framelock_speed_fix, sizeof(pattern_framelock_speed_fix) / sizeof(struct ignorable_byte), context->f, section_bytes, section_bytes_size, section_position, &pattern_framelock_speed_fix_index)) {
-			stop_and_wait(context);
-			break;
-		}
+static const struct pattern_site site_framelock = {
+	.name = "framelock",
+	.description = "framelock",
+	.section = ".text",
+	.pattern_bytes = pattern_framelock_fuzzy,
+	.pattern_bytes_length = sizeof(pattern_framelock_fuzzy) / sizeof(struct ignorable_byte),
+	.apply = apply_framelock,
+};
 
-		current_time = time(NULL);
-		if ((time_t)-1 == current_time) {
-			perror("time() failed");
-			return false;
-		}
-		if ((current_time - start_time) > context->timeout) {
-			fprintf(stderr, "timeout reached while looking for speed fix pattern\n");
-			return false;
-		}
-	}
+static const struct pattern_site site_framelock_speed_fix = {
+	.name = "framelock-speed-fix",
+	.description = "speed fix",
+	.section = ".text",
+	.pattern_bytes = pattern_framelock_speed_fix,
+	.pattern_bytes_length = sizeof(pattern_framelock_speed_fix) / sizeof(struct ignorable_byte),
+	.apply = apply_framelock_speed_fix,
+};
 
-	size_t framelock_speed_fix_offset_index = pattern_framelock_speed_fix_index + 15;
-	uint32_t framelock_speed_fix_offset = *(uint32_t *)(section_bytes + framelock_speed_fix_offset_index);
-	size_t framelock_speed_fix_position = section_position + framelock_speed_fix_offset_index + 4 + framelock_speed_fix_offset;
-	float framelock_speed_fix_value = find_speed_fix_for_refresh_rate(fps);
-	static_assert(sizeof(framelock_speed_fix_value) == 4, "the game expects framelock_speed_fix_value to be 4 bytes long");
-	if (!seek_and_write_bytes((uint8_t *)&framelock_speed_fix_value, sizeof(framelock_speed_fix_value), framelock_speed_fix_position, context->f)) {
-		fprintf(stderr, "seek_and_write_bytes() failed\n");
+bool check_fps(float fps)
+{
+	if (fps < 30 || fps > 300) {
+		fprintf(stderr, "fps needs to be at least 30 and at most 300\n");
 		return false;
 	}
 
 	return true;
 }
-static bool patch_game_fps_with_section(struct context *context, float fps, uint8_t *section_bytes, size_t section_bytes_size, size_t section_position)
+
+bool plan_fps(struct patch_plan *plan, float fps)
 {
-	if (!patch_framelock(context, fps, section_bytes, section_bytes_size, section_position)) {
-		fprintf(stderr, "patch_framelock() failed\n");
+	if (!check_fps(fps)) {
 		return false;
 	}
 
-	if (!patch_framelock_speed_fix(context, fps, section_bytes, section_bytes_size, section_position)) {
-		fprintf(stderr, "patch_framelock_speed_fix() failed\n");
+	if (!plan_add_pattern(plan, &site_framelock, &fps, sizeof(fps))) {
+		fprintf(stderr, "plan_add_pattern() failed\n");
+		return false;
+	}
+
+	if (!plan_add_pattern(plan, &site_framelock_speed_fix, &fps, sizeof(fps))) {
+		fprintf(stderr, "plan_add_pattern() failed\n");
 		return false;
 	}
 
 	return true;
 }
 
-static bool patch_game_fps(struct context *context, float fps)
+// Writes another cap where plan_fps() patched the first one, without looking for the patterns again.
+bool fps_rewrite(FILE *f, const struct patch_targets *targets, float fps)
 {
-	size_t section_position;
-	size_t section_size = 0;
-	if (!find_section_info(".text", context->f, &section_position, &section_size)) {
-		fprintf(stderr, "find_section_info(\".text\", ...) failed\n");
+	if (!check_fps(fps)) {
 		return false;
 	}
-
-	uint8_t *section_buffer = calloc(section_size, sizeof(uint8_t));
-	if (!section_buffer) {
-		fprintf(stderr, "calloc() failed\n");
+	if (!targets->framelock || !targets->speed_fix) {
+		fprintf(stderr, "the fps was not patched, there is nothing to rewrite\n");
 		return false;
 	}
 
-	bool success = patch_game_fps_with_section(context, fps, section_buffer, section_size, section_position);
-
-	free(section_buffer);
+	// Either both values change or neither does.
+	struct write_journal journal = { 0 };
+	if (!write_framelock(f, &journal, targets->framelock, fps) ||
+	    !write_speed_fix(f, &journal, targets->speed_fix, fps)) {
+		journal_rollback(&journal, f);
+		return false;
+	}
 
-	return success;
+	return true;
 }
 
-bool main_fps(struct context *context, int argc, char *argv[])
+bool main_fps(struct patch_plan *plan, int argc, char *argv[])
 {
 	if (argc < 1) {
 		fprintf(stderr, "need at least 1 argument to patch fps\n");
@@ -236,13 +226,8 @@ bool main_fps(struct context *context, int argc, char *argv[])
 		return false;
 	}
 
-	if (fps < 30 || fps > 300) {
-		fprintf(stderr, "fps needs to be at least 30 and at most 300\n");
-		return false;
-	}
-
-	if (!patch_game_fps(context, fps)) {
-		fprintf(stderr, "patch_game_fps() failed\n");
+	if (!plan_fps(plan, fps)) {
+		fprintf(stderr, "plan_fps() failed\n");
 		return false;
 	}
 
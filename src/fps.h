@@ -1,3 +1,8 @@
 #include "common.h"
+#include "plan.h"
 
-bool main_fps(struct context *context, int argc, char *argv[]);
+// Prints why when the fps is out of range.
+bool check_fps(float fps);
+bool plan_fps(struct patch_plan *plan, float fps);
+bool fps_rewrite(FILE *f, const struct patch_targets *targets, float fps);
+bool main_fps(struct patch_plan *plan, int argc, char *argv[]);
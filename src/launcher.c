@@ -0,0 +1,363 @@
+#define _GNU_SOURCE 1
+
+#include "launcher.h"
+
+#include "loop.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define INITIAL_TRACEES_CAPACITY 64
+
+// Every task of the launched process tree that is traced right now.
+struct tracees {
+	pid_t *tids;
+	size_t length;
+	size_t capacity;
+};
+
+static bool add_tracee(struct tracees *tracees, pid_t tid)
+{
+	for (size_t i = 0; i < tracees->length; ++i) {
+		if (tracees->tids[i] == tid) {
+			return true;
+		}
+	}
+
+	if (tracees->length == tracees->capacity) {
+		size_t capacity = tracees->capacity ? tracees->capacity * 2 : INITIAL_TRACEES_CAPACITY;
+		pid_t *tids = realloc(tracees->tids, capacity * sizeof(pid_t));
+		if (!tids) {
+			fprintf(stderr, "realloc() failed\n");
+			return false;
+		}
+		tracees->tids = tids;
+		tracees->capacity = capacity;
+	}
+	tracees->tids[tracees->length++] = tid;
+
+	return true;
+}
+
+static void remove_tracee(struct tracees *tracees, pid_t tid)
+{
+	for (size_t i = 0; i < tracees->length; ++i) {
+		if (tracees->tids[i] == tid) {
+			tracees->tids[i] = tracees->tids[--tracees->length];
+			return;
+		}
+	}
+}
+
+static bool read_proc_line(pid_t tid, const char *file, char *buffer, size_t buffer_size)
+{
+	char path[64] = "";
+	long tid_long = tid;
+	snprintf(path, sizeof(path), "/proc/%ld/%s", tid_long, file);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	ssize_t read_size = read(fd, buffer, buffer_size - 1);
+	close(fd);
+	if (read_size <= 0) {
+		return false;
+	}
+	buffer[read_size] = '\0';
+
+	return true;
+}
+
+// Wine names the process after the executable once it's running, so this is checked on exec and again every time the
+// process creates a thread or a child.
+static bool is_task_sekiro(pid_t tid, pid_t *pid_out)
+{
+	char comm[32] = "";
+	if (!read_proc_line(tid, "comm", comm, sizeof(comm)) || !strstr(comm, "sekiro.exe")) {
+		return false;
+	}
+
+	char status[512] = "";
+	if (!read_proc_line(tid, "status", status, sizeof(status))) {
+		return false;
+	}
+	const char *tgid = strstr(status, "Tgid:");
+	if (!tgid) {
+		return false;
+	}
+	*pid_out = strtol(tgid + strlen("Tgid:"), NULL, 10);
+
+	return *pid_out > 0;
+}
+
+static bool is_group_stop_signal(int signal)
+{
+	return SIGSTOP == signal || SIGTSTP == signal || SIGTTIN == signal || SIGTTOU == signal;
+}
+
+// Lets a stopped tracee go. Signals it was about to get are passed on, group-stops stay stopped.
+static bool release_tracee(pid_t tid, int wstatus)
+{
+	int event = wstatus >> 16;
+	int signal = WSTOPSIG(wstatus);
+	long delivered = !event && SIGTRAP != signal ? signal : 0;
+	if (ptrace(PTRACE_DETACH, tid, NULL, (void *)delivered) == -1 && ESRCH != errno) {
+		perror("ptrace(PTRACE_DETACH) failed");
+		return false;
+	}
+
+	return true;
+}
+
+static bool detach_all(struct tracees *tracees, struct launched_command *launched, pid_t stopped_tid,
+		       int stopped_wstatus)
+{
+	bool success = true;
+	for (size_t i = 0; i < tracees->length; ++i) {
+		pid_t tid = tracees->tids[i];
+		if (tid == stopped_tid) {
+			success = release_tracee(tid, stopped_wstatus) && success;
+			continue;
+		}
+
+		if (ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1) {
+			if (ESRCH != errno) {
+				perror("ptrace(PTRACE_INTERRUPT) failed");
+				success = false;
+			}
+			continue;
+		}
+
+		int wstatus = 0;
+		if (waitpid(tid, &wstatus, __WALL) != tid) {
+			perror("waitpid() failed");
+			success = false;
+			continue;
+		}
+		if (!WIFSTOPPED(wstatus)) {
+			if (tid == launched->child) {
+				launched->exited = true;
+				launched->wstatus = wstatus;
+			}
+			continue;
+		}
+
+		// The tracee may have stopped for a fork or a clone instead, the new task is traced too then.
+		int event = wstatus >> 16;
+		if (PTRACE_EVENT_FORK == event || PTRACE_EVENT_VFORK == event || PTRACE_EVENT_CLONE == event) {
+			unsigned long new_tid = 0;
+			if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &new_tid) != -1 && !add_tracee(tracees, new_tid)) {
+				success = false;
+			}
+		}
+		success = release_tracee(tid, wstatus) && success;
+	}
+	tracees->length = 0;
+
+	return success;
+}
+
+static bool continue_tracee(pid_t tid, int wstatus)
+{
+	int event = wstatus >> 16;
+	int signal = WSTOPSIG(wstatus);
+
+	if (PTRACE_EVENT_STOP == event && is_group_stop_signal(signal)) {
+		// A real group-stop, keep it stopped until SIGCONT like it would be without us.
+		if (ptrace(PTRACE_LISTEN, tid, NULL, NULL) == -1 && ESRCH != errno) {
+			perror("ptrace(PTRACE_LISTEN) failed");
+			return false;
+		}
+		return true;
+	}
+
+	long delivered = event ? 0 : signal;
+	if (ptrace(PTRACE_CONT, tid, NULL, (void *)delivered) == -1 && ESRCH != errno) {
+		perror("ptrace(PTRACE_CONT) failed");
+		return false;
+	}
+
+	return true;
+}
+
+struct tree {
+	struct tracees *tracees;
+	struct launched_command *launched;
+	pid_t *pid_out;
+};
+
+static enum loop_status handle_tree_event(struct tree *tree, pid_t tid, int wstatus)
+{
+	struct tracees *tracees = tree->tracees;
+	if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+		// This reaps the command too, wait_for_command() needs its status later.
+		if (tid == tree->launched->child) {
+			tree->launched->exited = true;
+			tree->launched->wstatus = wstatus;
+		}
+		remove_tracee(tracees, tid);
+		if (!tracees->length) {
+			fprintf(stderr, "the launched command exited without starting sekiro.exe\n");
+			return LOOP_FAILED;
+		}
+		return LOOP_CONTINUE;
+	}
+	if (!WIFSTOPPED(wstatus)) {
+		return LOOP_CONTINUE;
+	}
+	if (!add_tracee(tracees, tid)) {
+		return LOOP_FAILED;
+	}
+
+	int event = wstatus >> 16;
+	unsigned long message = 0;
+	if (PTRACE_EVENT_FORK == event || PTRACE_EVENT_VFORK == event || PTRACE_EVENT_CLONE == event) {
+		if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &message) == -1) {
+			perror("ptrace(PTRACE_GETEVENTMSG) failed");
+			return LOOP_FAILED;
+		}
+		if (!add_tracee(tracees, message)) {
+			return LOOP_FAILED;
+		}
+	} else if (PTRACE_EVENT_EXEC == event) {
+		// A thread other than the leader called exec, it took over the leader's tid.
+		if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &message) != -1 && (pid_t)message != tid) {
+			remove_tracee(tracees, message);
+		}
+	}
+
+	if (event && PTRACE_EVENT_STOP != event && is_task_sekiro(tid, tree->pid_out)) {
+		if (!detach_all(tracees, tree->launched, tid, wstatus)) {
+			fprintf(stderr, "detach_all() failed\n");
+			return LOOP_FAILED;
+		}
+		return LOOP_DONE;
+	}
+
+	return continue_tracee(tid, wstatus) ? LOOP_CONTINUE : LOOP_FAILED;
+}
+
+// SIGCHLD coalesces, so everything that is waiting gets handled.
+static enum loop_status follow_tree(void *data)
+{
+	struct tree *tree = data;
+	while (true) {
+		int wstatus = 0;
+		pid_t tid = waitpid(-1, &wstatus, WNOHANG | __WALL);
+		if (!tid) {
+			return LOOP_CONTINUE;
+		}
+		if (tid == -1) {
+			perror("waitpid() failed");
+			return LOOP_FAILED;
+		}
+
+		enum loop_status status = handle_tree_event(tree, tid, wstatus);
+		if (LOOP_CONTINUE != status) {
+			return status;
+		}
+	}
+}
+
+static bool follow_tree_in_loop(struct loop *loop, struct tracees *tracees, struct launched_command *launched,
+				time_t timeout, pid_t *pid_out)
+{
+	struct tree tree = {
+		.tracees = tracees,
+		.launched = launched,
+		.pid_out = pid_out,
+	};
+	// Nothing to poll, the tree only ever changes with a SIGCHLD.
+	struct loop_step step = {
+		.description = "waiting for sekiro.exe to start",
+		.timeout = timeout,
+		.child = follow_tree,
+		.data = &tree,
+	};
+	if (loop_run(loop, &step) == LOOP_DONE) {
+		return true;
+	}
+
+	// Whatever went wrong, the command gets to run on its own.
+	detach_all(tracees, launched, 0, 0);
+
+	return false;
+}
+
+// Runs command as a child and follows every process and thread it creates, until one of them turns out to be the
+// game. Everything is detached from then, the game included, so it can be attached to like any other process.
+bool launch_and_find_sekiro(struct loop *loop, char **command, time_t timeout, struct launched_command *launched_out,
+			    pid_t *pid_out)
+{
+	*launched_out = (struct launched_command){ .child = -1 };
+
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+		perror("pipe2() failed");
+		return false;
+	}
+
+	pid_t child = fork();
+	if (child == -1) {
+		perror("fork() failed");
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return false;
+	}
+
+	if (!child) {
+		// Wait until the parent is tracing us, it closes its end of the pipe once it is.
+		close(pipe_fds[1]);
+		char byte = 0;
+		while (read(pipe_fds[0], &byte, 1) == -1 && EINTR == errno);
+		sigprocmask(SIG_SETMASK, &loop->old_mask, NULL);
+		execvp(command[0], command);
+		perror("execvp() failed");
+		_exit(127);
+	}
+	launched_out->child = child;
+	close(pipe_fds[0]);
+
+	long options = PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC;
+	bool seized = ptrace(PTRACE_SEIZE, child, NULL, (void *)options) != -1;
+	if (!seized) {
+		perror("ptrace(PTRACE_SEIZE) failed");
+	}
+	close(pipe_fds[1]);
+	if (!seized) {
+		return false;
+	}
+
+	struct tracees tracees = { 0 };
+	bool success = add_tracee(&tracees, child) && follow_tree_in_loop(loop, &tracees, launched_out, timeout, pid_out);
+	free(tracees.tids);
+
+	return success;
+}
+
+// Waits for the launched command and returns its exit status the way a shell would.
+int wait_for_command(const struct launched_command *launched)
+{
+	int wstatus = launched->wstatus;
+	while (!launched->exited && waitpid(launched->child, &wstatus, 0) == -1) {
+		if (EINTR != errno) {
+			perror("waitpid() failed");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (WIFSIGNALED(wstatus)) {
+		return 128 + WTERMSIG(wstatus);
+	}
+
+	return WEXITSTATUS(wstatus);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct loop;
+
+struct launched_command {
+	pid_t child;
+	bool exited;
+	int wstatus;
+};
+
+bool launch_and_find_sekiro(struct loop *loop, char **command, time_t timeout, struct launched_command *launched_out,
+			    pid_t *pid_out);
+int wait_for_command(const struct launched_command *launched);
@@ -0,0 +1,481 @@
+#define _GNU_SOURCE 1
+
+#include "loop.h"
+
+#include "trace.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ptrace.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 4
+
+static void close_fd(int *fd)
+{
+	if (*fd != -1) {
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+static bool add_to_epoll(int epoll_fd, int fd)
+{
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		perror("epoll_ctl() failed");
+		return false;
+	}
+
+	return true;
+}
+
+static bool arm_timer(int timer_fd, long value_ns, long interval_ns)
+{
+	struct itimerspec spec = {
+		.it_interval = { .tv_sec = interval_ns / 1000000000L, .tv_nsec = interval_ns % 1000000000L },
+		.it_value = { .tv_sec = value_ns / 1000000000L, .tv_nsec = value_ns % 1000000000L },
+	};
+	if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1) {
+		perror("timerfd_settime() failed");
+		return false;
+	}
+
+	return true;
+}
+
+static bool create_fds(struct loop *loop, const sigset_t *mask)
+{
+	loop->signal_fd = mask ? signalfd(-1, mask, SFD_CLOEXEC | SFD_NONBLOCK) : -1;
+	if (mask && loop->signal_fd == -1) {
+		perror("signalfd() failed");
+		return false;
+	}
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd == -1) {
+		perror("epoll_create1() failed");
+		return false;
+	}
+
+	loop->tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	loop->deadline_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (loop->tick_fd == -1 || loop->deadline_fd == -1) {
+		perror("timerfd_create() failed");
+		return false;
+	}
+
+	return (!mask || add_to_epoll(loop->epoll_fd, loop->signal_fd)) && add_to_epoll(loop->epoll_fd, loop->tick_fd) &&
+	       add_to_epoll(loop->epoll_fd, loop->deadline_fd);
+}
+
+// With handle_signals, blocks the signals the loop waits for, so they only ever arrive through the signalfd. Without
+// it the signals are left to the rest of the program and the tracee is polled with waitpid() every tick.
+bool loop_init(struct loop *loop, bool handle_signals)
+{
+	*loop = (struct loop){ .epoll_fd = -1, .signal_fd = -1, .tick_fd = -1, .deadline_fd = -1, .pid_fd = -1 };
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	loop->handles_signals = handle_signals;
+	if (handle_signals && sigprocmask(SIG_BLOCK, &mask, &loop->old_mask) == -1) {
+		perror("sigprocmask() failed");
+		return false;
+	}
+
+	if (!create_fds(loop, handle_signals ? &mask : NULL)) {
+		fprintf(stderr, "create_fds() failed\n");
+		loop_free(loop);
+		return false;
+	}
+
+	return true;
+}
+
+void loop_free(struct loop *loop)
+{
+	close_fd(&loop->pid_fd);
+	close_fd(&loop->deadline_fd);
+	close_fd(&loop->tick_fd);
+	close_fd(&loop->epoll_fd);
+	close_fd(&loop->signal_fd);
+	if (loop->handles_signals) {
+		// A dump asked for after the last step would otherwise kill the patcher on its way out.
+		sigaddset(&loop->old_mask, SIGUSR1);
+		sigprocmask(SIG_SETMASK, &loop->old_mask, NULL);
+	}
+}
+
+// Steps end with LOOP_EXITED once pid is gone, traced or not.
+bool loop_watch(struct loop *loop, pid_t pid)
+{
+	loop->pid = pid;
+	loop->pid_fd = syscall(SYS_pidfd_open, pid, 0);
+	if (loop->pid_fd == -1) {
+		// Older than 5.3, a traced process that exits is still noticed through waitpid().
+		if (ENOSYS == errno) {
+			return true;
+		}
+		perror("pidfd_open() failed");
+		return false;
+	}
+
+	return add_to_epoll(loop->epoll_fd, loop->pid_fd);
+}
+
+static bool wait_for_stop(struct loop *loop)
+{
+	struct timespec start = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	static_assert(!WIFSTOPPED(0), "WIFSTOPPED triggered on 0");
+	int wstatus = 0;
+	while (!WIFSTOPPED(wstatus)) {
+		pid_t pid_waited = waitpid(loop->pid, &wstatus, 0);
+		if (pid_waited != loop->pid) {
+			perror("waitpid() failed");
+			return false;
+		}
+		if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+			fprintf(stderr, "sekiro.exe exited\n");
+			return false;
+		}
+	}
+	loop->tracee_stopped = true;
+
+	struct timespec end = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	trace_emit(TRACE_STOP, loop->pid,
+		   (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec, 0);
+
+	return true;
+}
+
+bool loop_attach(struct loop *loop, pid_t pid)
+{
+	if (!loop_watch(loop, pid)) {
+		fprintf(stderr, "loop_watch() failed\n");
+		return false;
+	}
+
+	if (ptrace(PTRACE_ATTACH, pid, NULL, NULL) == -1) {
+		perror("ptrace(PTRACE_ATTACH, ...)");
+		return false;
+	}
+	trace_emit(TRACE_ATTACH, pid, 0, 0);
+	// The attach stop is continued by the first step, like every other stop. Waiting for it here keeps anything before
+	// that step from sending a second SIGSTOP, which could stop the whole game until it gets continued.
+	loop->traced = true;
+	loop->tracee_stopped = false;
+
+	return wait_for_stop(loop);
+}
+
+bool loop_detach(struct loop *loop)
+{
+	// A step that failed may have left the tracee running, it has to be stopped to be detached from.
+	if (!loop->tracee_stopped && !loop_stop_tracee(loop)) {
+		fprintf(stderr, "loop_stop_tracee() failed\n");
+		return false;
+	}
+
+	if (ptrace(PTRACE_DETACH, loop->pid, NULL, NULL) == -1) {
+		perror("ptrace(PTRACE_DETACH, ...)");
+		return false;
+	}
+	loop->traced = false;
+	trace_emit(TRACE_DETACH, loop->pid, 0, 0);
+
+	return true;
+}
+
+// Leaves the tracee stopped until the next step runs, it can only be written to and detached from like this.
+bool loop_stop_tracee(struct loop *loop)
+{
+	if (!loop->traced || loop->tracee_stopped) {
+		return true;
+	}
+
+	if (kill(loop->pid, SIGSTOP) == -1) {
+		perror("kill() failed");
+		return false;
+	}
+
+	return wait_for_stop(loop);
+}
+
+static bool continue_tracee(struct loop *loop, int signal)
+{
+	if (ptrace(PTRACE_CONT, loop->pid, NULL, (void *)(long)signal) == -1) {
+		perror("ptrace(PTRACE_CONT) failed");
+		return false;
+	}
+	loop->tracee_stopped = false;
+	trace_emit(TRACE_CONTINUE, loop->pid, signal, 0);
+
+	return true;
+}
+
+// Lets the game run again after loop_stop_tracee(), does nothing when it isn't stopped.
+bool loop_continue_tracee(struct loop *loop)
+{
+	return !loop->traced || !loop->tracee_stopped || continue_tracee(loop, 0);
+}
+
+// Stops the game's main thread for a write, like patching does, when the loop isn't tracing it. Returns the signal the
+// game got in the meantime in signal_out, it gets delivered by loop_unseize().
+bool loop_seize(pid_t pid, int *signal_out)
+{
+	if (ptrace(PTRACE_SEIZE, pid, NULL, NULL) == -1) {
+		perror("ptrace(PTRACE_SEIZE, ...) failed");
+		return false;
+	}
+	if (ptrace(PTRACE_INTERRUPT, pid, NULL, NULL) == -1) {
+		perror("ptrace(PTRACE_INTERRUPT, ...) failed");
+		ptrace(PTRACE_DETACH, pid, NULL, NULL);
+		return false;
+	}
+
+	int wstatus = 0;
+	while (!WIFSTOPPED(wstatus)) {
+		if (waitpid(pid, &wstatus, __WALL) != pid) {
+			perror("waitpid() failed");
+			return false;
+		}
+		if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+			fprintf(stderr, "sekiro.exe exited\n");
+			return false;
+		}
+	}
+	*signal_out = PTRACE_EVENT_STOP == wstatus >> 16 ? 0 : WSTOPSIG(wstatus);
+
+	return true;
+}
+
+bool loop_unseize(pid_t pid, int signal)
+{
+	if (ptrace(PTRACE_DETACH, pid, NULL, (void *)(intptr_t)signal) == -1) {
+		perror("ptrace(PTRACE_DETACH, ...) failed");
+		return false;
+	}
+
+	return true;
+}
+
+// SIGCHLD coalesces, so every state change that is waiting gets handled.
+static enum loop_status handle_tracee(struct loop *loop, const struct loop_step *step)
+{
+	while (true) {
+		int wstatus = 0;
+		pid_t pid_waited = waitpid(loop->pid, &wstatus, WNOHANG | __WALL);
+		if (!pid_waited) {
+			return LOOP_CONTINUE;
+		}
+		if (pid_waited == -1) {
+			perror("waitpid() failed");
+			return LOOP_FAILED;
+		}
+
+		if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+			fprintf(stderr, "sekiro.exe exited\n");
+			return LOOP_EXITED;
+		}
+		if (!WIFSTOPPED(wstatus)) {
+			continue;
+		}
+
+		// SIGSTOP is either ours or the attach stop, anything else belongs to the game unless the step claims it.
+		int signal = WSTOPSIG(wstatus);
+		bool own = SIGSTOP == signal;
+		loop->tracee_stopped = true;
+		if (SIGTRAP == signal && step->trap) {
+			enum loop_status status = step->trap(step->data, &own);
+			if (LOOP_CONTINUE != status) {
+				return status;
+			}
+		}
+		if (loop->tracee_stopped && !continue_tracee(loop, own ? 0 : signal)) {
+			return LOOP_FAILED;
+		}
+	}
+}
+
+static enum loop_status handle_signals(struct loop *loop, const struct loop_step *step)
+{
+	enum loop_status status = LOOP_CONTINUE;
+	struct signalfd_siginfo info;
+	while (LOOP_CONTINUE == status && read(loop->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		if (SIGTERM == info.ssi_signo || SIGINT == info.ssi_signo) {
+			fprintf(stderr, "got %s, exiting\n", SIGTERM == info.ssi_signo ? "SIGTERM" : "SIGINT");
+			return LOOP_INTERRUPTED;
+		}
+		// Tracing is for launches that go wrong, this gets the trace out of one that hangs.
+		if (SIGUSR1 == info.ssi_signo) {
+			trace_dump();
+			continue;
+		}
+
+		if (step->child) {
+			status = step->child(step->data);
+		} else if (loop->traced) {
+			status = handle_tracee(loop, step);
+		}
+	}
+
+	return status;
+}
+
+static enum loop_status handle_tick(struct loop *loop, const struct loop_step *step)
+{
+	uint64_t expirations = 0;
+	if (read(loop->tick_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		return LOOP_CONTINUE;
+	}
+
+	// Without a signalfd there is no SIGCHLD, the tracee's stops are picked up here instead.
+	enum loop_status status = LOOP_CONTINUE;
+	if (loop->signal_fd == -1 && loop->traced && !step->child) {
+		status = handle_tracee(loop, step);
+	}
+
+	loop->tick_expirations += expirations;
+	if (loop->tick_expirations < loop->tick_every) {
+		return status;
+	}
+	loop->tick_expirations = 0;
+
+	return LOOP_CONTINUE == status && step->tick ? step->tick(step->data) : status;
+}
+
+static enum loop_status dispatch(struct loop *loop, const struct loop_step *step, const struct epoll_event *events,
+				 int events_length)
+{
+	bool signal = false;
+	bool exited = false;
+	bool tick = false;
+	bool deadline = false;
+	for (int i = 0; i < events_length; ++i) {
+		signal = signal || events[i].data.fd == loop->signal_fd;
+		exited = exited || events[i].data.fd == loop->pid_fd;
+		tick = tick || events[i].data.fd == loop->tick_fd;
+		deadline = deadline || events[i].data.fd == loop->deadline_fd;
+	}
+
+	// Signals go first so nothing gets scanned for a game that is gone, the deadline last so that even a timeout of
+	// zero gets one tick.
+	enum loop_status status = signal ? handle_signals(loop, step) : LOOP_CONTINUE;
+	if (LOOP_CONTINUE == status && exited) {
+		fprintf(stderr, "sekiro.exe exited\n");
+		status = LOOP_EXITED;
+	}
+	if (LOOP_CONTINUE == status && tick) {
+		status = handle_tick(loop, step);
+	}
+	if (LOOP_CONTINUE == status && deadline) {
+		if (step->description) {
+			fprintf(stderr, "timeout reached while %s\n", step->description);
+		}
+		status = LOOP_TIMEOUT;
+	}
+
+	return status;
+}
+
+// A tracee that has to be polled is polled at the poll interval however slow the step ticks, the tick handler only
+// runs every so many expirations then.
+static bool arm_tick(struct loop *loop, long tick_ns, long value_ns)
+{
+	long interval_ns = tick_ns > 0 ? tick_ns : LOOP_POLL_INTERVAL_NS;
+	loop->tick_every = 1;
+	if (loop->signal_fd == -1 && loop->traced && interval_ns > LOOP_POLL_INTERVAL_NS) {
+		loop->tick_every = interval_ns / LOOP_POLL_INTERVAL_NS;
+		interval_ns = LOOP_POLL_INTERVAL_NS;
+	}
+	// The first expiration runs the tick handler.
+	loop->tick_expirations = loop->tick_every;
+
+	return arm_timer(loop->tick_fd, value_ns, interval_ns);
+}
+
+// Changes how often the tick handler of the running step runs, starting with a tick right away.
+bool loop_set_tick(struct loop *loop, long tick_ns)
+{
+	return arm_tick(loop, tick_ns, 1);
+}
+
+// Continues a stopped tracee and arms the timers of step, loop_dispatch() does the rest.
+bool loop_begin(struct loop *loop, const struct loop_step *step)
+{
+	if (loop->traced && loop->tracee_stopped && !continue_tracee(loop, 0)) {
+		return false;
+	}
+
+	// A value of 0 would disarm the timers, 1 ns makes them expire right away instead. A step without a tick handler
+	// only needs the timer when the tracee has to be polled.
+	bool needs_tick = step->tick || (loop->signal_fd == -1 && loop->traced);
+	if (needs_tick && !arm_tick(loop, step->tick_ns, 1)) {
+		return false;
+	}
+	if (step->timeout >= 0 && !arm_timer(loop->deadline_fd, step->timeout ? step->timeout * 1000000000L : 1, 0)) {
+		loop_end(loop);
+		return false;
+	}
+
+	return true;
+}
+
+// Handles whatever is ready, waiting up to timeout_ms for it like epoll_wait() does. LOOP_CONTINUE means the step
+// is not over yet.
+enum loop_status loop_dispatch(struct loop *loop, const struct loop_step *step, int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int events_length = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout_ms);
+	if (events_length == -1) {
+		if (EINTR == errno) {
+			return LOOP_CONTINUE;
+		}
+		perror("epoll_wait() failed");
+		return LOOP_FAILED;
+	}
+
+	enum loop_status status = dispatch(loop, step, events, events_length);
+	if (LOOP_CONTINUE != status) {
+		trace_emit(TRACE_STEP_END, status, 0, 0);
+	}
+
+	return status;
+}
+
+void loop_end(struct loop *loop)
+{
+	arm_timer(loop->tick_fd, 0, 0);
+	arm_timer(loop->deadline_fd, 0, 0);
+}
+
+// Sleeps in epoll_wait() between events, the tick handler is the only thing that does work.
+enum loop_status loop_run(struct loop *loop, const struct loop_step *step)
+{
+	if (!loop_begin(loop, step)) {
+		return LOOP_FAILED;
+	}
+
+	enum loop_status status = LOOP_CONTINUE;
+	while (LOOP_CONTINUE == status) {
+		status = loop_dispatch(loop, step, -1);
+	}
+
+	loop_end(loop);
+
+	return status;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// How often steps that poll the game's memory get to look at it.
+#define LOOP_POLL_INTERVAL_NS 1000000L
+
+enum loop_status {
+	LOOP_CONTINUE,
+	LOOP_DONE,
+	LOOP_FAILED,
+	LOOP_TIMEOUT,
+	LOOP_INTERRUPTED,
+	LOOP_EXITED,
+};
+
+// A step runs until one of its handlers returns something other than LOOP_CONTINUE, its timeout is reached, SIGTERM
+// or SIGINT arrive or the watched process exits.
+struct loop_step {
+	// Finishes "timeout reached while ...", NULL for steps that are meant to end with the timeout.
+	const char *description;
+	// In seconds, negative waits forever.
+	time_t timeout;
+	long tick_ns;
+	enum loop_status (*tick)(void *data);
+	// Gets SIGCHLD instead of the loop when set, the loop continues a stopped tracee otherwise. Needs a loop that
+	// handles signals.
+	enum loop_status (*child)(void *data);
+	// Gets the tracee while it is stopped by SIGTRAP, and tells whether the trap was the step's own. Those are kept
+	// from the game. The tracee stays stopped when this returns anything but LOOP_CONTINUE.
+	enum loop_status (*trap)(void *data, bool *own_out);
+	void *data;
+};
+
+struct loop {
+	int epoll_fd;
+	int signal_fd;
+	int tick_fd;
+	int deadline_fd;
+	// -1 and 0 until a process is watched.
+	int pid_fd;
+	pid_t pid;
+	bool traced;
+	bool tracee_stopped;
+	bool handles_signals;
+	sigset_t old_mask;
+	// Timer expirations per run of the tick handler and how many there were since the last run.
+	uint64_t tick_every;
+	uint64_t tick_expirations;
+};
+
+bool loop_init(struct loop *loop, bool handle_signals);
+void loop_free(struct loop *loop);
+bool loop_watch(struct loop *loop, pid_t pid);
+bool loop_attach(struct loop *loop, pid_t pid);
+bool loop_detach(struct loop *loop);
+bool loop_stop_tracee(struct loop *loop);
+bool loop_continue_tracee(struct loop *loop);
+// For short writes once the game runs on its own again.
+bool loop_seize(pid_t pid, int *signal_out);
+bool loop_unseize(pid_t pid, int signal);
+bool loop_begin(struct loop *loop, const struct loop_step *step);
+bool loop_set_tick(struct loop *loop, long tick_ns);
+enum loop_status loop_dispatch(struct loop *loop, const struct loop_step *step, int timeout_ms);
+void loop_end(struct loop *loop);
+enum loop_status loop_run(struct loop *loop, const struct loop_step *step);
@@ -1,20 +1,25 @@
 #define _POSIX_SOURCE 1
 
 #include "common.h"
-#include "signals.h"
-#include "sekiro.h"
+#include "loop.h"
 #include "fps.h"
+#include "launcher.h"
+#include "monitor.h"
 #include "resolution.h"
+#include "selfbench.h"
+#include "session.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "timeline.h"
 
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
-#include <signal.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ptrace.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -22,6 +27,27 @@
 
 #define COMMAND_FPS "set-fps"
 #define COMMAND_RESOLUTION "set-resolution"
+#define COMMAND_CAPTURE "capture"
+#define COMMAND_REPLAY "replay"
+#define COMMAND_SEPARATOR "--"
+#define COMMAND_SAMPLE_FRAMES "sample-frames"
+#define COMMAND_FPS_TIMELINE "fps-timeline"
+#define COMMAND_SELF_BENCH "self-bench"
+#define COMMAND_MONITOR "monitor"
+#define SELF_BENCH_SAVE "save"
+
+// Work that runs once the game has been patched and detached from.
+struct after_patch {
+	bool sample_frames;
+	struct frame_sampling frame_sampling;
+	bool run_timeline;
+	struct fps_timeline timeline;
+	bool run_monitor;
+	uint32_t monitor_interval_ms;
+	// What the timeline may rewrite.
+	bool patches_fps;
+	bool patches_resolution;
+};
 
 static time_t uint32_to_time(uint32_t value)
 {
@@ -43,27 +69,65 @@ static bool string_to_time(const char *s, int base, time_t *value_out)
 	return true;
 }
 
-static bool handle_arguments(struct context *context, char **arguments, int arguments_size)
+static bool handle_arguments(struct patch_plan *plan, char **arguments, int arguments_size,
+			     struct after_patch *after_patch)
 {
 	static_assert(sizeof(ptrdiff_t) >= sizeof(int), "ptrdiff_t must fit int");
 
 	while (arguments_size > 0) {
 		if (!strncmp(*arguments, COMMAND_FPS, strlen(COMMAND_FPS))) {
-			if (!main_fps(context, arguments_size - 1, arguments + 1)) {
+			if (!main_fps(plan, arguments_size - 1, arguments + 1)) {
 				fprintf(stderr, "main_fps() failed\n");
 				return false;
 			}
+			after_patch->patches_fps = true;
 
 			arguments += 2;
 			arguments_size -= 2;
 		} else if (!strncmp(*arguments, COMMAND_RESOLUTION, strlen(COMMAND_RESOLUTION))) {
-			if (!main_resolution(context, arguments_size - 1, arguments + 1)) {
+			if (!main_resolution(plan, arguments_size - 1, arguments + 1)) {
 				fprintf(stderr, "main_resolution() failed\n");
 				return false;
 			}
+			after_patch->patches_resolution = true;
 
 			arguments += 4;
 			arguments_size -= 4;
+		} else if (!strncmp(*arguments, COMMAND_CAPTURE, strlen(COMMAND_CAPTURE))) {
+			if (!main_capture(plan, arguments_size - 1, arguments + 1)) {
+				fprintf(stderr, "main_capture() failed\n");
+				return false;
+			}
+
+			arguments += 3;
+			arguments_size -= 3;
+		} else if (!strncmp(*arguments, COMMAND_SAMPLE_FRAMES, strlen(COMMAND_SAMPLE_FRAMES))) {
+			if (!parse_frame_sampling(arguments_size - 1, arguments + 1, &after_patch->frame_sampling)) {
+				fprintf(stderr, "parse_frame_sampling() failed\n");
+				return false;
+			}
+			after_patch->sample_frames = true;
+
+			arguments += 6;
+			arguments_size -= 6;
+		} else if (!strncmp(*arguments, COMMAND_FPS_TIMELINE, strlen(COMMAND_FPS_TIMELINE))) {
+			if (!parse_fps_timeline(arguments_size - 1, arguments + 1, &after_patch->timeline)) {
+				fprintf(stderr, "parse_fps_timeline() failed\n");
+				return false;
+			}
+			after_patch->run_timeline = true;
+
+			arguments += 2;
+			arguments_size -= 2;
+		} else if (!strncmp(*arguments, COMMAND_MONITOR, strlen(COMMAND_MONITOR))) {
+			if (!parse_patch_monitoring(arguments_size - 1, arguments + 1, &after_patch->monitor_interval_ms)) {
+				fprintf(stderr, "parse_patch_monitoring() failed\n");
+				return false;
+			}
+			after_patch->run_monitor = true;
+
+			arguments += 2;
+			arguments_size -= 2;
 		} else {
 			fprintf(stderr, "unknown command: %s\n", *arguments);
 
@@ -71,46 +135,127 @@ static bool handle_arguments(struct context *context, char **arguments, int argu
 		}
 	}
 
+	// The timeline only rewrites what was patched, it doesn't look for anything itself.
+	if (after_patch->run_timeline && after_patch->timeline.has_fps && !after_patch->patches_fps) {
+		fprintf(stderr, "%s changes the fps, that needs %s\n", COMMAND_FPS_TIMELINE, COMMAND_FPS);
+		return false;
+	}
+	if (after_patch->run_timeline && after_patch->timeline.has_resolution && !after_patch->patches_resolution) {
+		fprintf(stderr, "%s changes the resolution, that needs %s\n", COMMAND_FPS_TIMELINE, COMMAND_RESOLUTION);
+		return false;
+	}
+	// The monitor would put back what the timeline changes on purpose.
+	if (after_patch->run_timeline && after_patch->run_monitor) {
+		fprintf(stderr, "%s can't be used with %s\n", COMMAND_MONITOR, COMMAND_FPS_TIMELINE);
+		return false;
+	}
+
 	return true;
 }
 
-static bool patch_attached_process_with_file(struct context *context, char **arguments, int arguments_size)
+static bool run_after_patch(struct loop *loop, pid_t pid, const struct patch_targets *targets,
+			    const struct after_patch *after_patch)
 {
-	if (!handle_arguments(context, arguments, arguments_size)) {
-		fprintf(stderr, "handle_arguments() failed\n");
+	if (after_patch->run_timeline && !run_fps_timeline(loop, pid, targets, &after_patch->timeline)) {
+		fprintf(stderr, "run_fps_timeline() failed\n");
+		return false;
+	}
+
+	if (after_patch->sample_frames && !sample_frames(loop, pid, &after_patch->frame_sampling)) {
+		fprintf(stderr, "sample_frames() failed\n");
+		return false;
+	}
+
+	if (after_patch->run_monitor && !monitor_patches(loop, pid, targets, after_patch->monitor_interval_ms)) {
+		fprintf(stderr, "monitor_patches() failed\n");
 		return false;
 	}
 
 	return true;
 }
 
-static bool patch_attached_process(pid_t pid, time_t timeout, char **arguments, int arguments_size)
+// Drives the session the way any other program embedding it would.
+static bool run_session(struct sekiropatch *session)
 {
-	char path[64] = "";
-	long pid_long = pid;
-	int written = snprintf(path, 64, "/proc/%ld/mem", pid_long);
-	if (written < 0) {
-		fprintf(stderr, "snprintf() failed\n");
+	enum sekiropatch_status status = SEKIROPATCH_PENDING;
+	while (SEKIROPATCH_PENDING == status) {
+		struct pollfd pollfd = {
+			.fd = sekiropatch_fd(session),
+			.events = POLLIN,
+		};
+		if (poll(&pollfd, 1, -1) == -1 && errno != EINTR) {
+			perror("poll() failed");
+			return false;
+		}
+
+		status = sekiropatch_poll(session);
+	}
+
+	return SEKIROPATCH_DONE == status;
+}
+
+static bool patch_process(struct sekiropatch *session, pid_t pid, const struct after_patch *after_patch)
+{
+	if (!sekiropatch_start(session, pid)) {
+		fprintf(stderr, "sekiropatch_start() failed\n");
+		return false;
+	}
+
+	if (!run_session(session)) {
+		fprintf(stderr, "run_session() failed\n");
 		return false;
 	}
-	if (written > 64) {
-		fprintf(stderr, "path did not fit the buffer\n");
+
+	if (!run_after_patch(session_loop(session), sekiropatch_pid(session), session_targets(session), after_patch)) {
+		fprintf(stderr, "run_after_patch() failed\n");
 		return false;
 	}
 
-	FILE *f = fopen(path, "r+");
+	return true;
+}
+
+// Runs command and patches the game as soon as the command starts it. Returns the exit status of command, the game
+// is what the caller (Steam) cares about, so a failure to patch does not change it.
+static int launch(struct sekiropatch *session, time_t timeout, const struct after_patch *after_patch, char **command)
+{
+	struct launched_command launched = { 0 };
+	pid_t pid = 0;
+	if (!launch_and_find_sekiro(session_loop(session), command, timeout, &launched, &pid)) {
+		fprintf(stderr, "launch_and_find_sekiro() failed\n");
+		if (launched.child == -1) {
+			return EXIT_FAILURE;
+		}
+	} else if (!patch_process(session, pid, after_patch)) {
+		fprintf(stderr, "patch_process() failed\n");
+	}
+
+	return wait_for_command(&launched);
+}
+
+static bool replay(struct sekiropatch *session, const char *path, time_t timeout, const struct after_patch *after_patch)
+{
+	FILE *f = open_replay(path);
 	if (!f) {
-		perror("fopen() failed");
+		fprintf(stderr, "open_replay() failed\n");
 		return false;
 	}
 
 	struct context context = {
 		.f = f,
-		.pid = pid,
+		.loop = session_loop(session),
 		.timeout = timeout,
 	};
 
-	bool success = patch_attached_process_with_file(&context, arguments, arguments_size);
+	bool success = plan_run(session_plan(session), &context);
+	if (after_patch->sample_frames) {
+		fprintf(stderr, "%s does nothing when replaying, there are no frames to sample\n", COMMAND_SAMPLE_FRAMES);
+	}
+	if (after_patch->run_timeline) {
+		fprintf(stderr, "%s does nothing when replaying, there is no game to rewrite\n", COMMAND_FPS_TIMELINE);
+	}
+	if (after_patch->run_monitor) {
+		fprintf(stderr, "%s does nothing when replaying, there is no game to watch\n", COMMAND_MONITOR);
+	}
 
 	if (fclose(f) == EOF) {
 		perror("fclose() failed");
@@ -120,48 +265,76 @@ static bool patch_attached_process(pid_t pid, time_t timeout, char **arguments,
 	return success;
 }
 
-static bool patch(time_t timeout, char **arguments, int arguments_size)
+static int run(struct sekiropatch *session, time_t timeout, int argc, char *argv[])
 {
-	pid_t pid = 0;
-	if (!find_sekiro(timeout, &pid)) {
-		fprintf(stderr, "find_sekiro() failed\n");
-		return false;
-	}
+	struct after_patch after_patch = { 0 };
 
-	if (ptrace(PTRACE_ATTACH, pid, NULL, NULL) == -1) {
-		perror("ptrace(PTRACE_ATTACH, ...)");
-		return false;
-	}
+	if (!strcmp(argv[2], COMMAND_SELF_BENCH)) {
+		bool save = argc > 3 && !strcmp(argv[3], SELF_BENCH_SAVE);
+		if (argc > 4 || (argc == 4 && !save)) {
+			fprintf(stderr, "usage: %s <timeout-seconds> %s [%s]\n", argv[0], COMMAND_SELF_BENCH, SELF_BENCH_SAVE);
+			return EXIT_FAILURE;
+		}
 
-	bool success = patch_attached_process(pid, timeout, arguments, arguments_size);
+		if (!self_bench(save)) {
+			fprintf(stderr, "self_bench() failed\n");
+			return EXIT_FAILURE;
+		}
 
-	if (ptrace(PTRACE_DETACH, pid, NULL, NULL) == -1) {
-		perror("ptrace(PTRACE_DETACH, ...)");
-		return false;
+		return EXIT_SUCCESS;
 	}
 
-	while (sleep(1));
+	if (!strcmp(argv[2], COMMAND_REPLAY)) {
+		if (argc < 5) {
+			fprintf(stderr, "usage: %s <timeout-seconds> %s <snapshot-file> <argument> {<argument>}\n", argv[0],
+				COMMAND_REPLAY);
+			return EXIT_FAILURE;
+		}
+
+		if (!handle_arguments(session_plan(session), argv + 4, argc - 4, &after_patch)) {
+			fprintf(stderr, "handle_arguments() failed\n");
+			return EXIT_FAILURE;
+		}
+
+		if (!replay(session, argv[3], timeout, &after_patch)) {
+			fprintf(stderr, "replay() failed\n");
+			return EXIT_FAILURE;
+		}
 
-	if (kill(pid, SIGCONT) == -1) {
-		perror("kill() failed");
-		success = false;
+		return EXIT_SUCCESS;
 	}
 
-	return success;
-}
+	for (int i = 2; i < argc; ++i) {
+		if (!strcmp(argv[i], COMMAND_SEPARATOR)) {
+			if (i + 1 == argc) {
+				fprintf(stderr, "need a command to run after %s\n", COMMAND_SEPARATOR);
+				return EXIT_FAILURE;
+			}
 
-int main(int argc, char *argv[])
-{
-	if (!set_sigchld_handler()) {
-		fprintf(stderr, "set_sigchld_handler() failed\n");
+			if (!handle_arguments(session_plan(session), argv + 2, i - 2, &after_patch)) {
+				fprintf(stderr, "handle_arguments() failed\n");
+				return EXIT_FAILURE;
+			}
+
+			return launch(session, timeout, &after_patch, argv + i + 1);
+		}
+	}
+
+	if (!handle_arguments(session_plan(session), argv + 2, argc - 2, &after_patch)) {
+		fprintf(stderr, "handle_arguments() failed\n");
 		return EXIT_FAILURE;
 	}
 
-	if (!set_sigterm_handler()) {
-		fprintf(stderr, "set_sigterm_handler() failed\n");
+	if (!patch_process(session, 0, &after_patch)) {
+		fprintf(stderr, "patch_process() failed\n");
 		return EXIT_FAILURE;
 	}
 
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
 	if (argc < 1) {
 		fprintf(stderr, "need at least one argument\n");
 		return EXIT_FAILURE;
@@ -178,10 +351,29 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (!patch(timeout, argv + 2, argc - 2)) {
-		fprintf(stderr, "patch() failed\n");
+	struct sekiropatch *session = session_new(true);
+	if (!session) {
+		fprintf(stderr, "session_new() failed\n");
 		return EXIT_FAILURE;
 	}
+	session_place_threads(session);
+	sekiropatch_enable_tracing();
 
-	return EXIT_SUCCESS;
+	if (!sekiropatch_set_timeout(session, timeout)) {
+		fprintf(stderr, "sekiropatch_set_timeout() failed\n");
+		sekiropatch_free(session);
+		return EXIT_FAILURE;
+	}
+
+	if (!sekiropatch_set_cache(session, true)) {
+		fprintf(stderr, "sekiropatch_set_cache() failed\n");
+		sekiropatch_free(session);
+		return EXIT_FAILURE;
+	}
+
+	int status = run(session, timeout, argc, argv);
+
+	sekiropatch_free(session);
+
+	return status;
 }
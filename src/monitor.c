@@ -0,0 +1,211 @@
+#define _GNU_SOURCE 1
+
+#include "monitor.h"
+
+#include "loop.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define MIN_MONITOR_INTERVAL_MS 10
+#define MAX_MONITOR_INTERVAL_MS 60000
+// A write that keeps getting undone is something the game does on purpose, fighting it would stop the game every
+// interval.
+#define MAX_REAPPLIES 5
+
+struct patch_monitor {
+	pid_t pid;
+	const struct patch_targets *targets;
+	// Opened for the first write, before the game is stopped for it. Most runs never need it.
+	FILE *f;
+	uint8_t found[MAX_JOURNAL_ENTRIES][MAX_JOURNAL_BYTES];
+	unsigned reapplied[MAX_JOURNAL_ENTRIES];
+	uint64_t start_ns;
+	size_t reads;
+	size_t drifts;
+	size_t stops;
+	uint64_t stopped_ns;
+};
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Every write with a single process_vm_readv(), the game is never stopped for it.
+static bool read_patched(struct patch_monitor *monitor)
+{
+	const struct patch_targets *targets = monitor->targets;
+	struct iovec local[MAX_JOURNAL_ENTRIES];
+	struct iovec remote[MAX_JOURNAL_ENTRIES];
+	size_t expected = 0;
+	for (size_t i = 0; i < targets->patched_length; ++i) {
+		const struct patched_bytes *patched = &targets->patched[i];
+		local[i] = (struct iovec){ .iov_base = monitor->found[i], .iov_len = patched->length };
+		remote[i] = (struct iovec){ .iov_base = (void *)(uintptr_t)patched->position, .iov_len = patched->length };
+		expected += patched->length;
+	}
+
+	ssize_t read = process_vm_readv(monitor->pid, local, targets->patched_length, remote, targets->patched_length, 0);
+	if (read == -1) {
+		perror("process_vm_readv() failed");
+		return false;
+	}
+	if ((size_t)read != expected) {
+		fprintf(stderr, "process_vm_readv() read %zd bytes, expected %zu\n", read, expected);
+		return false;
+	}
+	monitor->reads += 1;
+
+	return true;
+}
+
+static void print_bytes(const uint8_t *bytes, size_t length)
+{
+	for (size_t i = 0; i < length; ++i) {
+		printf(" %02" PRIx8, bytes[i]);
+	}
+}
+
+// Writes every drifted span again in one stop, and puts back what was there when one of the writes fails.
+static bool reapply(struct patch_monitor *monitor, const bool *drifted)
+{
+	if (!monitor->f) {
+		monitor->f = open_process_memory(monitor->pid);
+		if (!monitor->f) {
+			fprintf(stderr, "open_process_memory() failed\n");
+			return false;
+		}
+	}
+
+	uint64_t stop_ns = monotonic_ns();
+	int signal = 0;
+	if (!loop_seize(monitor->pid, &signal)) {
+		fprintf(stderr, "loop_seize() failed\n");
+		return false;
+	}
+
+	const struct patch_targets *targets = monitor->targets;
+	struct write_journal journal = { 0 };
+	bool success = true;
+	for (size_t i = 0; i < targets->patched_length && success; ++i) {
+		const struct patched_bytes *patched = &targets->patched[i];
+		success = !drifted[i] || journal_write(&journal, patched->bytes, patched->length, patched->position,
+						       monitor->f);
+	}
+	if (!success) {
+		journal_rollback(&journal, monitor->f);
+	}
+
+	if (!loop_unseize(monitor->pid, signal)) {
+		fprintf(stderr, "loop_unseize() failed\n");
+		return false;
+	}
+	uint64_t stopped_ns = monotonic_ns() - stop_ns;
+	monitor->stops += 1;
+	monitor->stopped_ns += stopped_ns;
+	printf("%10.3f s wrote %zu spans again, stopped for %.1f us\n", (monotonic_ns() - monitor->start_ns) / 1e9,
+	       journal.length, stopped_ns / 1e3);
+	fflush(stdout);
+
+	return success;
+}
+
+static enum loop_status check_patched(void *data)
+{
+	struct patch_monitor *monitor = data;
+	if (!read_patched(monitor)) {
+		// The game was most likely closed.
+		fprintf(stderr, "read_patched() failed, stopping the monitor\n");
+		return LOOP_DONE;
+	}
+
+	const struct patch_targets *targets = monitor->targets;
+	bool drifted[MAX_JOURNAL_ENTRIES] = { 0 };
+	bool any = false;
+	for (size_t i = 0; i < targets->patched_length; ++i) {
+		const struct patched_bytes *patched = &targets->patched[i];
+		if (!memcmp(monitor->found[i], patched->bytes, patched->length)) {
+			continue;
+		}
+
+		monitor->drifts += 1;
+		printf("%10.3f s 0x%zx drifted, wrote", (monotonic_ns() - monitor->start_ns) / 1e9, patched->position);
+		print_bytes(patched->bytes, patched->length);
+		printf(", found");
+		print_bytes(monitor->found[i], patched->length);
+		if (monitor->reapplied[i] == MAX_REAPPLIES) {
+			printf(", changed %d times already, leaving it\n", MAX_REAPPLIES);
+			continue;
+		}
+		printf("\n");
+		monitor->reapplied[i] += 1;
+		drifted[i] = true;
+		any = true;
+	}
+	fflush(stdout);
+
+	if (any && !reapply(monitor, drifted)) {
+		fprintf(stderr, "reapply() failed\n");
+		return LOOP_FAILED;
+	}
+
+	return LOOP_CONTINUE;
+}
+
+bool parse_patch_monitoring(int argc, char *argv[], uint32_t *interval_ms_out)
+{
+	if (argc < 1) {
+		fprintf(stderr, "need an interval to monitor the patches\n");
+		return false;
+	}
+
+	if (!string_to_uint32(argv[0], 10, interval_ms_out) || *interval_ms_out < MIN_MONITOR_INTERVAL_MS ||
+	    *interval_ms_out > MAX_MONITOR_INTERVAL_MS) {
+		fprintf(stderr, "monitor interval needs to be between %d and %d ms\n", MIN_MONITOR_INTERVAL_MS,
+			MAX_MONITOR_INTERVAL_MS);
+		return false;
+	}
+
+	return true;
+}
+
+bool monitor_patches(struct loop *loop, pid_t pid, const struct patch_targets *targets, uint32_t interval_ms)
+{
+	if (!targets->patched_length) {
+		printf("nothing was patched, nothing to monitor\n");
+		return true;
+	}
+
+	struct patch_monitor monitor = {
+		.pid = pid,
+		.targets = targets,
+		.start_ns = monotonic_ns(),
+	};
+	printf("monitoring %zu writes every %" PRIu32 " ms\n", targets->patched_length, interval_ms);
+	fflush(stdout);
+	// Runs until the game exits or the patcher is told to stop, either is how a monitor is supposed to end.
+	struct loop_step step = {
+		.description = "monitoring the patches",
+		.timeout = -1,
+		.tick_ns = interval_ms * 1000000L,
+		.tick = check_patched,
+		.data = &monitor,
+	};
+	enum loop_status status = loop_run(loop, &step);
+
+	printf("%zu reads in %.1f s, %zu drifts, %zu stops for %.1f us in total\n", monitor.reads,
+	       (monotonic_ns() - monitor.start_ns) / 1e9, monitor.drifts, monitor.stops, monitor.stopped_ns / 1e3);
+	if (monitor.f && fclose(monitor.f) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return LOOP_FAILED != status;
+}
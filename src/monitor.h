@@ -0,0 +1,14 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct loop;
+
+bool parse_patch_monitoring(int argc, char *argv[], uint32_t *interval_ms_out);
+// Reads back every write the patches kept once every interval_ms until the game exits, and writes the ones that
+// changed again.
+bool monitor_patches(struct loop *loop, pid_t pid, const struct patch_targets *targets, uint32_t interval_ms);
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE 1
+
+#include "placement.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+// Wine starts a few dozen threads, the rest aren't looked at.
+#define MAX_PLACEMENT_THREADS 256
+// With no core the game can't use, the patcher sits on this many of the least busy ones.
+#define PLACEMENT_CORES 2
+// How much nicer than the game the patcher makes itself.
+#define PLACEMENT_NICE_STEP 5
+#define MAX_NICE 19
+
+// The fields of /proc/<pid>/task/<tid>/stat that matter here, numbered like proc(5) does.
+#define STAT_UTIME 14
+#define STAT_STIME 15
+#define STAT_NICE 19
+#define STAT_PROCESSOR 39
+
+struct thread_sample {
+	pid_t tid;
+	// utime + stime, in clock ticks.
+	uint64_t ticks;
+	long nice;
+	int processor;
+};
+
+struct placement {
+	pid_t pid;
+	// Where the patcher was allowed to run before and how nice it was, it gets both back at the end.
+	cpu_set_t original;
+	cpu_set_t pinned;
+	bool is_pinned;
+	int original_nice;
+	bool is_reniced;
+	struct thread_sample threads[MAX_PLACEMENT_THREADS];
+	size_t threads_length;
+	uint64_t sampled_ns;
+};
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// The name in parentheses may contain anything, the fields are counted from the last parenthesis.
+static bool parse_stat(char *stat, struct thread_sample *sample_out)
+{
+	char *close = strrchr(stat, ')');
+	if (!close) {
+		return false;
+	}
+
+	unsigned long long utime = 0;
+	unsigned long long stime = 0;
+	int found = 0;
+	char *saveptr = NULL;
+	int field = 3;
+	for (char *token = strtok_r(close + 1, " ", &saveptr); token && field <= STAT_PROCESSOR;
+	     token = strtok_r(NULL, " ", &saveptr), ++field) {
+		switch (field) {
+		case STAT_UTIME:
+			utime = strtoull(token, NULL, 10);
+			++found;
+			break;
+		case STAT_STIME:
+			stime = strtoull(token, NULL, 10);
+			++found;
+			break;
+		case STAT_NICE:
+			sample_out->nice = strtol(token, NULL, 10);
+			++found;
+			break;
+		case STAT_PROCESSOR:
+			sample_out->processor = (int)strtol(token, NULL, 10);
+			++found;
+			break;
+		default:
+			break;
+		}
+	}
+	sample_out->ticks = utime + stime;
+
+	return 4 == found;
+}
+
+// False for threads that exited in the meantime, which is nothing to complain about.
+static bool read_thread(pid_t pid, pid_t tid, struct thread_sample *sample_out)
+{
+	char path[64] = "";
+	long pid_long = pid;
+	long tid_long = tid;
+	snprintf(path, sizeof(path), "/proc/%ld/task/%ld/stat", pid_long, tid_long);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	char stat[1024] = "";
+	ssize_t read_size = read(fd, stat, sizeof(stat) - 1);
+	close(fd);
+	if (read_size <= 0) {
+		return false;
+	}
+	stat[read_size] = '\0';
+	sample_out->tid = tid;
+
+	return parse_stat(stat, sample_out);
+}
+
+// Every thread of the game, and every core any of them may run on.
+static bool sample_threads(pid_t pid, struct thread_sample *threads_out, size_t *threads_length_out,
+			   cpu_set_t *game_cpus_out)
+{
+	char path[64] = "";
+	long pid_long = pid;
+	snprintf(path, sizeof(path), "/proc/%ld/task", pid_long);
+	DIR *tasks = opendir(path);
+	if (!tasks) {
+		perror("opendir() failed");
+		return false;
+	}
+
+	CPU_ZERO(game_cpus_out);
+	size_t length = 0;
+	struct dirent *entry = NULL;
+	while (length < MAX_PLACEMENT_THREADS && (entry = readdir(tasks))) {
+		pid_t tid = (pid_t)strtol(entry->d_name, NULL, 10);
+		if (tid <= 0 || !read_thread(pid, tid, &threads_out[length])) {
+			continue;
+		}
+
+		cpu_set_t cpus;
+		if (sched_getaffinity(tid, sizeof(cpus), &cpus) == 0) {
+			CPU_OR(game_cpus_out, game_cpus_out, &cpus);
+		}
+		++length;
+	}
+	*threads_length_out = length;
+
+	if (closedir(tasks) == -1) {
+		perror("closedir() failed");
+		return false;
+	}
+
+	return true;
+}
+
+// The clock ticks the game spent on every core since the last sample. Threads are counted on the core they ran on
+// last, which is where they'll most likely run next.
+static void add_load(const struct placement *placement, const struct thread_sample *threads, size_t threads_length,
+		     uint64_t *load)
+{
+	for (size_t i = 0; i < threads_length; ++i) {
+		uint64_t before = 0;
+		for (size_t j = 0; j < placement->threads_length; ++j) {
+			if (placement->threads[j].tid == threads[i].tid) {
+				before = placement->threads[j].ticks;
+				break;
+			}
+		}
+		int processor = threads[i].processor;
+		if (processor >= 0 && processor < CPU_SETSIZE && threads[i].ticks > before) {
+			load[processor] += threads[i].ticks - before;
+		}
+	}
+}
+
+// The cores the patcher may use that the game may not, or else the least busy ones. False when there is nothing to
+// gain, with PLACEMENT_CORES or fewer to choose from.
+static bool pick_cores(const cpu_set_t *original, const cpu_set_t *game_cpus, const uint64_t *load,
+		       cpu_set_t *cores_out)
+{
+	CPU_ZERO(cores_out);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, original) && !CPU_ISSET(cpu, game_cpus)) {
+			CPU_SET(cpu, cores_out);
+		}
+	}
+	if (CPU_COUNT(cores_out)) {
+		return true;
+	}
+	if (CPU_COUNT(original) <= PLACEMENT_CORES) {
+		return false;
+	}
+
+	for (int picked = 0; picked < PLACEMENT_CORES; ++picked) {
+		int least = -1;
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, original) && !CPU_ISSET(cpu, cores_out) && (least < 0 || load[cpu] < load[least])) {
+				least = cpu;
+			}
+		}
+		CPU_SET(least, cores_out);
+	}
+
+	return true;
+}
+
+// Nicer than the game's main thread by PLACEMENT_NICE_STEP, never less nice than the patcher already is.
+static void lower_priority(struct placement *placement, long game_nice)
+{
+	errno = 0;
+	int nice = getpriority(PRIO_PROCESS, 0);
+	if (nice == -1 && errno) {
+		perror("getpriority() failed");
+		return;
+	}
+
+	long wanted = game_nice + PLACEMENT_NICE_STEP < MAX_NICE ? game_nice + PLACEMENT_NICE_STEP : MAX_NICE;
+	if (wanted <= nice) {
+		return;
+	}
+	if (setpriority(PRIO_PROCESS, 0, (int)wanted) == -1) {
+		perror("setpriority() failed");
+		return;
+	}
+	placement->original_nice = nice;
+	placement->is_reniced = true;
+}
+
+struct placement *placement_new(pid_t pid)
+{
+	struct placement *placement = calloc(1, sizeof(struct placement));
+	if (!placement) {
+		fprintf(stderr, "calloc() failed\n");
+		return NULL;
+	}
+	placement->pid = pid;
+	if (sched_getaffinity(0, sizeof(placement->original), &placement->original) == -1) {
+		perror("sched_getaffinity() failed");
+		free(placement);
+		return NULL;
+	}
+
+	cpu_set_t game_cpus;
+	if (!sample_threads(pid, placement->threads, &placement->threads_length, &game_cpus)) {
+		fprintf(stderr, "sample_threads() failed\n");
+		free(placement);
+		return NULL;
+	}
+	placement->sampled_ns = monotonic_ns();
+
+	for (size_t i = 0; i < placement->threads_length; ++i) {
+		if (placement->threads[i].tid == pid) {
+			lower_priority(placement, placement->threads[i].nice);
+		}
+	}
+
+	return placement;
+}
+
+bool placement_update(struct placement *placement)
+{
+	uint64_t now_ns = monotonic_ns();
+	if (now_ns - placement->sampled_ns < PLACEMENT_INTERVAL_NS) {
+		return true;
+	}
+
+	struct thread_sample threads[MAX_PLACEMENT_THREADS];
+	size_t threads_length = 0;
+	cpu_set_t game_cpus;
+	if (!sample_threads(placement->pid, threads, &threads_length, &game_cpus)) {
+		fprintf(stderr, "sample_threads() failed\n");
+		return false;
+	}
+	uint64_t load[CPU_SETSIZE] = { 0 };
+	add_load(placement, threads, threads_length, load);
+	memcpy(placement->threads, threads, threads_length * sizeof(struct thread_sample));
+	placement->threads_length = threads_length;
+	placement->sampled_ns = now_ns;
+
+	cpu_set_t cores;
+	if (!pick_cores(&placement->original, &game_cpus, load, &cores) ||
+	    (placement->is_pinned && CPU_EQUAL(&cores, &placement->pinned))) {
+		return true;
+	}
+	if (sched_setaffinity(0, sizeof(cores), &cores) == -1) {
+		perror("sched_setaffinity() failed");
+		return false;
+	}
+	placement->pinned = cores;
+	placement->is_pinned = true;
+
+	return true;
+}
+
+void placement_free(struct placement *placement)
+{
+	if (!placement) {
+		return;
+	}
+
+	if (placement->is_pinned && sched_setaffinity(0, sizeof(placement->original), &placement->original) == -1) {
+		perror("sched_setaffinity() failed");
+	}
+	// Going back to a lower nice value needs CAP_SYS_NICE or an RLIMIT_NICE that allows it.
+	if (placement->is_reniced && setpriority(PRIO_PROCESS, 0, placement->original_nice) == -1) {
+		perror("setpriority() failed, staying nicer");
+	}
+	free(placement);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// How often the game's threads are sampled while patching.
+#define PLACEMENT_INTERVAL_NS 250000000ULL
+
+// Keeps the patcher's thread off the cores the game is busy on while the game unpacks, from what
+// /proc/<pid>/task/*/stat says about its threads.
+struct placement;
+
+// Takes the first sample and makes the patcher nicer than the game.
+struct placement *placement_new(pid_t pid);
+// Samples the game again once PLACEMENT_INTERVAL_NS have passed and pins the patcher to the cores the game can't use,
+// or to the ones it used the least in between.
+bool placement_update(struct placement *placement);
+// Lets the patcher run everywhere it could before, and as nice as it was before where it is allowed to.
+void placement_free(struct placement *placement);
@@ -0,0 +1,1101 @@
+#define _POSIX_C_SOURCE 1
+
+#include "plan.h"
+
+#include "profile.h"
+#include "reader.h"
+#include "scan.h"
+#include "trace.h"
+#include "watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each window around a hint is only tried every this many times as often as the one before it, and the whole section
+// as rarely again after the widest, so ticks before the game unpacked stay cheap.
+#define HINT_WIDEN_EVERY 4
+#define HINT_WINDOWS 3
+
+// Stops in a row that may go over the budget before the batch gives up.
+#define MAX_STOP_OVERRUNS 3
+
+// On each side of a hint, from the smallest.
+static const size_t hint_windows[HINT_WINDOWS] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+
+// A pattern site that is waited for together with all the others.
+struct pending_site {
+	const struct pattern_site *site;
+	// Into the sections of the batch.
+	size_t section;
+	bool applied;
+	// Where the current tick found it, if it did.
+	bool found;
+	size_t index;
+	// Where the profile says it is, when the batch is watching for it.
+	size_t expected;
+	// Where the site was on this build or the last one.
+	bool has_hint;
+	size_t hint;
+	// The hint is where this build had its only match, so a match near it is the match. Other hints only tell when the
+	// section is worth reading whole.
+	bool trusts_hint;
+	// How far past the match the current tick made sure there is no other one, and whether there was.
+	size_t checked_end;
+	bool repeated;
+	// A copy of what apply() gets, so callers don't have to keep it around.
+	void *value;
+};
+
+// What a tick last saw of a page, to learn when the game finished writing it.
+struct page_state {
+	uint64_t hash;
+	// CLOCK_BOOTTIME, 0 if it didn't change since it was first seen.
+	uint64_t changed_ns;
+	bool seen;
+	// Read whole by the current tick.
+	bool fresh;
+};
+
+struct batch_section {
+	const char *name;
+	uint8_t *bytes;
+	size_t size;
+	size_t position;
+	// Sites in this section that are still waited for.
+	size_t pending;
+	// Where the part of bytes that is being read starts, and how much of bytes the current tick already looked through.
+	size_t run_start;
+	size_t scanned;
+	// One per PROFILE_PAGE_SIZE, NULL without a profile to learn for.
+	struct page_state *pages;
+	size_t pages_length;
+	uint64_t learned_ns;
+	// Counts the ticks that had something to look for in it.
+	size_t ticks;
+	// The current tick left out pages the profile said weren't due.
+	bool skipped;
+};
+
+// Every pattern site of a plan, looked for at once under one deadline.
+struct pattern_batch {
+	struct context *context;
+	struct pending_site sites[MAX_PLAN_ACTIONS];
+	size_t sites_length;
+	struct batch_section sections[MAX_PLAN_ACTIONS];
+	size_t sections_length;
+	struct section_reader reader;
+	// The section being read by the current tick.
+	size_t section;
+	size_t pending;
+	// When to start polling at the normal pace, 0 once it does.
+	uint64_t fast_at_ns;
+	// Site i is watched by debug register i while this is set.
+	bool watching;
+	// Set once the game wrote to a watched site, it's ahead of the page order then.
+	bool trapped;
+	// Set once a site showed up near its hint before the profile expected it, this launch is faster than the ones
+	// the page order was learned from.
+	bool ahead;
+	// What the step waits for, it shrinks as sites get applied.
+	char description[512];
+	uint64_t stop_budget_ns;
+	// When the game was stopped for the current tick's writes, what they overwrote and the sites they applied. All of
+	// it is undone when a write fails or the stop takes too long.
+	uint64_t stopped_ns;
+	struct write_journal journal;
+	struct pending_site *stop_sites[MAX_PLAN_ACTIONS];
+	size_t stop_sites_length;
+	unsigned overruns;
+};
+
+bool plan_add(struct patch_plan *plan, const struct plan_action *action)
+{
+	if (plan->actions_length == MAX_PLAN_ACTIONS) {
+		fprintf(stderr, "can't do more than %d things at once\n", MAX_PLAN_ACTIONS);
+		if (action->free) {
+			action->free(action->data);
+		}
+		return false;
+	}
+
+	plan->actions[plan->actions_length++] = *action;
+
+	return true;
+}
+
+// Only scans every PROFILE_IDLE_TICK_NS until shortly before the first pending pattern is expected, they are still
+// found should they show up early, just a little later.
+static bool pick_pace(struct pattern_batch *batch)
+{
+	if (!batch->fast_at_ns) {
+		return true;
+	}
+
+	uint64_t now_ns = 0;
+	if (!boottime_ns(&now_ns)) {
+		fprintf(stderr, "boottime_ns() failed\n");
+		return false;
+	}
+	if (now_ns < batch->fast_at_ns) {
+		return true;
+	}
+
+	batch->fast_at_ns = 0;
+	if (!loop_set_tick(batch->context->loop, LOOP_POLL_INTERVAL_NS)) {
+		fprintf(stderr, "loop_set_tick() failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void describe_pending(struct pattern_batch *batch)
+{
+	size_t length = 0;
+	size_t pending = 0;
+	for (size_t i = 0; i < batch->sites_length && length < sizeof(batch->description); ++i) {
+		if (batch->sites[i].applied) {
+			continue;
+		}
+		int written = snprintf(batch->description + length, sizeof(batch->description) - length, "%s%s",
+				       pending ? ", " : "looking for ", batch->sites[i].site->description);
+		length += written > 0 ? (size_t)written : 0;
+		pending += 1;
+	}
+	if (length < sizeof(batch->description)) {
+		snprintf(batch->description + length, sizeof(batch->description) - length, " pattern%s",
+			 pending > 1 ? "s" : "");
+	}
+}
+
+static bool apply_site(struct pattern_batch *batch, struct pending_site *pending, size_t index)
+{
+	struct batch_section *section = &batch->sections[pending->section];
+	struct pattern_match match = {
+		.section_bytes = section->bytes,
+		.section_size = section->size,
+		.section_position = section->position,
+		.index = index,
+	};
+	if (!pending->site->apply(batch->context, &match, pending->value)) {
+		fprintf(stderr, "applying %s failed\n", pending->site->name);
+		return false;
+	}
+
+	// Not knowing next time is no reason to fail this time.
+	bool unique = pending->trusts_hint ||
+		      (!section->skipped && pending->checked_end == section->size && !pending->repeated);
+	if (batch->context->profile && !profile_record(batch->context->profile, pending->site->name, index, unique)) {
+		fprintf(stderr, "profile_record() failed\n");
+	}
+
+	trace_emit(TRACE_MATCH, pending - batch->sites, section->position + index, 0);
+	pending->applied = true;
+	section->pending -= 1;
+	batch->pending -= 1;
+
+	return true;
+}
+
+static uint64_t read_stop_budget_ns(void)
+{
+	const char *text = getenv(STOP_BUDGET_ENVIRONMENT_VARIABLE);
+	if (!text) {
+		return DEFAULT_STOP_BUDGET_US * 1000ULL;
+	}
+
+	char *end = NULL;
+	unsigned long long budget_us = strtoull(text, &end, 10);
+	if (end == text || *end || !budget_us) {
+		fprintf(stderr, "%s must be a positive number of microseconds, using %d\n", STOP_BUDGET_ENVIRONMENT_VARIABLE,
+			DEFAULT_STOP_BUDGET_US);
+		return DEFAULT_STOP_BUDGET_US * 1000ULL;
+	}
+
+	return budget_us * 1000ULL;
+}
+
+static bool begin_stop(struct pattern_batch *batch)
+{
+	if (!loop_stop_tracee(batch->context->loop)) {
+		fprintf(stderr, "loop_stop_tracee() failed\n");
+		return false;
+	}
+	if (!boottime_ns(&batch->stopped_ns)) {
+		fprintf(stderr, "boottime_ns() failed\n");
+		return false;
+	}
+	batch->journal.length = 0;
+	batch->stop_sites_length = 0;
+	batch->context->journal = &batch->journal;
+
+	return true;
+}
+
+// Puts back what the stop wrote and waits for its sites again. The game is still stopped.
+static bool undo_stop(struct pattern_batch *batch)
+{
+	trace_emit(TRACE_ROLLBACK, batch->journal.length, batch->stop_sites_length, 0);
+	bool success = journal_rollback(&batch->journal, batch->context->f);
+	for (size_t i = 0; i < batch->stop_sites_length; ++i) {
+		struct pending_site *pending = batch->stop_sites[i];
+		pending->applied = false;
+		batch->sections[pending->section].pending += 1;
+		batch->pending += 1;
+	}
+	batch->stop_sites_length = 0;
+	batch->context->journal = NULL;
+	if (success) {
+		fprintf(stderr, "undid the writes, sekiro.exe is as it was before this stop\n");
+	}
+
+	return success;
+}
+
+static bool over_budget(struct pattern_batch *batch, uint64_t *elapsed_ns_out)
+{
+	uint64_t now_ns = 0;
+	if (!boottime_ns(&now_ns)) {
+		fprintf(stderr, "boottime_ns() failed\n");
+		return true;
+	}
+	*elapsed_ns_out = now_ns - batch->stopped_ns;
+
+	return *elapsed_ns_out > batch->stop_budget_ns;
+}
+
+// Undoes a stop that took too long and lets the game go, a later tick writes the sites again. Gives up once that
+// keeps happening.
+static enum loop_status overrun(struct pattern_batch *batch, uint64_t elapsed_ns)
+{
+	fprintf(stderr, "sekiro.exe was stopped for %.1f us, more than the %.1f us allowed\n", elapsed_ns / 1e3,
+		batch->stop_budget_ns / 1e3);
+	bool undone = undo_stop(batch);
+	describe_pending(batch);
+	if (!loop_continue_tracee(batch->context->loop)) {
+		fprintf(stderr, "loop_continue_tracee() failed\n");
+		return LOOP_FAILED;
+	}
+	if (!undone) {
+		fprintf(stderr, "undo_stop() failed\n");
+		return LOOP_FAILED;
+	}
+	if (++batch->overruns == MAX_STOP_OVERRUNS) {
+		fprintf(stderr, "%d stops in a row took too long, giving up\n", MAX_STOP_OVERRUNS);
+		return LOOP_FAILED;
+	}
+
+	return LOOP_CONTINUE;
+}
+
+// Whether the rest of the section still matters for the site: it wasn't found yet, or it was and the rest of the
+// section tells whether that was its only match.
+static bool wants_rest(const struct pending_site *pending)
+{
+	return !pending->applied && (!pending->found || (!pending->trusts_hint && !pending->repeated));
+}
+
+// Looks for the patterns of the section being read in what arrived since the last call. Scanners skip a match ending
+// on the last byte they get, so each call goes back a whole pattern and the first match is the same as scanning the
+// whole section at once. Past a match, it looks for a second one, unless the site is known to have only one. The rest
+// of the section isn't read once nothing in it wants more.
+static bool scan_ready_bytes(void *data, size_t ready_length)
+{
+	struct pattern_batch *batch = data;
+	struct batch_section *section = &batch->sections[batch->section];
+	size_t ready_end = section->run_start + ready_length;
+	bool wanted = false;
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		struct pending_site *pending = &batch->sites[i];
+		const struct pattern_site *site = pending->site;
+		if (!wants_rest(pending) || pending->section != batch->section) {
+			continue;
+		}
+
+		size_t overlap = site->pattern_bytes_length;
+		size_t from = section->scanned > section->run_start + overlap ? section->scanned - overlap
+									     : section->run_start;
+		size_t index = 0;
+		if (!pending->found && scan_buffer(site->pattern_bytes, site->pattern_bytes_length, section->bytes + from,
+						   ready_end - from, &index)) {
+			pending->found = true;
+			pending->index = from + index;
+		}
+		if (pending->found && !pending->trusts_hint) {
+			size_t after = pending->index + 1 > from ? pending->index + 1 : from;
+			pending->repeated = after < ready_end &&
+					    scan_buffer(site->pattern_bytes, site->pattern_bytes_length, section->bytes + after,
+							ready_end - after, &index);
+			pending->checked_end = ready_end;
+		}
+		wanted = wanted || wants_rest(pending);
+	}
+	section->scanned = ready_end;
+
+	return wanted;
+}
+
+// Only has to tell whether a page changed between two reads. Four lanes, so the multiplications don't wait for each
+// other.
+static uint64_t hash_page(const uint8_t *bytes, size_t length)
+{
+	uint64_t lanes[4] = { length, 1, 2, 3 };
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		for (size_t j = 0; j < 4; ++j) {
+			uint64_t word = 0;
+			memcpy(&word, bytes + i + j * 8, sizeof(word));
+			lanes[j] = (lanes[j] ^ word) * 0x9e3779b97f4a7c15ULL;
+			lanes[j] ^= lanes[j] >> 29;
+		}
+	}
+	for (; i < length; ++i) {
+		lanes[0] = (lanes[0] ^ bytes[i]) * 0x100000001b3ULL;
+	}
+
+	return lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+}
+
+// Marks the pages read whole from start to end, learn_pages() looks at them.
+static void mark_fresh(struct batch_section *section, size_t start, size_t end)
+{
+	for (size_t page = start / PROFILE_PAGE_SIZE; page < section->pages_length; ++page) {
+		size_t page_end = (page + 1) * PROFILE_PAGE_SIZE < section->size ? (page + 1) * PROFILE_PAGE_SIZE
+										 : section->size;
+		if (page_end > end) {
+			return;
+		}
+		section->pages[page].fresh = true;
+	}
+}
+
+// Notes which of the pages the tick read changed since they were last seen.
+static void learn_pages(struct batch_section *section, uint64_t now_ns)
+{
+	for (size_t page = 0; page < section->pages_length; ++page) {
+		struct page_state *state = &section->pages[page];
+		if (!state->fresh) {
+			continue;
+		}
+		state->fresh = false;
+
+		size_t page_start = page * PROFILE_PAGE_SIZE;
+		size_t page_end = page_start + PROFILE_PAGE_SIZE < section->size ? page_start + PROFILE_PAGE_SIZE
+										: section->size;
+		uint64_t hash = hash_page(section->bytes + page_start, page_end - page_start);
+		if (state->seen && hash != state->hash) {
+			state->changed_ns = now_ns;
+		}
+		state->hash = hash;
+		state->seen = true;
+	}
+}
+
+// The page order only holds while this launch is as slow as the one it was learned from. Once the game wrote a site,
+// a site showed up earlier than it used to or something turned up, the pages still to come may be done too.
+static bool page_order_holds(const struct pattern_batch *batch)
+{
+	if (!batch->context->profile || batch->trapped || batch->ahead) {
+		return false;
+	}
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		if (batch->sites[i].applied || batch->sites[i].found) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static size_t section_missing(const struct pattern_batch *batch, size_t section_index)
+{
+	size_t missing = 0;
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		const struct pending_site *pending = &batch->sites[i];
+		if (pending->section == section_index && !pending->applied && !pending->found) {
+			++missing;
+		}
+	}
+
+	return missing;
+}
+
+static bool section_wanted(const struct pattern_batch *batch, size_t section_index)
+{
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		if (batch->sites[i].section == section_index && wants_rest(&batch->sites[i])) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Reads the section and scans it while it is being read, leaving out the pages the profile says the game won't be
+// done with for a while, until page_order_holds() says otherwise. The pages that are read go in runs from the start, so
+// the first match stays the first match.
+// Learns when pages change every PROFILE_IDLE_TICK_NS, that's precise enough for the next launch, and on the tick that
+// finds the last pattern of the section, the pages that matter most change right before it.
+static bool read_due_pages(struct pattern_batch *batch, size_t section_index)
+{
+	struct batch_section *section = &batch->sections[section_index];
+	const struct unpack_profile *profile = batch->context->profile;
+	uint64_t now_ns = 0;
+	if (profile && !boottime_ns(&now_ns)) {
+		fprintf(stderr, "boottime_ns() failed\n");
+		return false;
+	}
+	size_t pages = (section->size + PROFILE_PAGE_SIZE - 1) / PROFILE_PAGE_SIZE;
+	size_t page = 0;
+	while (page < pages && section_wanted(batch, section_index)) {
+		bool skipping = page_order_holds(batch);
+		if (skipping && !profile_page_due(profile, section->name, page, now_ns)) {
+			section->skipped = true;
+			++page;
+			continue;
+		}
+		size_t first = page;
+		while (page < pages && (!skipping || profile_page_due(profile, section->name, page, now_ns))) {
+			++page;
+		}
+
+		size_t start = first * PROFILE_PAGE_SIZE;
+		size_t end = page * PROFILE_PAGE_SIZE < section->size ? page * PROFILE_PAGE_SIZE : section->size;
+		section->run_start = start;
+		section->scanned = start;
+		if (!reader_read(&batch->reader, section->bytes + start, end - start, section->position + start,
+				 scan_ready_bytes, batch)) {
+			fprintf(stderr, "reader_read() failed\n");
+			return false;
+		}
+		if (section->pages) {
+			mark_fresh(section, start, section->scanned);
+		}
+	}
+
+	bool learning = now_ns >= section->learned_ns + PROFILE_IDLE_TICK_NS || !section_missing(batch, section_index);
+	if (section->pages && learning) {
+		section->learned_ns = now_ns;
+		learn_pages(section, now_ns);
+	}
+
+	return true;
+}
+
+// Reads and scans the first windows around the hint.
+static bool search_around_hint(struct pattern_batch *batch, struct batch_section *section,
+			       struct pending_site *pending, size_t windows)
+{
+	const struct pattern_site *site = pending->site;
+	for (size_t i = 0; i < windows; ++i) {
+		size_t start = pending->hint > hint_windows[i] ? pending->hint - hint_windows[i] : 0;
+		size_t end = pending->hint + site->pattern_bytes_length + hint_windows[i];
+		if (end > section->size) {
+			end = section->size;
+		}
+		if (start >= end) {
+			return false;
+		}
+
+		size_t index = 0;
+		if (!reader_read(&batch->reader, section->bytes + start, end - start, section->position + start, NULL,
+				 NULL)) {
+			fprintf(stderr, "reader_read() failed\n");
+			return false;
+		}
+		if (scan_buffer(site->pattern_bytes, site->pattern_bytes_length, section->bytes + start, end - start,
+				&index)) {
+			pending->index = start + index;
+			return true;
+		}
+		if (!start && end == section->size) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+// Whether the site showed up before the earliest time it did on the launches the profile remembers.
+static bool is_early(const struct pattern_batch *batch, const struct pending_site *pending)
+{
+	uint64_t ready_ns = 0;
+	uint64_t now_ns = 0;
+	if (!profile_predict(batch->context->profile, pending->site->name, &ready_ns) || !boottime_ns(&now_ns)) {
+		return false;
+	}
+
+	return now_ns < ready_ns;
+}
+
+// Tries the hinted sites of the section first and tells whether it still has to be read whole: for sites without a
+// hint, and every so often for hinted ones that weren't near their hint. The first tick reads it whole.
+static bool search_hints(struct pattern_batch *batch, size_t section_index)
+{
+	struct batch_section *section = &batch->sections[section_index];
+	size_t tick = section->ticks++;
+	size_t windows = 0;
+	size_t every = 1;
+	while (windows < HINT_WINDOWS && !(tick % every)) {
+		++windows;
+		every *= HINT_WIDEN_EVERY;
+	}
+	bool full_read_due = windows == HINT_WINDOWS && !(tick % every);
+	bool needs_full_read = false;
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		struct pending_site *pending = &batch->sites[i];
+		if (pending->applied || pending->section != section_index) {
+			continue;
+		}
+
+		if (!pending->has_hint || full_read_due) {
+			needs_full_read = true;
+			continue;
+		}
+		bool near_hint = search_around_hint(batch, section, pending, windows);
+		batch->ahead = batch->ahead || (near_hint && is_early(batch, pending));
+		// Another match may come first in the section, only reading it whole tells.
+		if (near_hint && !pending->trusts_hint) {
+			needs_full_read = true;
+			continue;
+		}
+		pending->found = near_hint;
+	}
+
+	return needs_full_read;
+}
+
+// Reads every section that still has pending sites once and looks for all of their patterns in it while it is being
+// read. The game is only stopped when something was found, once every section was read, and everything that was found
+// is applied in the same stop. No reading counts against the stop budget.
+static enum loop_status search_patterns(void *data)
+{
+	struct pattern_batch *batch = data;
+	trace_emit(TRACE_TICK, batch->pending, 0, 0);
+	if (!pick_pace(batch)) {
+		return LOOP_FAILED;
+	}
+
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		batch->sites[i].found = false;
+		batch->sites[i].checked_end = 0;
+		batch->sites[i].repeated = false;
+	}
+	for (size_t i = 0; i < batch->sections_length; ++i) {
+		batch->sections[i].skipped = false;
+		if (!batch->sections[i].pending) {
+			continue;
+		}
+		batch->section = i;
+		if (search_hints(batch, i) && !read_due_pages(batch, i)) {
+			fprintf(stderr, "read_due_pages() failed\n");
+		}
+	}
+
+	bool stopped = false;
+	uint64_t elapsed_ns = 0;
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		struct pending_site *pending = &batch->sites[i];
+		if (pending->applied || !pending->found) {
+			continue;
+		}
+
+		if (!stopped && !begin_stop(batch)) {
+			fprintf(stderr, "begin_stop() failed\n");
+			return LOOP_FAILED;
+		}
+		stopped = true;
+		if (over_budget(batch, &elapsed_ns)) {
+			return overrun(batch, elapsed_ns);
+		}
+		if (!apply_site(batch, pending, pending->index)) {
+			undo_stop(batch);
+			return LOOP_FAILED;
+		}
+		batch->stop_sites[batch->stop_sites_length++] = pending;
+	}
+	if (stopped && over_budget(batch, &elapsed_ns)) {
+		return overrun(batch, elapsed_ns);
+	}
+	if (stopped) {
+		if (batch->context->targets) {
+			journal_keep(&batch->journal, batch->context->targets);
+		}
+		batch->context->journal = NULL;
+		batch->overruns = 0;
+	}
+
+	if (!batch->pending) {
+		return LOOP_DONE;
+	}
+	if (stopped) {
+		describe_pending(batch);
+		if (!loop_continue_tracee(batch->context->loop)) {
+			fprintf(stderr, "loop_continue_tracee() failed\n");
+			return LOOP_FAILED;
+		}
+	}
+
+	return LOOP_CONTINUE;
+}
+
+// The first quadword of the site that doesn't hold its pattern yet, the pattern can't be complete before the game
+// writes there. Sets in_place_out instead when there is none.
+static bool find_unwritten(struct pattern_batch *batch, const struct pending_site *pending, bool *in_place_out,
+			   uint64_t *address_out)
+{
+	const struct pattern_site *site = pending->site;
+	uint64_t position = batch->sections[pending->section].position + pending->expected;
+	uint8_t *bytes = calloc(site->pattern_bytes_length, sizeof(uint8_t));
+	if (!bytes) {
+		fprintf(stderr, "calloc() failed\n");
+		return false;
+	}
+
+	bool success = reader_read(&batch->reader, bytes, site->pattern_bytes_length, position, NULL, NULL);
+	*in_place_out = true;
+	for (size_t i = 0; success && i < site->pattern_bytes_length; ++i) {
+		if (!site->pattern_bytes[i].is_ignored && bytes[i] != site->pattern_bytes[i].value) {
+			*in_place_out = false;
+			*address_out = position + i - (position + i) % WATCHPOINT_SIZE;
+			break;
+		}
+	}
+
+	free(bytes);
+	if (!success) {
+		fprintf(stderr, "reader_read() failed\n");
+	}
+
+	return success;
+}
+
+// Watches what is left to write of a site, or its last quadword once nothing is.
+static bool watch_unwritten(struct pattern_batch *batch, size_t slot, bool *in_place_out)
+{
+	const struct pending_site *pending = &batch->sites[slot];
+	uint64_t address = 0;
+	if (!find_unwritten(batch, pending, in_place_out, &address)) {
+		fprintf(stderr, "find_unwritten() failed\n");
+		return false;
+	}
+	if (*in_place_out) {
+		address = batch->sections[pending->section].position + pending->expected +
+			  pending->site->pattern_bytes_length - 1;
+		address -= address % WATCHPOINT_SIZE;
+	}
+
+	return watch_set(batch->context->loop->pid, slot, address);
+}
+
+// The unpacker wrote to a site that was still incomplete. The sections only get read once a pattern is in place
+// where the profile expects it, until then the watchpoint moves on to what is still missing. Only the thread that
+// wrote is held by the trap, so a site that is in place is written by a tick that stops the whole game, right away.
+static enum loop_status watch_trap(void *data, bool *own_out)
+{
+	struct pattern_batch *batch = data;
+	unsigned hits = 0;
+	if (!batch->watching) {
+		return LOOP_CONTINUE;
+	}
+	if (!watch_take_hits(batch->context->loop->pid, &hits)) {
+		fprintf(stderr, "watch_take_hits() failed\n");
+		return LOOP_FAILED;
+	}
+	if (!hits) {
+		return LOOP_CONTINUE;
+	}
+	*own_out = true;
+	batch->trapped = true;
+
+	bool due = false;
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		bool in_place = false;
+		if (!(hits & (1U << i)) || batch->sites[i].applied) {
+			continue;
+		}
+		if (!watch_unwritten(batch, i, &in_place)) {
+			fprintf(stderr, "watch_unwritten() failed\n");
+			return LOOP_FAILED;
+		}
+		due = due || in_place;
+	}
+	trace_emit(TRACE_TRAP, hits, due, 0);
+	if (!due) {
+		return LOOP_CONTINUE;
+	}
+
+	batch->fast_at_ns = 0;
+	if (!loop_set_tick(batch->context->loop, LOOP_POLL_INTERVAL_NS)) {
+		fprintf(stderr, "loop_set_tick() failed\n");
+		return LOOP_FAILED;
+	}
+
+	return LOOP_CONTINUE;
+}
+
+// Sets a write watchpoint on every site if the profile knows where all of them are and there are few enough.
+// Scanning alone finds them otherwise.
+static bool watch_sites(struct pattern_batch *batch)
+{
+	struct loop *loop = batch->context->loop;
+	batch->watching = false;
+	if (!batch->context->profile || !loop->traced || batch->sites_length > MAX_WATCHPOINTS) {
+		return true;
+	}
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		struct pending_site *pending = &batch->sites[i];
+		if (!profile_locate(batch->context->profile, pending->site->name, &pending->expected) ||
+		    pending->expected + pending->site->pattern_bytes_length >= batch->sections[pending->section].size) {
+			return true;
+		}
+	}
+
+	// Debug registers can only be changed while the tracee is stopped, the step continues it.
+	if (!loop_stop_tracee(loop)) {
+		fprintf(stderr, "loop_stop_tracee() failed\n");
+		return false;
+	}
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		// Sites that are already in place get found by the first tick.
+		bool in_place = false;
+		if (!watch_unwritten(batch, i, &in_place)) {
+			fprintf(stderr, "watch_unwritten() failed, scanning instead\n");
+			return watch_clear_all(loop->pid);
+		}
+	}
+	batch->watching = true;
+
+	return true;
+}
+
+// Watchpoints left behind would hit a game that has no tracer to catch them anymore.
+static bool unwatch_sites(struct pattern_batch *batch, enum loop_status status)
+{
+	if (!batch->watching) {
+		return true;
+	}
+	batch->watching = false;
+	if (LOOP_EXITED == status) {
+		return true;
+	}
+
+	struct loop *loop = batch->context->loop;
+	if (!loop_stop_tracee(loop)) {
+		fprintf(stderr, "loop_stop_tracee() failed\n");
+		return false;
+	}
+	if (!watch_clear_all(loop->pid)) {
+		fprintf(stderr, "watch_clear_all() failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void free_sections(struct pattern_batch *batch)
+{
+	for (size_t i = 0; i < batch->sections_length; ++i) {
+		free(batch->sections[i].bytes);
+		batch->sections[i].bytes = NULL;
+		free(batch->sections[i].pages);
+		batch->sections[i].pages = NULL;
+	}
+	reader_free(&batch->reader);
+}
+
+static bool find_sections_of_sites(struct pattern_batch *batch)
+{
+	for (size_t i = 0; i < batch->sections_length; ++i) {
+		struct batch_section *section = &batch->sections[i];
+		if (!find_section_info(section->name, batch->context->f, &section->position, &section->size)) {
+			fprintf(stderr, "find_section_info(\"%s\", ...) failed\n", section->name);
+			return false;
+		}
+
+		section->bytes = calloc(section->size, sizeof(uint8_t));
+		if (!section->bytes) {
+			fprintf(stderr, "calloc() failed\n");
+			return false;
+		}
+
+		section->learned_ns = 0;
+		section->pages_length = 0;
+		if (!batch->context->profile) {
+			continue;
+		}
+		section->pages_length = (section->size + PROFILE_PAGE_SIZE - 1) / PROFILE_PAGE_SIZE;
+		section->pages = calloc(section->pages_length, sizeof(struct page_state));
+		if (!section->pages) {
+			fprintf(stderr, "calloc() failed\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// The idle pace only pays off when every pending site has a prediction, the earliest one decides. Watched sites are
+// not polled for at all until a while after the last one was due, in case the watchpoints never fire.
+static long pick_first_tick(struct pattern_batch *batch)
+{
+	batch->fast_at_ns = 0;
+	if (!batch->context->profile) {
+		return LOOP_POLL_INTERVAL_NS;
+	}
+
+	uint64_t earliest_ns = UINT64_MAX;
+	uint64_t latest_ns = 0;
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		uint64_t ready_ns = 0;
+		if (!profile_predict(batch->context->profile, batch->sites[i].site->name, &ready_ns)) {
+			return LOOP_POLL_INTERVAL_NS;
+		}
+		if (ready_ns < earliest_ns) {
+			earliest_ns = ready_ns;
+		}
+		if (ready_ns > latest_ns) {
+			latest_ns = ready_ns;
+		}
+	}
+
+	uint64_t fast_at_ns = 0;
+	if (batch->watching) {
+		fast_at_ns = latest_ns + PROFILE_MARGIN_NS;
+	} else if (earliest_ns > PROFILE_MARGIN_NS) {
+		fast_at_ns = earliest_ns - PROFILE_MARGIN_NS;
+	}
+	uint64_t now_ns = 0;
+	if (!boottime_ns(&now_ns) || now_ns >= fast_at_ns) {
+		return LOOP_POLL_INTERVAL_NS;
+	}
+	batch->fast_at_ns = fast_at_ns;
+
+	return batch->watching ? (long)(fast_at_ns - now_ns) : PROFILE_IDLE_TICK_NS;
+}
+
+// Scans every poll interval until all patterns showed up and leaves the game stopped once they did.
+static bool begin_batch(struct context *context, void *data, struct loop_step *step_out)
+{
+	struct pattern_batch *batch = data;
+	batch->context = context;
+	batch->pending = batch->sites_length;
+	batch->stop_budget_ns = read_stop_budget_ns();
+	batch->overruns = 0;
+	batch->trapped = false;
+	batch->ahead = false;
+	for (size_t i = 0; i < batch->sections_length; ++i) {
+		batch->sections[i].pending = 0;
+		batch->sections[i].ticks = 0;
+	}
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		struct pending_site *pending = &batch->sites[i];
+		pending->applied = false;
+		pending->has_hint = context->profile && profile_hint(context->profile, pending->site->name, &pending->hint,
+								     &pending->trusts_hint);
+		pending->trusts_hint = pending->has_hint && pending->trusts_hint;
+		batch->sections[pending->section].pending += 1;
+	}
+
+	if (!find_sections_of_sites(batch)) {
+		free_sections(batch);
+		return false;
+	}
+	if (!reader_init(&batch->reader, context->f)) {
+		fprintf(stderr, "reader_init() failed\n");
+		free_sections(batch);
+		return false;
+	}
+	if (!watch_sites(batch)) {
+		fprintf(stderr, "watch_sites() failed\n");
+		free_sections(batch);
+		return false;
+	}
+	describe_pending(batch);
+
+	*step_out = (struct loop_step){
+		.description = batch->description,
+		.timeout = context->timeout,
+		.tick_ns = pick_first_tick(batch),
+		.tick = search_patterns,
+		.trap = watch_trap,
+		.data = batch,
+	};
+
+	return true;
+}
+
+// Pages are ready once they changed for the last time, the ones that never changed are ready whenever.
+static bool record_page_order(struct pattern_batch *batch)
+{
+	struct unpack_profile *profile = batch->context->profile;
+	for (size_t i = 0; i < batch->sections_length; ++i) {
+		struct batch_section *section = &batch->sections[i];
+		if (!section->pages) {
+			continue;
+		}
+
+		uint32_t *ready_ms = calloc(section->pages_length, sizeof(uint32_t));
+		if (!ready_ms) {
+			fprintf(stderr, "calloc() failed\n");
+			return false;
+		}
+		for (size_t j = 0; j < section->pages_length; ++j) {
+			uint64_t changed_ns = section->pages[j].changed_ns;
+			ready_ms[j] = changed_ns > profile->start_ns ? (changed_ns - profile->start_ns) / 1000000 : 0;
+		}
+		bool success = profile_record_pages(profile, section->name, ready_ms, section->pages_length);
+		free(ready_ms);
+		if (!success) {
+			fprintf(stderr, "profile_record_pages() failed\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool finish_batch(struct context *context, void *data, enum loop_status status)
+{
+	struct pattern_batch *batch = data;
+
+	// Only a launch that found everything knows when the pages were done.
+	if (LOOP_DONE == status && context->profile && !record_page_order(batch)) {
+		fprintf(stderr, "record_page_order() failed\n");
+	}
+
+	// Sections are large, there's no need to hold on to them until the whole plan is done.
+	free_sections(batch);
+
+	return unwatch_sites(batch, status) && LOOP_DONE == status;
+}
+
+static void free_batch(void *data)
+{
+	struct pattern_batch *batch = data;
+	free_sections(batch);
+	for (size_t i = 0; i < batch->sites_length; ++i) {
+		free(batch->sites[i].value);
+	}
+	free(batch);
+}
+
+static bool add_batch(struct patch_plan *plan)
+{
+	plan->patterns = calloc(1, sizeof(struct pattern_batch));
+	if (!plan->patterns) {
+		fprintf(stderr, "calloc() failed\n");
+		return false;
+	}
+
+	struct plan_action action = {
+		.begin = begin_batch,
+		.finish = finish_batch,
+		.free = free_batch,
+		.data = plan->patterns,
+	};
+	if (!plan_add(plan, &action)) {
+		plan->patterns = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static size_t add_section(struct pattern_batch *batch, const char *name)
+{
+	for (size_t i = 0; i < batch->sections_length; ++i) {
+		if (!strcmp(batch->sections[i].name, name)) {
+			return i;
+		}
+	}
+	batch->sections[batch->sections_length].name = name;
+
+	return batch->sections_length++;
+}
+
+// All pattern sites of a plan end up in one action, in the place of the first one.
+bool plan_add_pattern(struct patch_plan *plan, const struct pattern_site *site, const void *value, size_t value_size)
+{
+	if (!plan->patterns && !add_batch(plan)) {
+		fprintf(stderr, "add_batch() failed\n");
+		return false;
+	}
+
+	struct pattern_batch *batch = plan->patterns;
+	if (batch->sites_length == MAX_PLAN_ACTIONS) {
+		fprintf(stderr, "can't look for more than %d patterns at once\n", MAX_PLAN_ACTIONS);
+		return false;
+	}
+
+	struct pending_site *pending = &batch->sites[batch->sites_length];
+	*pending = (struct pending_site){ .site = site };
+	if (value_size) {
+		pending->value = malloc(value_size);
+		if (!pending->value) {
+			fprintf(stderr, "malloc() failed\n");
+			return false;
+		}
+		memcpy(pending->value, value, value_size);
+	}
+	pending->section = add_section(batch, site->section);
+	batch->sites_length += 1;
+
+	return true;
+}
+
+void plan_free(struct patch_plan *plan)
+{
+	for (size_t i = 0; i < plan->actions_length; ++i) {
+		if (plan->actions[i].free) {
+			plan->actions[i].free(plan->actions[i].data);
+		}
+	}
+	plan->actions_length = 0;
+	plan->patterns = NULL;
+}
+
+size_t plan_pattern_sites(const struct patch_plan *plan, const struct pattern_site **sites_out, size_t sites_size)
+{
+	size_t length = 0;
+	for (size_t i = 0; plan->patterns && i < plan->patterns->sites_length && length < sites_size; ++i) {
+		sites_out[length++] = plan->patterns->sites[i].site;
+	}
+
+	return length;
+}
+
+bool plan_begin_action(struct patch_plan *plan, size_t index, struct context *context, struct loop_step *step_out)
+{
+	struct plan_action *action = &plan->actions[index];
+
+	return action->begin(context, action->data, step_out);
+}
+
+bool plan_finish_action(struct patch_plan *plan, size_t index, struct context *context, enum loop_status status)
+{
+	struct plan_action *action = &plan->actions[index];
+
+	return action->finish(context, action->data, status);
+}
+
+// Runs every action to completion, blocking in the loop until each is done.
+bool plan_run(struct patch_plan *plan, struct context *context)
+{
+	for (size_t i = 0; i < plan->actions_length; ++i) {
+		struct loop_step step = { 0 };
+		if (!plan_begin_action(plan, i, context, &step)) {
+			fprintf(stderr, "plan_begin_action() failed\n");
+			return false;
+		}
+
+		enum loop_status status = loop_run(context->loop, &step);
+		if (!plan_finish_action(plan, i, context, status)) {
+			fprintf(stderr, "plan_finish_action() failed\n");
+			return false;
+		}
+	}
+
+	return true;
+}
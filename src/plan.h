@@ -0,0 +1,64 @@
+#pragma once
+
+#include "common.h"
+#include "loop.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_PLAN_ACTIONS 16
+// How long the game may stay stopped for the writes of one tick, in microseconds. Writes that take longer are undone
+// and tried again on a later tick.
+#define STOP_BUDGET_ENVIRONMENT_VARIABLE "SEKIROFPSUNLOCK_STOP_BUDGET_US"
+#define DEFAULT_STOP_BUDGET_US 20000
+
+// One thing to do to the attached game. Actions run one after another, each as a step of the loop.
+struct plan_action {
+	// Fills in the step, the game may be stopped or running.
+	bool (*begin)(struct context *context, void *data, struct loop_step *step_out);
+	// Gets how the step ended. The game is stopped after a step that found what it waited for, so this is where it
+	// gets written to, unless the tick already stopped it to write.
+	bool (*finish)(struct context *context, void *data, enum loop_status status);
+	void (*free)(void *data);
+	void *data;
+};
+
+// Where a pattern was found, section_bytes holds the section as it was read by the scan that found it.
+struct pattern_match {
+	const uint8_t *section_bytes;
+	size_t section_size;
+	size_t section_position;
+	size_t index;
+};
+
+// A patch that goes where a pattern shows up in a section. All sites of a plan are waited for at once and each is
+// applied as soon as its pattern shows up.
+struct pattern_site {
+	// Identifies the pattern in the unpack profile.
+	const char *name;
+	// Finishes "timeout reached while looking for ... pattern".
+	const char *description;
+	const char *section;
+	const struct ignorable_byte *pattern_bytes;
+	size_t pattern_bytes_length;
+	bool (*apply)(struct context *context, const struct pattern_match *match, const void *value);
+};
+
+struct pattern_batch;
+
+struct patch_plan {
+	struct plan_action actions[MAX_PLAN_ACTIONS];
+	size_t actions_length;
+	// The action that waits for every pattern site, NULL until one is added.
+	struct pattern_batch *patterns;
+};
+
+bool plan_add(struct patch_plan *plan, const struct plan_action *action);
+bool plan_add_pattern(struct patch_plan *plan, const struct pattern_site *site, const void *value, size_t value_size);
+void plan_free(struct patch_plan *plan);
+// The sites of every pattern action, at most sites_size of them.
+size_t plan_pattern_sites(const struct patch_plan *plan, const struct pattern_site **sites_out, size_t sites_size);
+bool plan_begin_action(struct patch_plan *plan, size_t index, struct context *context, struct loop_step *step_out);
+bool plan_finish_action(struct patch_plan *plan, size_t index, struct context *context, enum loop_status status);
+bool plan_run(struct patch_plan *plan, struct context *context);
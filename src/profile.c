@@ -0,0 +1,650 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "profile.h"
+
+#include "common.h"
+#include "sekiro.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+bool boottime_ns(uint64_t *ns_out)
+{
+	struct timespec now = { 0 };
+	if (clock_gettime(CLOCK_BOOTTIME, &now) == -1) {
+		perror("clock_gettime() failed");
+		return false;
+	}
+	*ns_out = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+
+	return true;
+}
+
+// $XDG_CACHE_HOME/sekirofpsunlock, or ~/.cache/sekirofpsunlock like the spec says when it isn't set.
+static bool cache_directory(char *path_out, size_t path_size)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int written = 0;
+	if (cache_home && *cache_home) {
+		written = snprintf(path_out, path_size, "%s/%s", cache_home, PROFILE_DIRECTORY);
+	} else if (home && *home) {
+		written = snprintf(path_out, path_size, "%s/.cache/%s", home, PROFILE_DIRECTORY);
+	} else {
+		fprintf(stderr, "neither XDG_CACHE_HOME nor HOME are set\n");
+		return false;
+	}
+	if (written < 0 || (size_t)written >= path_size) {
+		fprintf(stderr, "snprintf() failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool make_directory(const char *path)
+{
+	if (mkdir(path, 0755) == -1 && EEXIST != errno) {
+		perror("mkdir() failed");
+		return false;
+	}
+
+	return true;
+}
+
+static bool make_cache_directory(char *path_out, size_t path_size)
+{
+	if (!cache_directory(path_out, path_size)) {
+		fprintf(stderr, "cache_directory() failed\n");
+		return false;
+	}
+	// The cache directory itself may not exist yet either.
+	char *parent_end = strrchr(path_out, '/');
+	if (parent_end && parent_end != path_out) {
+		*parent_end = '\0';
+		bool made = make_directory(path_out);
+		*parent_end = '/';
+		if (!made) {
+			return false;
+		}
+	}
+
+	return make_directory(path_out);
+}
+
+// The index of the entry for name, entries_length if there is none.
+static size_t find_in(const struct profile_entry *entries, size_t entries_length, const char *name)
+{
+	size_t i = 0;
+	while (i < entries_length && strcmp(entries[i].name, name)) {
+		++i;
+	}
+
+	return i;
+}
+
+static size_t find_entry(const struct unpack_profile *profile, const char *name)
+{
+	return find_in(profile->entries, profile->entries_length, name);
+}
+
+// "@" and the offset in hex, or "=" for an offset that was the only match in its section. Profiles from before
+// offsets were remembered don't have it.
+static bool read_offset(struct profile_entry *entry, const char *token)
+{
+	uint32_t offset = 0;
+	if (!string_to_uint32(token + 1, 16, &offset)) {
+		return false;
+	}
+	entry->offset = offset;
+	entry->has_offset = true;
+	entry->unique = '=' == token[0];
+
+	return true;
+}
+
+// One line per pattern: its name, optionally where it was found, and the delays in milliseconds, oldest first.
+static bool read_entries(FILE *f, const char *path, struct profile_entry *entries, size_t *entries_length)
+{
+	char line[512] = "";
+	while (fgets(line, sizeof(line), f) && *entries_length < MAX_PROFILE_ENTRIES) {
+		char *save = NULL;
+		const char *name = strtok_r(line, " \n", &save);
+		if (!name || strlen(name) >= MAX_PROFILE_NAME) {
+			continue;
+		}
+
+		struct profile_entry *entry = &entries[*entries_length];
+		*entry = (struct profile_entry){ 0 };
+		strcpy(entry->name, name);
+		for (const char *delay = strtok_r(NULL, " \n", &save); delay && entry->delays_length < PROFILE_HISTORY;
+		     delay = strtok_r(NULL, " \n", &save)) {
+			uint32_t delay_ms = 0;
+			if (('@' == delay[0] || '=' == delay[0]) && !entry->has_offset && !entry->delays_length) {
+				if (!read_offset(entry, delay)) {
+					fprintf(stderr, "ignoring a broken line in %s\n", path);
+					break;
+				}
+				continue;
+			}
+			if (!string_to_uint32(delay, 10, &delay_ms)) {
+				fprintf(stderr, "ignoring a broken line in %s\n", path);
+				entry->delays_length = 0;
+				break;
+			}
+			entry->delays_ms[entry->delays_length++] = delay_ms;
+		}
+
+		if (entry->delays_length) {
+			++*entries_length;
+		}
+	}
+
+	if (ferror(f)) {
+		fprintf(stderr, "fgets() failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool read_file(const char *path, struct profile_entry *entries, size_t *entries_length)
+{
+	FILE *in = fopen(path, "r");
+	if (!in) {
+		if (ENOENT == errno) {
+			return true;
+		}
+		perror("fopen() failed");
+		return false;
+	}
+
+	bool success = read_entries(in, path, entries, entries_length);
+
+	if (fclose(in) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
+
+static struct page_order *find_page_order(const struct unpack_profile *profile, const char *section)
+{
+	for (size_t i = 0; i < profile->page_orders_length; ++i) {
+		if (!strcmp(profile->page_orders[i].section, section)) {
+			return (struct page_order *)&profile->page_orders[i];
+		}
+	}
+
+	return NULL;
+}
+
+// One line per section: its name and when each of its pages was ready, in milliseconds.
+static bool read_pages(FILE *f, const char *path, struct unpack_profile *profile)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, f) != -1 && profile->page_orders_length < MAX_PROFILE_SECTIONS) {
+		char *save = NULL;
+		const char *section = strtok_r(line, " \n", &save);
+		if (!section || strlen(section) >= sizeof(profile->page_orders[0].section)) {
+			continue;
+		}
+
+		struct page_order *order = &profile->page_orders[profile->page_orders_length];
+		order->pages_length = 0;
+		strcpy(order->section, section);
+		for (const char *ready = strtok_r(NULL, " \n", &save); ready && order->pages_length < MAX_PROFILE_PAGES;
+		     ready = strtok_r(NULL, " \n", &save)) {
+			if (!string_to_uint32(ready, 10, &order->ready_ms[order->pages_length])) {
+				fprintf(stderr, "ignoring a broken line in %s\n", path);
+				order->pages_length = 0;
+				break;
+			}
+			order->pages_length += 1;
+		}
+
+		if (order->pages_length) {
+			++profile->page_orders_length;
+		}
+	}
+	free(line);
+
+	if (ferror(f)) {
+		fprintf(stderr, "getline() failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool read_pages_file(struct unpack_profile *profile)
+{
+	FILE *in = fopen(profile->pages_path, "r");
+	if (!in) {
+		if (ENOENT == errno) {
+			return true;
+		}
+		perror("fopen() failed");
+		return false;
+	}
+
+	bool success = read_pages(in, profile->pages_path, profile);
+
+	if (fclose(in) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
+
+// Finds the profile of the build that is running as pid. A build that was never seen before gets an empty one, with
+// the offsets of the build that was seen last as hints.
+bool profile_load(struct unpack_profile *profile, FILE *f, pid_t pid)
+{
+	*profile = (struct unpack_profile){ 0 };
+
+	uint32_t time_date_stamp = 0;
+	if (!find_time_date_stamp(f, &time_date_stamp)) {
+		fprintf(stderr, "find_time_date_stamp() failed\n");
+		return false;
+	}
+
+	if (!find_process_start_ns(pid, &profile->start_ns)) {
+		fprintf(stderr, "find_process_start_ns() failed\n");
+		return false;
+	}
+
+	char directory[PATH_MAX] = "";
+	if (!cache_directory(directory, sizeof(directory))) {
+		fprintf(stderr, "cache_directory() failed\n");
+		return false;
+	}
+	int written = snprintf(profile->path, sizeof(profile->path), "%s/%08" PRIx32 ".profile", directory,
+			       time_date_stamp);
+	if (written < 0 || (size_t)written >= sizeof(profile->path)) {
+		fprintf(stderr, "snprintf() failed\n");
+		return false;
+	}
+
+	if (!read_file(profile->path, profile->entries, &profile->entries_length)) {
+		fprintf(stderr, "read_file() failed\n");
+		return false;
+	}
+	written = snprintf(profile->pages_path, sizeof(profile->pages_path), "%s/%08" PRIx32 ".pages", directory,
+			   time_date_stamp);
+	// The unpack order only makes scans cheaper, the patterns are found without it too.
+	if (written < 0 || (size_t)written >= sizeof(profile->pages_path) || !read_pages_file(profile)) {
+		fprintf(stderr, "failed to read the page order in %s\n", profile->pages_path);
+		profile->page_orders_length = 0;
+	}
+	if (profile->entries_length) {
+		return true;
+	}
+
+	char latest[PATH_MAX + sizeof(PROFILE_LATEST) + 1] = "";
+	written = snprintf(latest, sizeof(latest), "%s/%s", directory, PROFILE_LATEST);
+	// Going without hints only makes finding the patterns slower.
+	if (written < 0 || (size_t)written >= sizeof(latest) ||
+	    !read_file(latest, profile->hints, &profile->hints_length)) {
+		fprintf(stderr, "failed to read the hints in %s\n", latest);
+		profile->hints_length = 0;
+	}
+
+	return true;
+}
+
+static bool write_entries(const struct unpack_profile *profile, FILE *out)
+{
+	for (size_t i = 0; i < profile->entries_length; ++i) {
+		const struct profile_entry *entry = &profile->entries[i];
+		if (fputs(entry->name, out) == EOF) {
+			perror("fputs() failed");
+			return false;
+		}
+		if (entry->has_offset && fprintf(out, " %c%zx", entry->unique ? '=' : '@', entry->offset) < 0) {
+			perror("fprintf() failed");
+			return false;
+		}
+		for (size_t j = 0; j < entry->delays_length; ++j) {
+			if (fprintf(out, " %" PRIu32, entry->delays_ms[j]) < 0) {
+				perror("fprintf() failed");
+				return false;
+			}
+		}
+		if (fputc('\n', out) == EOF) {
+			perror("fputc() failed");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Points PROFILE_LATEST at path, replacing the link atomically like the profile itself.
+static bool link_latest(const char *directory, const char *path)
+{
+	char latest[PATH_MAX + sizeof(PROFILE_LATEST) + 1] = "";
+	char temporary[PATH_MAX + sizeof(PROFILE_LATEST) + 24] = "";
+	int latest_written = snprintf(latest, sizeof(latest), "%s/%s", directory, PROFILE_LATEST);
+	int temporary_written = snprintf(temporary, sizeof(temporary), "%s.%ld", latest, (long)getpid());
+	if (latest_written < 0 || (size_t)latest_written >= sizeof(latest) || temporary_written < 0 ||
+	    (size_t)temporary_written >= sizeof(temporary)) {
+		fprintf(stderr, "snprintf() failed\n");
+		return false;
+	}
+
+	const char *name = strrchr(path, '/');
+	if (symlink(name ? name + 1 : path, temporary) == -1) {
+		perror("symlink() failed");
+		return false;
+	}
+	if (rename(temporary, latest) == -1) {
+		perror("rename() failed");
+		remove(temporary);
+		return false;
+	}
+
+	return true;
+}
+
+static bool write_pages(const struct unpack_profile *profile, FILE *out)
+{
+	for (size_t i = 0; i < profile->page_orders_length; ++i) {
+		const struct page_order *order = &profile->page_orders[i];
+		if (fputs(order->section, out) == EOF) {
+			perror("fputs() failed");
+			return false;
+		}
+		for (size_t j = 0; j < order->pages_length; ++j) {
+			if (fprintf(out, " %" PRIu32, order->ready_ms[j]) < 0) {
+				perror("fprintf() failed");
+				return false;
+			}
+		}
+		if (fputc('\n', out) == EOF) {
+			perror("fputc() failed");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Writes a temporary file first, two launches at once must not leave half a profile behind.
+static bool replace_file(const struct unpack_profile *profile, const char *path,
+			 bool (*write)(const struct unpack_profile *profile, FILE *out))
+{
+	char temporary[PATH_MAX + 24] = "";
+	int written = snprintf(temporary, sizeof(temporary), "%s.%ld", path, (long)getpid());
+	if (written < 0 || (size_t)written >= sizeof(temporary)) {
+		fprintf(stderr, "snprintf() failed\n");
+		return false;
+	}
+
+	FILE *out = fopen(temporary, "w");
+	if (!out) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	bool success = write(profile, out);
+
+	if (fclose(out) == EOF) {
+		perror("fclose() failed");
+		success = false;
+	}
+	if (success && rename(temporary, path) == -1) {
+		perror("rename() failed");
+		success = false;
+	}
+	if (!success) {
+		remove(temporary);
+		return false;
+	}
+
+	return true;
+}
+
+bool profile_save(const struct unpack_profile *profile)
+{
+	if (!profile->changed) {
+		return true;
+	}
+
+	char directory[PATH_MAX] = "";
+	if (!make_cache_directory(directory, sizeof(directory))) {
+		fprintf(stderr, "make_cache_directory() failed\n");
+		return false;
+	}
+
+	if (!replace_file(profile, profile->path, write_entries)) {
+		fprintf(stderr, "replace_file() failed\n");
+		return false;
+	}
+	if (profile->page_orders_length && !replace_file(profile, profile->pages_path, write_pages)) {
+		fprintf(stderr, "replace_file() failed\n");
+		return false;
+	}
+
+	return link_latest(directory, profile->path);
+}
+
+// The earliest the pattern showed up on any of the remembered launches, false if it never did.
+bool profile_predict(const struct unpack_profile *profile, const char *name, uint64_t *ready_ns_out)
+{
+	size_t index = find_entry(profile, name);
+	if (index == profile->entries_length) {
+		return false;
+	}
+	const struct profile_entry *entry = &profile->entries[index];
+
+	uint32_t earliest_ms = entry->delays_ms[0];
+	for (size_t i = 1; i < entry->delays_length; ++i) {
+		if (entry->delays_ms[i] < earliest_ms) {
+			earliest_ms = entry->delays_ms[i];
+		}
+	}
+	*ready_ns_out = profile->start_ns + (uint64_t)earliest_ms * 1000000ULL;
+
+	return true;
+}
+
+// Where in its section the pattern was found last time, false if that isn't known.
+bool profile_locate(const struct unpack_profile *profile, const char *name, size_t *offset_out)
+{
+	size_t index = find_entry(profile, name);
+	if (index == profile->entries_length || !profile->entries[index].has_offset) {
+		return false;
+	}
+	*offset_out = profile->entries[index].offset;
+
+	return true;
+}
+
+// Where the pattern is likely to be, from this build or else the one seen last. Trusted when this build had its only
+// match there, a match near any other hint may not be the first one in the section.
+bool profile_hint(const struct unpack_profile *profile, const char *name, size_t *offset_out, bool *trusted_out)
+{
+	if (profile_locate(profile, name, offset_out)) {
+		*trusted_out = profile->entries[find_entry(profile, name)].unique;
+		return true;
+	}
+	*trusted_out = false;
+
+	size_t index = find_in(profile->hints, profile->hints_length, name);
+	if (index == profile->hints_length || !profile->hints[index].has_offset) {
+		return false;
+	}
+	*offset_out = profile->hints[index].offset;
+
+	return true;
+}
+
+// Remembers that the pattern showed up just now at offset into its section, and whether that was its only match,
+// forgetting the oldest launch once the history is full.
+bool profile_record(struct unpack_profile *profile, const char *name, size_t offset, bool unique)
+{
+	uint64_t now_ns = 0;
+	if (!boottime_ns(&now_ns)) {
+		fprintf(stderr, "boottime_ns() failed\n");
+		return false;
+	}
+	uint64_t delay_ms = now_ns > profile->start_ns ? (now_ns - profile->start_ns) / 1000000ULL : 0;
+	if (delay_ms > UINT32_MAX) {
+		delay_ms = UINT32_MAX;
+	}
+
+	size_t index = find_entry(profile, name);
+	if (index == profile->entries_length) {
+		if (profile->entries_length == MAX_PROFILE_ENTRIES || strlen(name) >= MAX_PROFILE_NAME) {
+			fprintf(stderr, "can't remember when %s showed up\n", name);
+			return false;
+		}
+		profile->entries[index] = (struct profile_entry){ 0 };
+		strcpy(profile->entries[index].name, name);
+		++profile->entries_length;
+	}
+	struct profile_entry *entry = &profile->entries[index];
+
+	if (entry->delays_length == PROFILE_HISTORY) {
+		memmove(entry->delays_ms, entry->delays_ms + 1, (PROFILE_HISTORY - 1) * sizeof(entry->delays_ms[0]));
+		--entry->delays_length;
+	}
+	entry->delays_ms[entry->delays_length++] = (uint32_t)delay_ms;
+	entry->offset = offset;
+	entry->has_offset = true;
+	entry->unique = unique;
+	profile->changed = true;
+
+	return true;
+}
+
+// Whether the page should be done by now, or at least soon. Pages nothing is known about always are.
+bool profile_page_due(const struct unpack_profile *profile, const char *section, size_t page, uint64_t now_ns)
+{
+	const struct page_order *order = find_page_order(profile, section);
+	if (!order || page >= order->pages_length) {
+		return true;
+	}
+
+	return profile->start_ns + order->ready_ms[page] * 1000000ULL <= now_ns + PROFILE_MARGIN_NS;
+}
+
+// Keeps the earliest time any launch saw a page done, a launch that went faster than the last ones must not wait for
+// pages. A 0 only says the launch didn't see the page change, it keeps what earlier ones saw.
+bool profile_record_pages(struct unpack_profile *profile, const char *section, const uint32_t *ready_ms,
+			  size_t pages_length)
+{
+	if (pages_length > MAX_PROFILE_PAGES) {
+		pages_length = MAX_PROFILE_PAGES;
+	}
+
+	struct page_order *order = find_page_order(profile, section);
+	if (order) {
+		for (size_t i = 0; i < pages_length; ++i) {
+			uint32_t known_ms = i < order->pages_length ? order->ready_ms[i] : 0;
+			order->ready_ms[i] = ready_ms[i] && (!known_ms || ready_ms[i] < known_ms) ? ready_ms[i] : known_ms;
+		}
+		order->pages_length = pages_length;
+		profile->changed = true;
+
+		return true;
+	}
+
+	if (strlen(section) >= sizeof(profile->page_orders[0].section)) {
+		fprintf(stderr, "section name %s is too long\n", section);
+		return false;
+	}
+	if (profile->page_orders_length == MAX_PROFILE_SECTIONS) {
+		fprintf(stderr, "can't remember the page order of more than %d sections\n", MAX_PROFILE_SECTIONS);
+		return false;
+	}
+	order = &profile->page_orders[profile->page_orders_length++];
+	strcpy(order->section, section);
+	memcpy(order->ready_ms, ready_ms, pages_length * sizeof(uint32_t));
+	order->pages_length = pages_length;
+	profile->changed = true;
+
+	return true;
+}
+
+static bool scanner_path(char *path_out, size_t path_size, bool create)
+{
+	char directory[PATH_MAX] = "";
+	if (!(create ? make_cache_directory(directory, sizeof(directory)) : cache_directory(directory, sizeof(directory)))) {
+		return false;
+	}
+	int written = snprintf(path_out, path_size, "%s/%s", directory, PROFILE_SCANNER);
+	if (written < 0 || (size_t)written >= path_size) {
+		fprintf(stderr, "snprintf() failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Leaves name_out empty when no scanner was stored yet.
+bool profile_load_scanner(char *name_out, size_t name_size)
+{
+	name_out[0] = '\0';
+
+	char path[PATH_MAX + sizeof(PROFILE_SCANNER) + 1] = "";
+	if (!scanner_path(path, sizeof(path), false)) {
+		return false;
+	}
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		if (ENOENT == errno) {
+			return true;
+		}
+		perror("fopen() failed");
+		return false;
+	}
+
+	if (!fgets(name_out, name_size, f)) {
+		name_out[0] = '\0';
+	}
+	name_out[strcspn(name_out, "\n")] = '\0';
+
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return true;
+}
+
+bool profile_save_scanner(const char *name)
+{
+	char path[PATH_MAX + sizeof(PROFILE_SCANNER) + 1] = "";
+	if (!scanner_path(path, sizeof(path), true)) {
+		return false;
+	}
+
+	FILE *out = fopen(path, "w");
+	if (!out) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	bool success = fprintf(out, "%s\n", name) >= 0;
+	if (!success) {
+		fprintf(stderr, "fprintf() failed\n");
+	}
+
+	if (fclose(out) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
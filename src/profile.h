@@ -0,0 +1,76 @@
+#pragma once
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define PROFILE_DIRECTORY "sekirofpsunlock"
+// Links to the profile that was saved last, other builds take their hints from it.
+#define PROFILE_LATEST "latest"
+// Names the scanner self-bench found fastest on this machine.
+#define PROFILE_SCANNER "scanner"
+#define MAX_PROFILE_ENTRIES 16
+#define MAX_PROFILE_NAME 32
+#define PROFILE_HISTORY 8
+// How often a pattern is looked for until shortly before it showed up on earlier launches.
+#define PROFILE_IDLE_TICK_NS 100000000L
+// How long before its earliest known time a pattern gets polled for at the normal pace.
+#define PROFILE_MARGIN_NS 1000000000ULL
+// Pages of a section, as far as the unpack order goes. 128 MiB of them are plenty for the game's sections.
+#define PROFILE_PAGE_SIZE (64 * 1024)
+#define MAX_PROFILE_PAGES 2048
+#define MAX_PROFILE_SECTIONS 4
+
+// How long after the game started a pattern showed up on the last few launches, and where.
+struct profile_entry {
+	char name[MAX_PROFILE_NAME];
+	// In milliseconds, oldest first.
+	uint32_t delays_ms[PROFILE_HISTORY];
+	size_t delays_length;
+	// Into the pattern's section, as of the last launch.
+	size_t offset;
+	bool has_offset;
+	// The whole section was read on that launch and the offset was its only match.
+	bool unique;
+};
+
+// When the game last changed each page of a section on the last launch, in milliseconds after it started. Pages that
+// didn't change while they were looked at are 0, they can be read whenever.
+struct page_order {
+	char section[9];
+	uint32_t ready_ms[MAX_PROFILE_PAGES];
+	size_t pages_length;
+};
+
+// What was learned about one build of the game, stored in the cache directory under its PE time stamp.
+struct unpack_profile {
+	char path[PATH_MAX];
+	// CLOCK_BOOTTIME nanoseconds.
+	uint64_t start_ns;
+	struct profile_entry entries[MAX_PROFILE_ENTRIES];
+	size_t entries_length;
+	// From the build that was seen last, when this one was never seen before.
+	struct profile_entry hints[MAX_PROFILE_ENTRIES];
+	size_t hints_length;
+	// Next to the profile, in the order the sections were first looked at.
+	char pages_path[PATH_MAX];
+	struct page_order page_orders[MAX_PROFILE_SECTIONS];
+	size_t page_orders_length;
+	bool changed;
+};
+
+bool profile_load(struct unpack_profile *profile, FILE *f, pid_t pid);
+bool profile_save(const struct unpack_profile *profile);
+bool profile_predict(const struct unpack_profile *profile, const char *name, uint64_t *ready_ns_out);
+bool profile_locate(const struct unpack_profile *profile, const char *name, size_t *offset_out);
+bool profile_hint(const struct unpack_profile *profile, const char *name, size_t *offset_out, bool *trusted_out);
+bool profile_record(struct unpack_profile *profile, const char *name, size_t offset, bool unique);
+bool profile_page_due(const struct unpack_profile *profile, const char *section, size_t page, uint64_t now_ns);
+bool profile_record_pages(struct unpack_profile *profile, const char *section, const uint32_t *ready_ms,
+			  size_t pages_length);
+bool profile_load_scanner(char *name_out, size_t name_size);
+bool profile_save_scanner(const char *name);
+bool boottime_ns(uint64_t *ns_out);
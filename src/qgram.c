@@ -0,0 +1,200 @@
+#include "qgram.h"
+
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define QGRAM_LENGTH 3
+// 256 KiB of bucket starts, few enough buckets that building stays cheap and enough that a bucket is short.
+#ifndef QGRAM_BUCKET_BITS
+#define QGRAM_BUCKET_BITS 16
+#endif
+#define QGRAM_BUCKETS (1U << QGRAM_BUCKET_BITS)
+// The low bits of a bucket fit a byte.
+#define QGRAM_LOW_BUCKETS 256U
+#define QGRAM_PARTITIONS (QGRAM_BUCKETS / QGRAM_LOW_BUCKETS)
+
+static uint32_t gram_at(const uint8_t *bytes)
+{
+	return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16;
+}
+
+static uint32_t bucket_of(uint32_t gram)
+{
+	return (gram * 0x9e3779b1U) >> (32 - QGRAM_BUCKET_BITS);
+}
+
+// The offsets of one partition, in order, with the low bits of their buckets. The buckets of a partition are next to
+// each other in offsets and few enough to stay in the cache while it is filled.
+static void fill_partition(const uint32_t *from, const uint8_t *low_buckets, size_t length, uint32_t *cursors,
+			   uint32_t *offsets)
+{
+	for (size_t i = 0; i < length; ++i) {
+		offsets[cursors[low_buckets[i]]++] = from[i];
+	}
+}
+
+// Sorts the offsets in two passes, by the top bits of their bucket first and then by the rest. Scattering every
+// offset straight to its bucket writes all over offsets and takes several times as long.
+static bool fill_index(struct qgram_index *index, size_t grams)
+{
+	uint32_t *partitioned = malloc((grams ? grams : 1) * sizeof(uint32_t));
+	if (!partitioned) {
+		fprintf(stderr, "malloc() failed\n");
+		return false;
+	}
+	uint8_t *low_buckets = malloc(grams ? grams : 1);
+	if (!low_buckets) {
+		fprintf(stderr, "malloc() failed\n");
+		free(partitioned);
+		return false;
+	}
+
+	// A partition starts where its first bucket does.
+	uint32_t cursors[QGRAM_PARTITIONS > QGRAM_LOW_BUCKETS ? QGRAM_PARTITIONS : QGRAM_LOW_BUCKETS];
+	for (size_t p = 0; p < QGRAM_PARTITIONS; ++p) {
+		cursors[p] = index->starts[p * QGRAM_LOW_BUCKETS];
+	}
+	for (size_t i = 0; i < grams; ++i) {
+		uint32_t bucket = bucket_of(gram_at(index->bytes + i));
+		uint32_t at = cursors[bucket / QGRAM_LOW_BUCKETS]++;
+		partitioned[at] = i;
+		low_buckets[at] = bucket % QGRAM_LOW_BUCKETS;
+	}
+
+	for (size_t p = 0; p < QGRAM_PARTITIONS; ++p) {
+		const uint32_t *starts = index->starts + p * QGRAM_LOW_BUCKETS;
+		memcpy(cursors, starts, QGRAM_LOW_BUCKETS * sizeof(uint32_t));
+		fill_partition(partitioned + starts[0], low_buckets + starts[0], starts[QGRAM_LOW_BUCKETS] - starts[0],
+			       cursors, index->offsets);
+	}
+
+	free(low_buckets);
+	free(partitioned);
+
+	return true;
+}
+
+bool qgram_build(const uint8_t *bytes, size_t size, struct qgram_index *index_out)
+{
+	*index_out = (struct qgram_index){ .bytes = bytes, .size = size };
+	if (size > UINT32_MAX) {
+		fprintf(stderr, "can't index more than 4 GiB\n");
+		return false;
+	}
+	size_t grams = size >= QGRAM_LENGTH ? size - QGRAM_LENGTH + 1 : 0;
+
+	index_out->starts = calloc(QGRAM_BUCKETS + 1, sizeof(uint32_t));
+	if (!index_out->starts) {
+		fprintf(stderr, "calloc() failed\n");
+		return false;
+	}
+	index_out->offsets = malloc((grams ? grams : 1) * sizeof(uint32_t));
+	if (!index_out->offsets) {
+		fprintf(stderr, "malloc() failed\n");
+		qgram_free(index_out);
+		return false;
+	}
+
+	// Counts every bucket, then turns the counts into where the buckets start.
+	uint32_t *starts = index_out->starts;
+	for (size_t i = 0; i < grams; ++i) {
+		starts[bucket_of(gram_at(bytes + i)) + 1] += 1;
+	}
+	for (size_t b = 0; b < QGRAM_BUCKETS; ++b) {
+		starts[b + 1] += starts[b];
+	}
+
+	if (!fill_index(index_out, grams)) {
+		qgram_free(index_out);
+		return false;
+	}
+
+	return true;
+}
+
+void qgram_free(struct qgram_index *index)
+{
+	free(index->starts);
+	free(index->offsets);
+	index->starts = NULL;
+	index->offsets = NULL;
+}
+
+static bool same_pattern(const struct ignorable_byte *pattern_bytes, size_t pattern_bytes_length, const uint8_t *bytes)
+{
+	for (size_t i = 0; i < pattern_bytes_length; ++i) {
+		if (!pattern_bytes[i].is_ignored && bytes[i] != pattern_bytes[i].value) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// The 3 fixed bytes in a row whose bucket is the shortest, false if the pattern has none.
+static bool pick_gram(const struct qgram_index *index, const struct ignorable_byte *pattern_bytes,
+		      size_t pattern_bytes_length, size_t *at_out)
+{
+	bool picked = false;
+	uint32_t shortest = UINT32_MAX;
+	size_t run = 0;
+	for (size_t i = 0; i < pattern_bytes_length; ++i) {
+		run = pattern_bytes[i].is_ignored ? 0 : run + 1;
+		if (run < QGRAM_LENGTH) {
+			continue;
+		}
+
+		uint8_t gram_bytes[QGRAM_LENGTH] = { 0 };
+		for (size_t j = 0; j < QGRAM_LENGTH; ++j) {
+			gram_bytes[j] = pattern_bytes[i + 1 - QGRAM_LENGTH + j].value;
+		}
+		uint32_t bucket = bucket_of(gram_at(gram_bytes));
+		uint32_t length = index->starts[bucket + 1] - index->starts[bucket];
+		if (length < shortest) {
+			shortest = length;
+			*at_out = i + 1 - QGRAM_LENGTH;
+			picked = true;
+		}
+	}
+
+	return picked;
+}
+
+bool qgram_find(const struct qgram_index *index, const struct ignorable_byte *pattern_bytes,
+		size_t pattern_bytes_length, size_t *index_out)
+{
+	size_t at = 0;
+	if (!pick_gram(index, pattern_bytes, pattern_bytes_length, &at)) {
+		return scan_buffer(pattern_bytes, pattern_bytes_length, index->bytes, index->size, index_out);
+	}
+	if (pattern_bytes_length >= index->size) {
+		return false;
+	}
+
+	uint8_t gram_bytes[QGRAM_LENGTH] = { 0 };
+	for (size_t j = 0; j < QGRAM_LENGTH; ++j) {
+		gram_bytes[j] = pattern_bytes[at + j].value;
+	}
+	uint32_t bucket = bucket_of(gram_at(gram_bytes));
+	// Like the scanners, a match ending on the last byte doesn't count.
+	size_t last_index = index->size - pattern_bytes_length - 1;
+	for (uint32_t i = index->starts[bucket]; i < index->starts[bucket + 1]; ++i) {
+		size_t offset = index->offsets[i];
+		if (offset < at) {
+			continue;
+		}
+		size_t candidate = offset - at;
+		if (candidate > last_index) {
+			return false;
+		}
+		if (same_pattern(pattern_bytes, pattern_bytes_length, index->bytes + candidate)) {
+			*index_out = candidate;
+			return true;
+		}
+	}
+
+	return false;
+}
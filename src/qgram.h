@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every 3 bytes of a snapshot, bucketed by a hash of their value, with the offsets of each bucket sorted. Looking a
+// pattern up only compares it where one of its grams is, so it costs next to nothing once the index is built and
+// many patterns are looked for in the same bytes.
+struct qgram_index {
+	const uint8_t *bytes;
+	size_t size;
+	// Bucket b holds offsets[starts[b]] up to offsets[starts[b + 1]].
+	uint32_t *starts;
+	uint32_t *offsets;
+};
+
+// Keeps pointing at bytes, which must not change while the index is used. Fails for more than 4 GiB.
+bool qgram_build(const uint8_t *bytes, size_t size, struct qgram_index *index_out);
+void qgram_free(struct qgram_index *index);
+// Finds what scan_buffer() would find in the indexed bytes. Patterns without 3 fixed bytes in a row are scanned for.
+bool qgram_find(const struct qgram_index *index, const struct ignorable_byte *pattern_bytes,
+		size_t pattern_bytes_length, size_t *index_out);
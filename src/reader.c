@@ -0,0 +1,387 @@
+#define _GNU_SOURCE 1
+
+#include "reader.h"
+
+#include "common.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *reader_names[] = {
+	[READER_STDIO] = "stdio",
+	[READER_PREAD] = "pread",
+	[READER_URING] = "io_uring",
+};
+
+// There's no glibc wrapper and liburing would be a dependency for two syscalls.
+static int io_uring_setup(uint32_t entries, struct io_uring_params *params)
+{
+	return syscall(SYS_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+	return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_free(struct uring *uring)
+{
+	if (uring->sqes && munmap(uring->sqes, uring->sqes_size) == -1) {
+		perror("munmap() failed");
+	}
+	if (uring->rings && munmap(uring->rings, uring->rings_size) == -1) {
+		perror("munmap() failed");
+	}
+	if (uring->fd != -1 && close(uring->fd) == -1) {
+		perror("close() failed");
+	}
+	*uring = (struct uring){ .fd = -1 };
+}
+
+// Quietly fails on kernels without io_uring, or where it is turned off, the caller falls back to pread() then.
+static bool uring_init(struct uring *uring)
+{
+	*uring = (struct uring){ .fd = -1 };
+
+	struct io_uring_params params = { 0 };
+	uring->fd = io_uring_setup(READER_QUEUE_DEPTH, &params);
+	if (uring->fd == -1) {
+		return false;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		uring_free(uring);
+		return false;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	uring->rings = mmap(NULL, uring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+			    IORING_OFF_SQ_RING);
+	if (uring->rings == MAP_FAILED) {
+		perror("mmap() failed");
+		uring->rings = NULL;
+		uring_free(uring);
+		return false;
+	}
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		perror("mmap() failed");
+		uring->sqes = NULL;
+		uring_free(uring);
+		return false;
+	}
+
+	uint8_t *rings = uring->rings;
+	uring->entries = params.sq_entries;
+	uring->sq_tail = (uint32_t *)(rings + params.sq_off.tail);
+	uring->sq_mask = (uint32_t *)(rings + params.sq_off.ring_mask);
+	uring->cq_head = (uint32_t *)(rings + params.cq_off.head);
+	uring->cq_tail = (uint32_t *)(rings + params.cq_off.tail);
+	uring->cq_mask = (uint32_t *)(rings + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+	// Slot i of the submission queue always holds entry i.
+	uint32_t *array = (uint32_t *)(rings + params.sq_off.array);
+	for (uint32_t i = 0; i < params.sq_entries; ++i) {
+		array[i] = i;
+	}
+
+	return true;
+}
+
+static enum reader_kind pick_kind(FILE *f)
+{
+	if (fileno(f) == -1) {
+		return READER_STDIO;
+	}
+
+	const char *name = getenv(READER_ENVIRONMENT_VARIABLE);
+	if (!name) {
+		return READER_URING;
+	}
+	for (size_t i = 0; i < sizeof(reader_names) / sizeof(reader_names[0]); ++i) {
+		if (!strcmp(name, reader_names[i])) {
+			return i;
+		}
+	}
+	fprintf(stderr, "unknown reader %s, using %s\n", name, reader_names[READER_URING]);
+
+	return READER_URING;
+}
+
+bool reader_init(struct section_reader *reader, FILE *f)
+{
+	*reader = (struct section_reader){
+		.kind = pick_kind(f),
+		.f = f,
+		.fd = fileno(f),
+		.uring = { .fd = -1 },
+	};
+
+	if (READER_URING == reader->kind && !uring_init(&reader->uring)) {
+		reader->kind = READER_PREAD;
+	}
+	// A snapshot can't be read around its FILE, it has nothing to fall back to.
+	if (READER_STDIO == reader->kind && reader->fd != -1) {
+		reader->kind = READER_PREAD;
+	}
+
+	return true;
+}
+
+void reader_free(struct section_reader *reader)
+{
+	if (READER_URING == reader->kind) {
+		uring_free(&reader->uring);
+	}
+	free(reader->chunks_read);
+	*reader = (struct section_reader){ 0 };
+}
+
+const char *reader_name(const struct section_reader *reader)
+{
+	return reader_names[reader->kind];
+}
+
+static size_t chunk_start(size_t position, size_t chunk)
+{
+	if (!chunk) {
+		return 0;
+	}
+	size_t first_end = (position / READER_CHUNK_SIZE + 1) * READER_CHUNK_SIZE - position;
+
+	return first_end + (chunk - 1) * READER_CHUNK_SIZE;
+}
+
+static size_t chunk_count(size_t size, size_t position)
+{
+	size_t count = 1;
+	while (chunk_start(position, count) < size) {
+		++count;
+	}
+
+	return count;
+}
+
+static size_t chunk_end(size_t size, size_t position, size_t chunk)
+{
+	size_t end = chunk_start(position, chunk + 1);
+
+	return end < size ? end : size;
+}
+
+static bool read_with_pread(struct section_reader *reader, uint8_t *buffer, size_t size, size_t position,
+			    reader_progress progress, void *data)
+{
+	size_t chunks = chunk_count(size, position);
+	for (size_t chunk = 0; chunk < chunks; ++chunk) {
+		size_t start = chunk_start(position, chunk);
+		size_t end = chunk_end(size, position, chunk);
+		while (start < end) {
+			ssize_t read_size = pread(reader->fd, buffer + start, end - start, position + start);
+			if (read_size == -1 && EINTR == errno) {
+				continue;
+			}
+			if (read_size <= 0) {
+				if (read_size == -1) {
+					perror("pread() failed");
+				} else {
+					fprintf(stderr, "pread() reached end-of-file unexpectedly\n");
+				}
+				return false;
+			}
+			start += read_size;
+		}
+
+		if (progress && !progress(data, end)) {
+			return true;
+		}
+	}
+
+	return true;
+}
+
+static void queue_read(struct uring *uring, int fd, uint8_t *buffer, size_t start, size_t end, size_t position,
+		       size_t chunk)
+{
+	uint32_t tail = *uring->sq_tail;
+	struct io_uring_sqe *sqe = &uring->sqes[tail & *uring->sq_mask];
+	*sqe = (struct io_uring_sqe){
+		.opcode = IORING_OP_READ,
+		.fd = fd,
+		.off = position + start,
+		.addr = (uintptr_t)(buffer + start),
+		.len = end - start,
+		.user_data = chunk,
+	};
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Takes back the reads that were queued but not submitted and waits for the ones that were, the buffer is the kernel's
+// until they complete. Their results don't matter anymore.
+static bool drain(struct uring *uring, uint32_t in_flight, uint32_t to_submit)
+{
+	__atomic_store_n(uring->sq_tail, *uring->sq_tail - to_submit, __ATOMIC_RELEASE);
+	in_flight -= to_submit;
+	while (in_flight) {
+		if (io_uring_enter(uring->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && EINTR != errno) {
+			perror("io_uring_enter() failed");
+			return false;
+		}
+		uint32_t head = *uring->cq_head;
+		uint32_t tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+		in_flight -= tail - head;
+		__atomic_store_n(uring->cq_head, tail, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+// Keeps up to READER_QUEUE_DEPTH chunk reads in flight and hands the prefix that has fully arrived to progress while
+// the rest is still being read. Returns only once nothing is in flight anymore, the buffer is the kernel's until then.
+static bool read_with_uring(struct section_reader *reader, uint8_t *buffer, size_t size, size_t position,
+			    reader_progress progress, void *data)
+{
+	struct uring *uring = &reader->uring;
+	size_t chunks = chunk_count(size, position);
+	if (chunks > reader->chunks_capacity) {
+		size_t *chunks_read = realloc(reader->chunks_read, chunks * sizeof(size_t));
+		if (!chunks_read) {
+			fprintf(stderr, "realloc() failed\n");
+			return false;
+		}
+		reader->chunks_read = chunks_read;
+		reader->chunks_capacity = chunks;
+	}
+	memset(reader->chunks_read, 0, chunks * sizeof(size_t));
+
+	bool success = true;
+	bool wanted = true;
+	size_t next = 0;
+	size_t ready = 0;
+	uint32_t in_flight = 0;
+	uint32_t to_submit = 0;
+	while (in_flight || (success && wanted && ready < chunks)) {
+		for (; success && wanted && next < chunks && in_flight < uring->entries; ++next, ++in_flight, ++to_submit) {
+			queue_read(uring, reader->fd, buffer, chunk_start(position, next), chunk_end(size, position, next),
+				   position, next);
+		}
+
+		int submitted = io_uring_enter(uring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+		if (submitted == -1) {
+			if (EINTR == errno) {
+				continue;
+			}
+			perror("io_uring_enter() failed");
+			// The ring is no use anymore. Closing it cancels whatever it still has, should waiting for that fail too.
+			bool drained = drain(uring, in_flight, to_submit);
+			uring_free(uring);
+			reader->kind = READER_PREAD;
+			if (!drained) {
+				fprintf(stderr, "drain() failed\n");
+				return false;
+			}
+
+			// The part progress was told about stays, the rest is read with pread() from now on.
+			size_t done = ready ? chunk_end(size, position, ready - 1) : 0;
+			if (!success || !wanted) {
+				return success;
+			}
+			if (!read_with_pread(reader, buffer + done, size - done, position + done, NULL, NULL)) {
+				fprintf(stderr, "read_with_pread() failed\n");
+				return false;
+			}
+			if (progress) {
+				progress(data, size);
+			}
+			return true;
+		}
+		to_submit -= submitted;
+
+		uint32_t head = *uring->cq_head;
+		uint32_t tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			const struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+			size_t chunk = cqe->user_data;
+			int result = cqe->res;
+			in_flight -= 1;
+			if (result <= 0) {
+				if (success) {
+					errno = -result;
+					perror(result ? "io_uring read failed" : "io_uring read reached end-of-file");
+				}
+				success = false;
+				continue;
+			}
+
+			reader->chunks_read[chunk] += result;
+			size_t start = chunk_start(position, chunk) + reader->chunks_read[chunk];
+			size_t end = chunk_end(size, position, chunk);
+			// A short read, the rest of the chunk goes right back into the queue.
+			if (success && start < end) {
+				queue_read(uring, reader->fd, buffer, start, end, position, chunk);
+				in_flight += 1;
+				to_submit += 1;
+			}
+		}
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+		size_t previous = ready;
+		while (ready < chunks && chunk_start(position, ready) + reader->chunks_read[ready] ==
+						 chunk_end(size, position, ready)) {
+			++ready;
+		}
+		if (progress && success && wanted && ready != previous) {
+			wanted = progress(data, chunk_end(size, position, ready - 1));
+		}
+	}
+
+	return success;
+}
+
+static bool read_with_stdio(struct section_reader *reader, uint8_t *buffer, size_t size, size_t position,
+			    reader_progress progress, void *data)
+{
+	if (!seek_and_read_bytes(buffer, size, position, reader->f)) {
+		fprintf(stderr, "seek_and_read_bytes() failed\n");
+		return false;
+	}
+	if (progress) {
+		progress(data, size);
+	}
+
+	return true;
+}
+
+// Reads size bytes at position into buffer, telling progress, if there is one, about every part of it that has arrived
+// in order. Except for snapshots, which only stdio can read, nothing an earlier read left in a buffer is handed out.
+bool reader_read(struct section_reader *reader, uint8_t *buffer, size_t size, size_t position, reader_progress progress,
+		 void *data)
+{
+	bool success = false;
+	switch (reader->kind) {
+	case READER_URING:
+		success = read_with_uring(reader, buffer, size, position, progress, data);
+		break;
+	case READER_PREAD:
+		success = read_with_pread(reader, buffer, size, position, progress, data);
+		break;
+	case READER_STDIO:
+		success = read_with_stdio(reader, buffer, size, position, progress, data);
+		break;
+	default:
+		fprintf(stderr, "unknown reader\n");
+		break;
+	}
+	trace_emit(TRACE_READ, position, size, success);
+
+	return success;
+}
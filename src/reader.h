@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define READER_ENVIRONMENT_VARIABLE "SEKIROFPSUNLOCK_READER"
+// Chunks start at multiples of this in the game's address space, so none of them straddles a page more than needed.
+#define READER_CHUNK_SIZE (64 * 1024)
+#define READER_QUEUE_DEPTH 64
+
+enum reader_kind {
+	// For snapshots, which are a FILE without a descriptor.
+	READER_STDIO,
+	READER_PREAD,
+	READER_URING,
+};
+
+// Told how much of the buffer, counted from its start, has been read so far. Returning false ends the read early.
+typedef bool (*reader_progress)(void *data, size_t ready_length);
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring {
+	int fd;
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t entries;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct section_reader {
+	enum reader_kind kind;
+	FILE *f;
+	int fd;
+	struct uring uring;
+	// How much of every chunk of the current read has arrived.
+	size_t *chunks_read;
+	size_t chunks_capacity;
+};
+
+bool reader_init(struct section_reader *reader, FILE *f);
+void reader_free(struct section_reader *reader);
+const char *reader_name(const struct section_reader *reader);
+bool reader_read(struct section_reader *reader, uint8_t *buffer, size_t size, size_t position, reader_progress progress,
+		 void *data);
@@ -1,11 +1,10 @@
+#define _POSIX_C_SOURCE 1
+
 #include "resolution.h"
 
 #include "common.h"
-#include "signals.h"
 
-#include <stdlib.h>
-#include <sys/ptrace.h>
-#include <time.h>
+#include <stdio.h>
 
 static struct ignorable_byte pattern_resolution_default[] = {
 	{ .is_ignored = false, .value = 0x80 }, { .is_ignored = false, .value = 0x7 },
@@ -48,190 +47,123 @@ static struct ignorable_byte pattern_resolution_scaling_fix[] = {
 	{ .is_ignored = false, .value = 0x74 },
 };
 
-static bool patch_resolution_default_with_section(struct context *context, uint32_t screen_width, uint32_t game_width, uint32_t game_height, uint8_t *section_bytes,
-						  size_t section_bytes_size, size_t section_position)
-{
-	time_t start_time = time(NULL);
-	if ((time_t)-1 == start_time) {
-		perror("time() failed");
-		return false;
-	}
-
-	size_t pattern_resolution_default_index = 0;
-	time_t current_time = start_time;
-	while (true) {
-		if (got_sigterm) {
-			fprintf(stderr, "got SIGTERM, exiting\n");
-			return false;
-		}
-
-		if (got_sigchld) {
-			if (ptrace(PTRACE_CONT, context->pid, NULL, NULL) == -1) {
-				perror("ptrace(PTRACE_CONT) failed");
-				return false;
-			}
-			got_sigchld = 0;
-		}
-
-		if (screen_width < 1920) {
-			if (find_pattern(pattern_resolution_default_720,
-					sizeof(pattern_resolution_default_720) / sizeof(struct ignorable_byte), context->f, section_bytes,
-					section_bytes_size, section_position, &pattern_resolution_default_index)) {
-				stop_and_wait(context);
-				break;
-			}
-		} else {
-			if (find_pattern(pattern_resolution_default,
-					sizeof(pattern_resolution_default) / sizeof(struct ignorable_byte), context->f, section_bytes,
-					section_bytes_size, section_position, &pattern_resolution_default_index)) {
-				stop_and_wait(context);
-				break;
-			}
-		}
-
-		current_time = time(NULL);
-		if ((time_t)-1 == current_time) {
-			perror("time() failed");
-			return false;
-		}
-		if ((current_time - start_time) > context->timeout) {
-			fprintf(stderr, "timeout reached while looking for resolution default pattern\n");
-			return false;
-		}
-	}
+struct resolution {
+	uint32_t game_width;
+	uint32_t game_height;
+};
 
-	if (!seek_and_write_bytes((uint8_t *)&game_width,
-				  sizeof(game_width),
-				  section_position + pattern_resolution_default_index, context->f)) {
-		fprintf(stderr, "seek_and_write_bytes() failed\n");
+static bool write_resolution(FILE *f, struct write_journal *journal, size_t position, uint32_t game_width,
+			     uint32_t game_height)
+{
+	if (!journal_write(journal, &game_width, sizeof(game_width), position, f)) {
+		fprintf(stderr, "journal_write() failed\n");
 		return false;
 	}
 
-	if (!seek_and_write_bytes((uint8_t *)&game_height,
-				  sizeof(game_height),
-				  section_position + pattern_resolution_default_index + 4, context->f)) {
-		fprintf(stderr, "seek_and_write_bytes() failed\n");
+	if (!journal_write(journal, &game_height, sizeof(game_height), position + 4, f)) {
+		fprintf(stderr, "journal_write() failed\n");
 		return false;
 	}
 
 	return true;
 }
 
-static bool patch_resolution_default(struct context *context, uint32_t screen_width, uint32_t game_width, uint32_t game_height)
+static bool apply_resolution_default(struct context *context, const struct pattern_match *match, const void *value)
 {
-	size_t section_position;
-	size_t section_size = 0;
-	if (!find_section_info(".data", context->f, &section_position, &section_size)) {
-		fprintf(stderr, "find_section_info(\".data\", ...) failed\n");
+	const struct resolution *resolution = value;
+	size_t position = match->section_position + match->index;
+	if (!write_resolution(context->f, context->journal, position, resolution->game_width, resolution->game_height)) {
+		fprintf(stderr, "write_resolution() failed\n");
 		return false;
 	}
-
-	uint8_t *section_buffer = calloc(section_size, sizeof(uint8_t));
-	if (!section_buffer) {
-		fprintf(stderr, "calloc() failed\n");
-		return false;
+	if (context->targets) {
+		context->targets->resolution = position;
 	}
 
-	bool success =
-		patch_resolution_default_with_section(context, screen_width, game_width, game_height, section_buffer, section_size, section_position);
-
-	free(section_buffer);
-
-	return success;
+	return true;
 }
 
-static bool patch_resolution_scaling_fix_with_section(struct context *context, uint8_t *section_bytes,
-						      size_t section_bytes_size, size_t section_position)
+static bool apply_resolution_scaling_fix(struct context *context, const struct pattern_match *match, const void *value)
 {
-	time_t start_time = time(NULL);
-	if ((time_t)-1 == start_time) {
-		perror("time() failed");
-		return false;
-	}
-
-	size_t pattern_resolution_scaling_fix_index = 0;
-	time_t current_time = start_time;
-	while (true) {
-		if (got_sigterm) {
-			fprintf(stderr, "got SIGTERM, exiting\n");
-			return false;
-		}
-
-		if (got_sigchld) {
-			if (ptrace(PTRACE_CONT, context->pid, NULL, NULL) == -1) {
-				perror("ptrace(PTRACE_CONT) failed");
-				return false;
-			}
-			got_sigchld = 0;
-		}
-
-		if (find_pattern(pattern_resolution_scaling_fix,
-				sizeof(pattern_resolution_scaling_fix) / sizeof(struct ignorable_byte), context->f, section_bytes,
-				section_bytes_size, section_position, &pattern_resolution_scaling_fix_index)) {
-			stop_and_wait(context);
-			break;
-		}
-
-		current_time = time(NULL);
-		if ((time_t)-1 == current_time) {
-			perror("time() failed");
-			return false;
-		}
-		if ((current_time - start_time) > context->timeout) {
-			fprintf(stderr, "timeout reached while looking for resolution scaling fix pattern\n");
-			return false;
-		}
-	}
-
+	(void)value;
 	uint8_t nop_jmp[] = { 0x90, 0x90, 0xeb };
-	if (!seek_and_write_bytes(nop_jmp, sizeof(nop_jmp) / sizeof(uint8_t),
-				 section_position + pattern_resolution_scaling_fix_index, context->f)) {
-		fprintf(stderr, "seek_and_write_bytes() failed\n");
+	if (!journal_write(context->journal, nop_jmp, sizeof(nop_jmp), match->section_position + match->index,
+			   context->f)) {
+		fprintf(stderr, "journal_write() failed\n");
 		return false;
 	}
 
 	return true;
 }
 
-static bool patch_resolution_scaling_fix(struct context *context)
+static const struct pattern_site site_resolution_default = {
+	.name = "resolution-default",
+	.description = "resolution default",
+	.section = ".data",
+	.pattern_bytes = pattern_resolution_default,
+	.pattern_bytes_length = sizeof(pattern_resolution_default) / sizeof(struct ignorable_byte),
+	.apply = apply_resolution_default,
+};
+
+// Screens narrower than 1920 start out at 720p.
+static const struct pattern_site site_resolution_default_720 = {
+	.name = "resolution-default-720",
+	.description = "resolution default",
+	.section = ".data",
+	.pattern_bytes = pattern_resolution_default_720,
+	.pattern_bytes_length = sizeof(pattern_resolution_default_720) / sizeof(struct ignorable_byte),
+	.apply = apply_resolution_default,
+};
+
+static const struct pattern_site site_resolution_scaling_fix = {
+	.name = "resolution-scaling-fix",
+	.description = "resolution scaling fix",
+	.section = ".text",
+	.pattern_bytes = pattern_resolution_scaling_fix,
+	.pattern_bytes_length = sizeof(pattern_resolution_scaling_fix) / sizeof(struct ignorable_byte),
+	.apply = apply_resolution_scaling_fix,
+};
+
+bool plan_resolution(struct patch_plan *plan, uint32_t screen_width, uint32_t game_width, uint32_t game_height)
 {
-	size_t section_position;
-	size_t section_size = 0;
-	if (!find_section_info(".text", context->f, &section_position, &section_size)) {
-		fprintf(stderr, "find_section_info(\".text\", ...) failed\n");
+	struct resolution resolution = {
+		.game_width = game_width,
+		.game_height = game_height,
+	};
+	const struct pattern_site *site_default =
+		screen_width < 1920 ? &site_resolution_default_720 : &site_resolution_default;
+	if (!plan_add_pattern(plan, site_default, &resolution, sizeof(resolution))) {
+		fprintf(stderr, "plan_add_pattern() failed\n");
 		return false;
 	}
 
-	uint8_t *section_buffer = calloc(section_size, sizeof(uint8_t));
-	if (!section_buffer) {
-		fprintf(stderr, "calloc() failed\n");
+	if (!plan_add_pattern(plan, &site_resolution_scaling_fix, NULL, 0)) {
+		fprintf(stderr, "plan_add_pattern() failed\n");
 		return false;
 	}
 
-	bool success =
-		patch_resolution_scaling_fix_with_section(context, section_buffer, section_size, section_position);
-
-	free(section_buffer);
-
-	return success;
+	return true;
 }
 
-static bool patch_resolution(struct context *context, uint32_t screen_width, uint32_t game_width, uint32_t game_height)
+// Only changes the default the game starts out with, it takes effect once the game picks the resolution again.
+bool resolution_rewrite(FILE *f, const struct patch_targets *targets, uint32_t game_width, uint32_t game_height)
 {
-	if (!patch_resolution_default(context, screen_width, game_width, game_height)) {
-		fprintf(stderr, "patch_resolution_default() failed\n");
+	if (!targets->resolution) {
+		fprintf(stderr, "the resolution was not patched, there is nothing to rewrite\n");
 		return false;
 	}
 
-	if (!patch_resolution_scaling_fix(context)) {
-		fprintf(stderr, "patch_resolution_default() failed\n");
+	// Either both values change or neither does.
+	struct write_journal journal = { 0 };
+	if (!write_resolution(f, &journal, targets->resolution, game_width, game_height)) {
+		journal_rollback(&journal, f);
 		return false;
 	}
 
 	return true;
 }
 
-bool main_resolution(struct context *context, int argc, char *argv[])
+bool main_resolution(struct patch_plan *plan, int argc, char *argv[])
 {
 	if (argc < 3) {
 		fprintf(stderr, "argc must be at least 3\n");
@@ -256,8 +188,8 @@ bool main_resolution(struct context *context, int argc, char *argv[])
 		return false;
 	}
 
-	if (!patch_resolution(context, screen_width, game_width, game_height)) {
-		fprintf(stderr, "patch_resolution() failed\n");
+	if (!plan_resolution(plan, screen_width, game_width, game_height)) {
+		fprintf(stderr, "plan_resolution() failed\n");
 		return false;
 	}
 
@@ -1,6 +1,10 @@
 #include "common.h"
+#include "plan.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
-bool main_resolution(struct context *context, int argc, char *argv[]);
+bool plan_resolution(struct patch_plan *plan, uint32_t screen_width, uint32_t game_width, uint32_t game_height);
+bool resolution_rewrite(FILE *f, const struct patch_targets *targets, uint32_t game_width, uint32_t game_height);
+bool main_resolution(struct patch_plan *plan, int argc, char *argv[]);
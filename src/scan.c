@@ -0,0 +1,392 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCANNER_ENVIRONMENT_VARIABLE "SEKIROFPSUNLOCK_SCANNER"
+
+static bool same_pattern(const struct ignorable_byte *pattern_bytes, const size_t pattern_bytes_length, const uint8_t *bytes, const size_t bytes_length)
+{
+	for (size_t i = 0; i < pattern_bytes_length && i < bytes_length; ++i) {
+		const struct ignorable_byte ignorable_byte = pattern_bytes[i];
+		if (!ignorable_byte.is_ignored && bytes[i] != ignorable_byte.value) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Scans from the given candidate on like the reference matcher does.
+static bool find_from(const struct ignorable_byte *pattern_bytes, size_t pattern_bytes_length, const uint8_t *buffer,
+		      size_t buffer_size, size_t start, size_t *index_out)
+{
+	for (size_t i = start; i + pattern_bytes_length < buffer_size; ++i) {
+		if (same_pattern(pattern_bytes, pattern_bytes_length, buffer + i, buffer_size - i)) {
+			*index_out = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// The reference matcher, every other backend must return exactly what this one returns.
+// Note that a match ending on the very last byte of the buffer is not reported, other backends have to keep that.
+static bool find_reference(const struct ignorable_byte *pattern_bytes, size_t pattern_bytes_length,
+			   const uint8_t *buffer, size_t buffer_size, size_t *index_out)
+{
+	return find_from(pattern_bytes, pattern_bytes_length, buffer, buffer_size, 0, index_out);
+}
+
+// Looks for the first fixed byte of the pattern with memchr() and only compares the whole pattern there.
+static bool find_anchored(const struct ignorable_byte *pattern_bytes, size_t pattern_bytes_length,
+			  const uint8_t *buffer, size_t buffer_size, size_t *index_out)
+{
+	if (pattern_bytes_length >= buffer_size) {
+		return false;
+	}
+	size_t last_index = buffer_size - pattern_bytes_length - 1;
+
+	size_t anchor = 0;
+	while (anchor < pattern_bytes_length && pattern_bytes[anchor].is_ignored) {
+		++anchor;
+	}
+	if (anchor == pattern_bytes_length) {
+		*index_out = 0;
+		return true;
+	}
+
+	const uint8_t *cursor = buffer + anchor;
+	const uint8_t *end = buffer + last_index + anchor + 1;
+	while (cursor < end) {
+		const uint8_t *found = memchr(cursor, pattern_bytes[anchor].value, end - cursor);
+		if (!found) {
+			return false;
+		}
+
+		size_t i = found - buffer - anchor;
+		if (same_pattern(pattern_bytes, pattern_bytes_length, buffer + i, buffer_size - i)) {
+			*index_out = i;
+			return true;
+		}
+		cursor = found + 1;
+	}
+
+	return false;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The first and the last fixed byte of a pattern, the vector kernels only look at the rest where both are in place.
+struct anchors {
+	size_t first;
+	size_t last;
+};
+
+static bool find_anchors(const struct ignorable_byte *pattern_bytes, size_t pattern_bytes_length,
+			 struct anchors *anchors_out)
+{
+	size_t first = 0;
+	while (first < pattern_bytes_length && pattern_bytes[first].is_ignored) {
+		++first;
+	}
+	if (first == pattern_bytes_length) {
+		return false;
+	}
+	size_t last = pattern_bytes_length - 1;
+	while (pattern_bytes[last].is_ignored) {
+		--last;
+	}
+	anchors_out->first = first;
+	anchors_out->last = last;
+
+	return true;
+}
+
+// Candidates are the positions the reference matcher would try, [0, buffer_size - pattern_bytes_length). Every kernel
+// loads whole vectors at both anchors of a candidate, the last vector stays inside the buffer since the last anchor
+// is inside the pattern, and leaves the candidates that don't fill a vector to find_from().
+
+__attribute__((target("sse2"))) static bool find_sse2(const struct ignorable_byte *pattern_bytes,
+						      size_t pattern_bytes_length, const uint8_t *buffer,
+						      size_t buffer_size, size_t *index_out)
+{
+	if (pattern_bytes_length >= buffer_size) {
+		return false;
+	}
+	struct anchors anchors = { 0 };
+	if (!find_anchors(pattern_bytes, pattern_bytes_length, &anchors)) {
+		*index_out = 0;
+		return true;
+	}
+
+	size_t candidates = buffer_size - pattern_bytes_length;
+	const __m128i first = _mm_set1_epi8((char)pattern_bytes[anchors.first].value);
+	const __m128i last = _mm_set1_epi8((char)pattern_bytes[anchors.last].value);
+	size_t i = 0;
+	for (; i + 16 <= candidates; i += 16) {
+		__m128i at_first = _mm_loadu_si128((const __m128i *)(buffer + i + anchors.first));
+		__m128i at_last = _mm_loadu_si128((const __m128i *)(buffer + i + anchors.last));
+		unsigned mask = (unsigned)_mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(at_first, first), _mm_cmpeq_epi8(at_last, last)));
+		for (; mask; mask &= mask - 1) {
+			size_t candidate = i + (size_t)__builtin_ctz(mask);
+			if (same_pattern(pattern_bytes, pattern_bytes_length, buffer + candidate, buffer_size - candidate)) {
+				*index_out = candidate;
+				return true;
+			}
+		}
+	}
+
+	return find_from(pattern_bytes, pattern_bytes_length, buffer, buffer_size, i, index_out);
+}
+
+// Looks for the longest run of fixed bytes, at most 16 of them, as a substring with pcmpestri.
+__attribute__((target("sse4.2"))) static bool find_sse42(const struct ignorable_byte *pattern_bytes,
+							 size_t pattern_bytes_length, const uint8_t *buffer,
+							 size_t buffer_size, size_t *index_out)
+{
+	if (pattern_bytes_length >= buffer_size) {
+		return false;
+	}
+
+	size_t run = 0;
+	size_t run_length = 0;
+	for (size_t i = 0; i < pattern_bytes_length;) {
+		size_t length = 0;
+		while (i + length < pattern_bytes_length && !pattern_bytes[i + length].is_ignored) {
+			++length;
+		}
+		if (length > run_length) {
+			run = i;
+			run_length = length;
+		}
+		i += length + 1;
+	}
+	if (!run_length) {
+		*index_out = 0;
+		return true;
+	}
+	if (run_length > 16) {
+		run_length = 16;
+	}
+
+	uint8_t needle_bytes[16] = { 0 };
+	for (size_t i = 0; i < run_length; ++i) {
+		needle_bytes[i] = pattern_bytes[run + i].value;
+	}
+	const __m128i needle = _mm_loadu_si128((const __m128i *)needle_bytes);
+
+	size_t candidates = buffer_size - pattern_bytes_length;
+	size_t i = 0;
+	while (i + 16 <= candidates) {
+		__m128i haystack = _mm_loadu_si128((const __m128i *)(buffer + i + run));
+		size_t at = (size_t)_mm_cmpestri(needle, (int)run_length, haystack, 16,
+						 _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ORDERED);
+		if (16 == at) {
+			i += 16;
+			continue;
+		}
+		// The run may go on past the vector, start the next one where it begins.
+		if (at + run_length > 16) {
+			i += at;
+			continue;
+		}
+
+		size_t candidate = i + at;
+		if (same_pattern(pattern_bytes, pattern_bytes_length, buffer + candidate, buffer_size - candidate)) {
+			*index_out = candidate;
+			return true;
+		}
+		i = candidate + 1;
+	}
+
+	return find_from(pattern_bytes, pattern_bytes_length, buffer, buffer_size, i, index_out);
+}
+
+__attribute__((target("avx2"))) static bool find_avx2(const struct ignorable_byte *pattern_bytes,
+						      size_t pattern_bytes_length, const uint8_t *buffer,
+						      size_t buffer_size, size_t *index_out)
+{
+	if (pattern_bytes_length >= buffer_size) {
+		return false;
+	}
+	struct anchors anchors = { 0 };
+	if (!find_anchors(pattern_bytes, pattern_bytes_length, &anchors)) {
+		*index_out = 0;
+		return true;
+	}
+
+	size_t candidates = buffer_size - pattern_bytes_length;
+	const __m256i first = _mm256_set1_epi8((char)pattern_bytes[anchors.first].value);
+	const __m256i last = _mm256_set1_epi8((char)pattern_bytes[anchors.last].value);
+	size_t i = 0;
+	for (; i + 32 <= candidates; i += 32) {
+		__m256i at_first = _mm256_loadu_si256((const __m256i *)(buffer + i + anchors.first));
+		__m256i at_last = _mm256_loadu_si256((const __m256i *)(buffer + i + anchors.last));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(at_first, first), _mm256_cmpeq_epi8(at_last, last)));
+		for (; mask; mask &= mask - 1) {
+			size_t candidate = i + (size_t)__builtin_ctz(mask);
+			if (same_pattern(pattern_bytes, pattern_bytes_length, buffer + candidate, buffer_size - candidate)) {
+				*index_out = candidate;
+				return true;
+			}
+		}
+	}
+
+	return find_from(pattern_bytes, pattern_bytes_length, buffer, buffer_size, i, index_out);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static bool find_avx512(const struct ignorable_byte *pattern_bytes,
+								    size_t pattern_bytes_length,
+								    const uint8_t *buffer, size_t buffer_size,
+								    size_t *index_out)
+{
+	if (pattern_bytes_length >= buffer_size) {
+		return false;
+	}
+	struct anchors anchors = { 0 };
+	if (!find_anchors(pattern_bytes, pattern_bytes_length, &anchors)) {
+		*index_out = 0;
+		return true;
+	}
+
+	size_t candidates = buffer_size - pattern_bytes_length;
+	const __m512i first = _mm512_set1_epi8((char)pattern_bytes[anchors.first].value);
+	const __m512i last = _mm512_set1_epi8((char)pattern_bytes[anchors.last].value);
+	size_t i = 0;
+	for (; i + 64 <= candidates; i += 64) {
+		__m512i at_first = _mm512_loadu_si512((const void *)(buffer + i + anchors.first));
+		__m512i at_last = _mm512_loadu_si512((const void *)(buffer + i + anchors.last));
+		uint64_t mask = _mm512_cmpeq_epi8_mask(at_first, first) & _mm512_cmpeq_epi8_mask(at_last, last);
+		for (; mask; mask &= mask - 1) {
+			size_t candidate = i + (size_t)__builtin_ctzll(mask);
+			if (same_pattern(pattern_bytes, pattern_bytes_length, buffer + candidate, buffer_size - candidate)) {
+				*index_out = candidate;
+				return true;
+			}
+		}
+	}
+
+	return find_from(pattern_bytes, pattern_bytes_length, buffer, buffer_size, i, index_out);
+}
+
+// __builtin_cpu_supports() also checks that the kernel saves the wider registers.
+static bool has_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool has_sse42(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+static bool has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static bool has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+#endif
+
+// Ordered by how fast scanfuzz measures them, slowest first. That puts sse4.2 before sse2, pcmpestri loses to plain
+// sse2 compares. The last one this CPU can run is the default, `self-bench save` can store another for this machine.
+const struct scan_backend scan_backends[] = {
+	{ .name = "reference", .find = find_reference },
+	{ .name = "anchored", .find = find_anchored },
+#if defined(__x86_64__) || defined(__i386__)
+	{ .name = "sse4.2", .find = find_sse42, .supported = has_sse42 },
+	{ .name = "sse2", .find = find_sse2, .supported = has_sse2 },
+	{ .name = "avx2", .find = find_avx2, .supported = has_avx2 },
+	{ .name = "avx512", .find = find_avx512, .supported = has_avx512 },
+#endif
+};
+
+const size_t scan_backends_length = sizeof(scan_backends) / sizeof(struct scan_backend);
+
+const struct scan_backend *scan_backend_by_name(const char *name)
+{
+	for (size_t i = 0; i < scan_backends_length; ++i) {
+		if (!strcmp(scan_backends[i].name, name)) {
+			return &scan_backends[i];
+		}
+	}
+
+	return NULL;
+}
+
+bool scan_backend_supported(const struct scan_backend *backend)
+{
+	return !backend->supported || backend->supported();
+}
+
+static const struct scan_backend *chosen_backend = NULL;
+static const struct scan_backend *backend = NULL;
+
+static const struct scan_backend *fastest_backend(void)
+{
+	for (size_t i = scan_backends_length; i > 1; --i) {
+		if (scan_backend_supported(&scan_backends[i - 1])) {
+			return &scan_backends[i - 1];
+		}
+	}
+
+	return &scan_backends[0];
+}
+
+// The environment wins over what was chosen, which wins over the table.
+static const struct scan_backend *selected_backend(void)
+{
+	if (backend) {
+		return backend;
+	}
+
+	backend = chosen_backend ? chosen_backend : fastest_backend();
+	const char *name = getenv(SCANNER_ENVIRONMENT_VARIABLE);
+	if (name) {
+		const struct scan_backend *named = scan_backend_by_name(name);
+		if (!named) {
+			fprintf(stderr, "unknown scanner %s, using %s\n", name, backend->name);
+		} else if (!scan_backend_supported(named)) {
+			fprintf(stderr, "this CPU can't run scanner %s, using %s\n", name, backend->name);
+		} else {
+			backend = named;
+		}
+	}
+
+	return backend;
+}
+
+const struct scan_backend *scan_selected(void)
+{
+	return selected_backend();
+}
+
+bool scan_select(const char *name)
+{
+	const struct scan_backend *named = scan_backend_by_name(name);
+	if (!named || !scan_backend_supported(named)) {
+		return false;
+	}
+	chosen_backend = named;
+	backend = NULL;
+
+	return true;
+}
+
+bool scan_buffer(const struct ignorable_byte *pattern_bytes, size_t pattern_bytes_length, const uint8_t *buffer,
+		 size_t buffer_size, size_t *index_out)
+{
+	return selected_backend()->find(pattern_bytes, pattern_bytes_length, buffer, buffer_size, index_out);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef bool (*scan_function)(const struct ignorable_byte *pattern_bytes, size_t pattern_bytes_length,
+			      const uint8_t *buffer, size_t buffer_size, size_t *index_out);
+
+struct scan_backend {
+	const char *name;
+	scan_function find;
+	// Whether this CPU can run it, NULL for the ones every CPU can.
+	bool (*supported)(void);
+};
+
+extern const struct scan_backend scan_backends[];
+extern const size_t scan_backends_length;
+
+const struct scan_backend *scan_backend_by_name(const char *name);
+bool scan_backend_supported(const struct scan_backend *backend);
+// The backend scan_buffer() uses, SEKIROFPSUNLOCK_SCANNER overrides whatever was selected.
+const struct scan_backend *scan_selected(void);
+// Fails for backends this CPU can't run.
+bool scan_select(const char *name);
+bool scan_buffer(const struct ignorable_byte *pattern_bytes, size_t pattern_bytes_length, const uint8_t *buffer,
+		 size_t buffer_size, size_t *index_out);
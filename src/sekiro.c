@@ -1,194 +1,370 @@
+#define _DEFAULT_SOURCE 1
+
 #include "sekiro.h"
 
-#include "signals.h"
+#include "loop.h"
 
-#include <assert.h>
-#include <dirent.h>
 #include <errno.h>
-#include <limits.h>
+#include <fcntl.h>
 #include <stdio.h>
-#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DIRENTS_SIZE (128 * 1024)
+#define INITIAL_REJECTED_CAPACITY 1024
 
 enum find_sekiro_result {
 	FOUND,
 	NOT_FOUND,
+	GONE,
 	ERROR,
 };
 
-static bool string_to_long(char *s, int base, long *n_out)
+// glibc does not export this, it's the layout getdents64() writes.
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static bool name_to_pid(const char *name, pid_t *pid_out)
 {
-	int errno_stored = errno;
-	errno = 0;
-	char *endptr = NULL;
-	*n_out = strtol(s, &endptr, base);
-	if (errno) {
-		perror("strtol() failed");
+	if (!*name) {
 		return false;
 	}
-	if (endptr == s) {
-		fprintf(stderr, "strtol() failed, no digits were read.\n");
-		return false;
+
+	long pid_long = 0;
+	for (const char *c = name; *c; ++c) {
+		if (*c < '0' || *c > '9') {
+			return false;
+		}
+		pid_long = pid_long * 10 + (*c - '0');
+		if (pid_long > INT32_MAX) {
+			return false;
+		}
 	}
-	errno = errno_stored;
+
+	*pid_out = pid_long;
 
 	return true;
 }
 
-static bool string_to_pid(char *s, int base, pid_t *pid_out)
+static int compare_rejected(const void *a, const void *b)
 {
-	long pid_long = 0;
-	if (!string_to_long(s, base, &pid_long)) {
-		fprintf(stderr, "string_to_long() failed\n");
+	const struct rejected_process *left = a;
+	const struct rejected_process *right = b;
+
+	return (left->pid > right->pid) - (left->pid < right->pid);
+}
+
+// Reads stat instead of comm, it has the name too and tells how old the process is.
+static enum find_sekiro_result is_process_sekiro(int proc_fd, pid_t pid, uint64_t *start_time_out)
+{
+	char path[32] = "";
+	long pid_long = pid;
+	int written = snprintf(path, sizeof(path), "%ld/stat", pid_long);
+	if (written < 0 || (size_t)written >= sizeof(path)) {
+		fprintf(stderr, "snprintf() failed\n");
+		return ERROR;
+	}
+
+	int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		// The process exited between getdents64() and openat().
+		if (ENOENT == errno || ESRCH == errno) {
+			return GONE;
+		}
+		perror("openat() failed");
+		return ERROR;
+	}
+
+	char stat[1024] = "";
+	ssize_t read_size = read(fd, stat, sizeof(stat) - 1);
+	int errno_stored = errno;
+	if (close(fd) == -1) {
+		perror("close() failed");
+		return ERROR;
+	}
+	if (read_size == -1) {
+		if (ESRCH == errno_stored) {
+			return GONE;
+		}
+		errno = errno_stored;
+		perror("read() failed");
+		return ERROR;
+	}
+	stat[read_size] = '\0';
+
+	// "pid (comm) state ...", the name can hold anything, parentheses included, so it ends at the last ')'.
+	char *comm = strchr(stat, '(');
+	char *comm_end = strrchr(stat, ')');
+	if (!comm || !comm_end || comm_end < comm) {
+		fprintf(stderr, "could not parse %s\n", path);
+		return ERROR;
+	}
+	*comm_end = '\0';
+
+	// The start time is field 22, the state after the name is field 3.
+	char *field = comm_end + 1;
+	for (int i = 3; i < 22 && field; ++i) {
+		field = strchr(field + 1, ' ');
+	}
+	*start_time_out = field ? strtoull(field, NULL, 10) : 0;
+
+	return strstr(comm + 1, "sekiro.exe") ? FOUND : NOT_FOUND;
+}
+
+static bool remember_rejected(struct process_scanner *scanner, size_t *length, pid_t pid, uint64_t inode,
+			      uint64_t start_time)
+{
+	if (*length == scanner->rejected_capacity) {
+		size_t capacity = scanner->rejected_capacity * 2;
+		struct rejected_process *rejected = realloc(scanner->rejected, capacity * sizeof(*rejected));
+		if (!rejected) {
+			fprintf(stderr, "realloc() failed\n");
+			return false;
+		}
+		scanner->rejected = rejected;
+		struct rejected_process *rejected_next =
+			realloc(scanner->rejected_next, capacity * sizeof(*rejected_next));
+		if (!rejected_next) {
+			fprintf(stderr, "realloc() failed\n");
+			return false;
+		}
+		scanner->rejected_next = rejected_next;
+		scanner->rejected_capacity = capacity;
+	}
+
+	scanner->rejected_next[*length].pid = pid;
+	scanner->rejected_next[*length].inode = inode;
+	scanner->rejected_next[*length].start_time = start_time;
+	*length += 1;
+
+	return true;
+}
+
+bool process_scanner_init(struct process_scanner *scanner)
+{
+	*scanner = (struct process_scanner){ .proc_fd = -1 };
+
+	scanner->dirents_size = DIRENTS_SIZE;
+	scanner->dirents = malloc(scanner->dirents_size);
+	scanner->rejected_capacity = INITIAL_REJECTED_CAPACITY;
+	scanner->rejected = calloc(scanner->rejected_capacity, sizeof(struct rejected_process));
+	scanner->rejected_next = calloc(scanner->rejected_capacity, sizeof(struct rejected_process));
+	if (!scanner->dirents || !scanner->rejected || !scanner->rejected_next) {
+		fprintf(stderr, "failed to allocate process scanner buffers\n");
+		process_scanner_free(scanner);
 		return false;
 	}
 
-	static_assert(sizeof(int32_t) == sizeof(pid_t), "pid_t must take the same amount of bytes as int32_t");
-	if (pid_long > INT32_MAX) {
-		fprintf(stderr, "pid is too big for pid_t\n");
+	scanner->clock_ticks = sysconf(_SC_CLK_TCK);
+	if (scanner->clock_ticks <= 0) {
+		perror("sysconf(_SC_CLK_TCK) failed");
+		process_scanner_free(scanner);
 		return false;
 	}
 
-	*pid_out = pid_long;
+	scanner->proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (scanner->proc_fd == -1) {
+		perror("open(\"/proc\") failed");
+		process_scanner_free(scanner);
+		return false;
+	}
 
 	return true;
 }
 
-static enum find_sekiro_result is_process_sekiro(FILE *f, char *buffer, size_t buffer_size)
+void process_scanner_free(struct process_scanner *scanner)
 {
-	// fgets takes int, so make sure the implicit cast provides the correct value.
-	assert(buffer_size <= INT_MAX);
-
-	if (!fgets(buffer, buffer_size, f)) {
-		// Can happen if the file has been opened but the process is already dead by the time fgets is called.
-		// These reads from /proc should never really fail for any other reason, so it's probably fine to treat it as a failure to find the process.
-		// Even if it is a real error (in which case something is seriously wrong), the timeout should take care of it.
-		if (ferror(f)) {
-			return NOT_FOUND;
-		}
-		if (feof(f)) {
-			fprintf(stderr, "got unexpected EOF\n");
-			return ERROR;
-		}
+	if (scanner->proc_fd != -1 && close(scanner->proc_fd) == -1) {
+		perror("close() failed");
 	}
-	if (!strstr(buffer, "sekiro.exe")) {
-		return NOT_FOUND;
+	free(scanner->dirents);
+	free(scanner->rejected);
+	free(scanner->rejected_next);
+	*scanner = (struct process_scanner){ .proc_fd = -1 };
+}
+
+// Start times in /proc are clock ticks since boot.
+static bool boot_time_ticks(const struct process_scanner *scanner, uint64_t *ticks_out)
+{
+	struct timespec now = { 0 };
+	if (clock_gettime(CLOCK_BOOTTIME, &now) == -1) {
+		perror("clock_gettime() failed");
+		return false;
 	}
+	*ticks_out = (uint64_t)now.tv_sec * scanner->clock_ticks + now.tv_nsec / (1000000000L / scanner->clock_ticks);
 
-	return FOUND;
+	return true;
 }
 
-static enum find_sekiro_result find_sekiro_in_dir(DIR *dirp, char *buffer, size_t buffer_size, pid_t *pid_out)
+// Reads /proc in large batches and only looks at processes that weren't rejected on a previous pass. A pid is
+// remembered together with the inode of its /proc directory, so a recycled pid is looked at again, and with its start
+// time, so a process that is young enough to be renamed still is.
+bool process_scanner_pass(struct process_scanner *scanner, bool *found_out, pid_t *pid_out)
 {
-	for (;;) {
-		errno = 0;
-		struct dirent *entry = readdir(dirp);
-		if (!entry) {
-			if (errno) {
-				perror("readdir() failed");
-				return ERROR;
-			}
+	*found_out = false;
 
-			return NOT_FOUND;
-		}
+	uint64_t now = 0;
+	if (!boot_time_ticks(scanner, &now)) {
+		fprintf(stderr, "boot_time_ticks() failed\n");
+		return false;
+	}
+	uint64_t grace = (uint64_t)RENAME_GRACE_SECONDS * scanner->clock_ticks;
+
+	if (lseek(scanner->proc_fd, 0, SEEK_SET) == -1) {
+		perror("lseek() failed");
+		return false;
+	}
 
-		int written = snprintf(buffer, buffer_size, "/proc/%s/status", entry->d_name);
-		if (written < 0) {
-			fprintf(stderr, "snprintf() failed\n");
-			return ERROR;
+	size_t next_length = 0;
+	bool sorted = true;
+	pid_t previous_pid = 0;
+	for (;;) {
+		long read_size = syscall(SYS_getdents64, scanner->proc_fd, scanner->dirents, scanner->dirents_size);
+		if (read_size == -1) {
+			perror("getdents64() failed");
+			return false;
 		}
-		size_t written_size = written;
-		if (written_size > buffer_size) {
-			fprintf(stderr, "snprintf() did not write the whole string, buffer is too short\n");
-			return ERROR;
+		if (read_size == 0) {
+			break;
 		}
 
-		FILE *f = fopen(buffer, "r");
-		if (!f) {
-			if (ENOENT == errno || ENOTDIR == errno) {
+		for (long offset = 0; offset < read_size;) {
+			const struct linux_dirent64 *entry = (const struct linux_dirent64 *)(scanner->dirents + offset);
+			offset += entry->d_reclen;
+
+			pid_t pid = 0;
+			if (!name_to_pid(entry->d_name, &pid)) {
 				continue;
 			}
-			perror("fopen() failed");
-			return ERROR;
-		}
-
-		enum find_sekiro_result result = is_process_sekiro(f, buffer, buffer_size);
 
-		if (fclose(f) == EOF) {
-			perror("fclose() failed");
-			return ERROR;
-		}
-
-		switch (result) {
-		case NOT_FOUND:
-			break;
-		case FOUND:
-			if (!string_to_pid(entry->d_name, 10, pid_out)) {
-				fprintf(stderr, "string_to_pid() failed\n");
-				return ERROR;
+			struct rejected_process key = { .pid = pid };
+			const struct rejected_process *rejected = bsearch(&key, scanner->rejected, scanner->rejected_length,
+									  sizeof(key), compare_rejected);
+			uint64_t start_time = rejected ? rejected->start_time : 0;
+			if (scanner->rescan_rejected || !rejected || rejected->inode != entry->d_ino ||
+			    start_time + grace > now) {
+				switch (is_process_sekiro(scanner->proc_fd, pid, &start_time)) {
+				case FOUND:
+					*found_out = true;
+					*pid_out = pid;
+					return true;
+				case NOT_FOUND:
+					break;
+				case GONE:
+					continue;
+				case ERROR:
+					fprintf(stderr, "is_process_sekiro() failed\n");
+					return false;
+				default:
+					fprintf(stderr, "got unknown is_process_sekiro() result\n");
+					return false;
+				}
 			}
 
-			return FOUND;
-		case ERROR:
-			fprintf(stderr, "is_process_sekiro() failed\n");
-			return ERROR;
-		default:
-			fprintf(stderr, "got unknown is_process_sekiro() result\n");
-			return ERROR;
+			if (!remember_rejected(scanner, &next_length, pid, entry->d_ino, start_time)) {
+				fprintf(stderr, "remember_rejected() failed\n");
+				return false;
+			}
+			sorted = sorted && pid > previous_pid;
+			previous_pid = pid;
 		}
 	}
+
+	// Processes that are gone are dropped here, so the list only ever holds what's currently running.
+	struct rejected_process *rejected = scanner->rejected;
+	scanner->rejected = scanner->rejected_next;
+	scanner->rejected_next = rejected;
+	scanner->rejected_length = next_length;
+	if (!sorted) {
+		qsort(scanner->rejected, scanner->rejected_length, sizeof(struct rejected_process), compare_rejected);
+	}
+
+	return true;
 }
 
-bool find_sekiro(time_t timeout, pid_t *pid_out)
+// When pid started in CLOCK_BOOTTIME nanoseconds, to the precision of a clock tick.
+bool find_process_start_ns(pid_t pid, uint64_t *start_ns_out)
 {
-	time_t start_time = time(NULL);
-	if ((time_t)-1 == start_time) {
-		perror("time() failed");
+	long clock_ticks = sysconf(_SC_CLK_TCK);
+	if (clock_ticks <= 0) {
+		perror("sysconf(_SC_CLK_TCK) failed");
 		return false;
 	}
 
-	char buffer[64] = "";
-	time_t current_time = start_time;
-	do {
-		if (got_sigterm) {
-			fprintf(stderr, "got SIGTERM, exiting\n");
-			return false;
-		}
+	int proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (proc_fd == -1) {
+		perror("open(\"/proc\") failed");
+		return false;
+	}
 
-		DIR *dirp = opendir("/proc");
-		if (!dirp) {
-			perror("opendir() failed");
-			return false;
-		}
+	uint64_t start_time = 0;
+	enum find_sekiro_result result = is_process_sekiro(proc_fd, pid, &start_time);
+	if (close(proc_fd) == -1) {
+		perror("close() failed");
+		return false;
+	}
+	if (FOUND != result && NOT_FOUND != result) {
+		fprintf(stderr, "could not read the start time of %ld\n", (long)pid);
+		return false;
+	}
 
-		enum find_sekiro_result result = find_sekiro_in_dir(dirp, buffer, sizeof(buffer), pid_out);
-		if (closedir(dirp) == -1) {
-			perror("closedir() failed");
-			return false;
-		}
+	*start_ns_out = start_time * (1000000000ULL / clock_ticks);
 
-		switch (result) {
-		case NOT_FOUND:
-			break;
-		case FOUND:
-			return true;
-		case ERROR:
-			fprintf(stderr, "find_sekiro_in_dir() failed\n");
-			return false;
-		default:
-			fprintf(stderr, "unknown result of find_sekiro_in_dir()\n");
-			return false;
-		}
+	return true;
+}
 
-		current_time = time(NULL);
-		if ((time_t)-1 == start_time) {
-			perror("time() failed");
-			return false;
-		}
-	} while (current_time - start_time < timeout);
+struct sekiro_search {
+	struct process_scanner *scanner;
+	pid_t *pid_out;
+};
+
+static enum loop_status search_sekiro(void *data)
+{
+	struct sekiro_search *search = data;
+	bool found = false;
+	if (!process_scanner_pass(search->scanner, &found, search->pid_out)) {
+		fprintf(stderr, "process_scanner_pass() failed\n");
+		return LOOP_FAILED;
+	}
+
+	return found ? LOOP_DONE : LOOP_CONTINUE;
+}
+
+static bool find_sekiro_with_scanner(struct loop *loop, struct process_scanner *scanner, time_t timeout, pid_t *pid_out)
+{
+	struct sekiro_search search = {
+		.scanner = scanner,
+		.pid_out = pid_out,
+	};
+	struct loop_step step = {
+		.description = "searching for sekiro.exe",
+		.timeout = timeout,
+		.tick_ns = LOOP_POLL_INTERVAL_NS,
+		.tick = search_sekiro,
+		.data = &search,
+	};
+
+	return loop_run(loop, &step) == LOOP_DONE;
+}
+
+bool find_sekiro(struct loop *loop, time_t timeout, pid_t *pid_out)
+{
+	struct process_scanner scanner;
+	if (!process_scanner_init(&scanner)) {
+		fprintf(stderr, "process_scanner_init() failed\n");
+		return false;
+	}
+
+	bool success = find_sekiro_with_scanner(loop, &scanner, timeout, pid_out);
 
-	fprintf(stderr, "timeout reached while searching for sekiro.exe\n");
+	process_scanner_free(&scanner);
 
-	return false;
+	return success;
 }
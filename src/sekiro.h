@@ -1,5 +1,39 @@
+#pragma once
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <time.h>
 
-bool find_sekiro(time_t timeout, pid_t *pid_out);
+// Wine renames the process a little while after exec, a process this young may still turn into the game.
+#define RENAME_GRACE_SECONDS 30
+
+struct loop;
+
+struct rejected_process {
+	pid_t pid;
+	uint64_t inode;
+	// Clock ticks after boot.
+	uint64_t start_time;
+};
+
+struct process_scanner {
+	int proc_fd;
+	long clock_ticks;
+	uint8_t *dirents;
+	size_t dirents_size;
+	// Processes that are known not to be the game, sorted by pid.
+	struct rejected_process *rejected;
+	size_t rejected_length;
+	struct rejected_process *rejected_next;
+	size_t rejected_capacity;
+	// Looks at every process on every pass like a plain /proc walk, only useful for comparing against.
+	bool rescan_rejected;
+};
+
+bool process_scanner_init(struct process_scanner *scanner);
+void process_scanner_free(struct process_scanner *scanner);
+bool process_scanner_pass(struct process_scanner *scanner, bool *found_out, pid_t *pid_out);
+bool find_process_start_ns(pid_t pid, uint64_t *start_ns_out);
+bool find_sekiro(struct loop *loop, time_t timeout, pid_t *pid_out);
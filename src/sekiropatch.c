@@ -0,0 +1,464 @@
+#define _POSIX_C_SOURCE 1
+
+#include "sekiropatch.h"
+
+#include "fps.h"
+#include "placement.h"
+#include "profile.h"
+#include "resolution.h"
+#include "scan.h"
+#include "sekiro.h"
+#include "session.h"
+#include "trace.h"
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_TIMEOUT_SECONDS 30
+// The game sometimes stays stopped when SIGCONT comes right after the detach.
+#define SETTLE_SECONDS 1
+
+enum session_phase {
+	PHASE_IDLE,
+	PHASE_DISCOVERING,
+	PHASE_PATCHING,
+	PHASE_SETTLING,
+	PHASE_DONE,
+	PHASE_FAILED,
+};
+
+struct sekiropatch {
+	struct loop loop;
+	struct patch_plan plan;
+	struct process_scanner scanner;
+	bool has_scanner;
+	time_t timeout;
+	enum session_phase phase;
+	pid_t pid;
+	FILE *f;
+	struct context context;
+	struct patch_targets targets;
+	struct unpack_profile profile;
+	bool has_profile;
+	bool uses_cache;
+	bool places_threads;
+	// While patching, NULL otherwise.
+	struct placement *placement;
+	// The step that is running in the loop right now.
+	struct loop_step step;
+	size_t action;
+	bool failed;
+	char error[256];
+};
+
+static void set_error(struct sekiropatch *session, const char *format, ...)
+{
+	// The first error is the one that matters, whatever follows is fallout.
+	if (session->error[0]) {
+		return;
+	}
+
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(session->error, sizeof(session->error), format, arguments);
+	va_end(arguments);
+}
+
+static void set_step_error(struct sekiropatch *session, enum loop_status status, const char *what)
+{
+	switch (status) {
+	case LOOP_TIMEOUT:
+		set_error(session, "timeout reached while %s", session->step.description ? session->step.description : what);
+		break;
+	case LOOP_EXITED:
+		set_error(session, "sekiro.exe exited");
+		break;
+	case LOOP_INTERRUPTED:
+		set_error(session, "interrupted");
+		break;
+	default:
+		set_error(session, "%s failed", what);
+	}
+}
+
+// Uses the scanner self-bench stored for this machine, if it still runs here.
+static void select_stored_scanner(void)
+{
+	char name[64] = "";
+	if (!profile_load_scanner(name, sizeof(name))) {
+		fprintf(stderr, "profile_load_scanner() failed\n");
+		return;
+	}
+	if (*name && !scan_select(name)) {
+		fprintf(stderr, "stored scanner %s can't be used, using %s\n", name, scan_selected()->name);
+	}
+}
+
+struct sekiropatch *session_new(bool handle_signals)
+{
+	struct sekiropatch *session = calloc(1, sizeof(struct sekiropatch));
+	if (!session) {
+		fprintf(stderr, "calloc() failed\n");
+		return NULL;
+	}
+	session->timeout = DEFAULT_TIMEOUT_SECONDS;
+	if (!loop_init(&session->loop, handle_signals)) {
+		fprintf(stderr, "loop_init() failed\n");
+		free(session);
+		return NULL;
+	}
+
+	return session;
+}
+
+struct patch_plan *session_plan(struct sekiropatch *session)
+{
+	return &session->plan;
+}
+
+struct loop *session_loop(struct sekiropatch *session)
+{
+	return &session->loop;
+}
+
+const struct patch_targets *session_targets(struct sekiropatch *session)
+{
+	return &session->targets;
+}
+
+void session_place_threads(struct sekiropatch *session)
+{
+	session->places_threads = true;
+}
+
+struct sekiropatch *sekiropatch_new(void)
+{
+	return session_new(false);
+}
+
+static void close_memory(struct sekiropatch *session)
+{
+	if (session->f && fclose(session->f) == EOF) {
+		perror("fclose() failed");
+	}
+	session->f = NULL;
+}
+
+void sekiropatch_free(struct sekiropatch *session)
+{
+	if (!session) {
+		return;
+	}
+
+	// An action that is cut short still has to clean up while the game is traced, watchpoints left behind would hit a
+	// game nothing catches the traps of anymore. It reports the interruption as a failure, that's expected here.
+	if (PHASE_PATCHING == session->phase) {
+		loop_end(&session->loop);
+		plan_finish_action(&session->plan, session->action, &session->context, LOOP_INTERRUPTED);
+	}
+	close_memory(session);
+	if (session->loop.traced && loop_detach(&session->loop) && kill(session->pid, SIGCONT) == -1) {
+		perror("kill() failed");
+	}
+	if (PHASE_SETTLING == session->phase && kill(session->pid, SIGCONT) == -1) {
+		perror("kill() failed");
+	}
+	if (session->has_scanner) {
+		process_scanner_free(&session->scanner);
+	}
+	placement_free(session->placement);
+	plan_free(&session->plan);
+	loop_free(&session->loop);
+	free(session);
+}
+
+bool sekiropatch_set_timeout(struct sekiropatch *session, time_t seconds)
+{
+	if (PHASE_IDLE != session->phase) {
+		fprintf(stderr, "the session has already started\n");
+		return false;
+	}
+	session->timeout = seconds;
+
+	return true;
+}
+
+bool sekiropatch_set_cache(struct sekiropatch *session, bool enabled)
+{
+	if (PHASE_IDLE != session->phase) {
+		fprintf(stderr, "the session has already started\n");
+		return false;
+	}
+	if (enabled && !session->uses_cache) {
+		select_stored_scanner();
+	}
+	session->uses_cache = enabled;
+
+	return true;
+}
+
+void sekiropatch_enable_tracing(void)
+{
+	trace_init();
+}
+
+bool sekiropatch_set_fps(struct sekiropatch *session, float fps)
+{
+	if (PHASE_IDLE != session->phase) {
+		fprintf(stderr, "the session has already started\n");
+		return false;
+	}
+
+	return plan_fps(&session->plan, fps);
+}
+
+bool sekiropatch_set_resolution(struct sekiropatch *session, uint32_t screen_width, uint32_t game_width,
+				uint32_t game_height)
+{
+	if (PHASE_IDLE != session->phase) {
+		fprintf(stderr, "the session has already started\n");
+		return false;
+	}
+
+	return plan_resolution(&session->plan, screen_width, game_width, game_height);
+}
+
+static bool begin_step(struct sekiropatch *session, enum session_phase phase)
+{
+	if (!loop_begin(&session->loop, &session->step)) {
+		fprintf(stderr, "loop_begin() failed\n");
+		return false;
+	}
+	session->phase = phase;
+
+	return true;
+}
+
+// Detaches and gives the game a moment before it gets SIGCONT, without blocking anyone.
+static void settle(struct sekiropatch *session)
+{
+	close_memory(session);
+	placement_free(session->placement);
+	session->placement = NULL;
+	if (session->has_profile && !profile_save(&session->profile)) {
+		fprintf(stderr, "profile_save() failed\n");
+	}
+
+	if (session->loop.traced && !loop_detach(&session->loop)) {
+		fprintf(stderr, "loop_detach() failed\n");
+		set_error(session, "could not detach from sekiro.exe");
+		session->failed = true;
+	}
+
+	session->step = (struct loop_step){ .timeout = SETTLE_SECONDS };
+	if (!begin_step(session, PHASE_SETTLING)) {
+		set_error(session, "could not wait for sekiro.exe to settle");
+		session->phase = PHASE_FAILED;
+	}
+}
+
+static void fail(struct sekiropatch *session)
+{
+	session->failed = true;
+	if (session->loop.traced) {
+		settle(session);
+	} else {
+		session->phase = PHASE_FAILED;
+	}
+}
+
+static void begin_action(struct sekiropatch *session)
+{
+	if (session->action == session->plan.actions_length) {
+		settle(session);
+		return;
+	}
+
+	if (!plan_begin_action(&session->plan, session->action, &session->context, &session->step) ||
+	    !begin_step(session, PHASE_PATCHING)) {
+		set_error(session, "could not start patching");
+		fail(session);
+	}
+}
+
+static bool open_memory(struct sekiropatch *session)
+{
+	session->f = open_process_memory(session->pid);
+	if (!session->f) {
+		fprintf(stderr, "open_process_memory() failed\n");
+		return false;
+	}
+	session->context = (struct context){
+		.f = session->f,
+		.loop = &session->loop,
+		.timeout = session->timeout,
+		.targets = &session->targets,
+	};
+
+	// Patching works the same without a profile, it just can't idle until the patterns are due.
+	if (!session->uses_cache) {
+		return true;
+	}
+	session->has_profile = profile_load(&session->profile, session->f, session->pid);
+	if (session->has_profile) {
+		session->context.profile = &session->profile;
+	} else {
+		fprintf(stderr, "profile_load() failed, polling from the start\n");
+	}
+
+	return true;
+}
+
+static void attach(struct sekiropatch *session)
+{
+	if (!loop_attach(&session->loop, session->pid)) {
+		set_error(session, "could not attach to sekiro.exe");
+		session->phase = PHASE_FAILED;
+		return;
+	}
+
+	if (!open_memory(session)) {
+		set_error(session, "could not open the memory of sekiro.exe");
+		fail(session);
+		return;
+	}
+
+	// Patching works the same from anywhere, just with more competition for the game.
+	if (session->places_threads) {
+		session->placement = placement_new(session->pid);
+		if (!session->placement) {
+			fprintf(stderr, "placement_new() failed, running on any core\n");
+		}
+	}
+
+	session->action = 0;
+	begin_action(session);
+}
+
+static enum loop_status discover(void *data)
+{
+	struct sekiropatch *session = data;
+	bool found = false;
+	if (!process_scanner_pass(&session->scanner, &found, &session->pid)) {
+		fprintf(stderr, "process_scanner_pass() failed\n");
+		return LOOP_FAILED;
+	}
+
+	return found ? LOOP_DONE : LOOP_CONTINUE;
+}
+
+bool sekiropatch_start(struct sekiropatch *session, pid_t pid)
+{
+	if (PHASE_IDLE != session->phase) {
+		fprintf(stderr, "the session has already started\n");
+		return false;
+	}
+
+	if (pid) {
+		session->pid = pid;
+		attach(session);
+		return PHASE_FAILED != session->phase;
+	}
+
+	if (!process_scanner_init(&session->scanner)) {
+		fprintf(stderr, "process_scanner_init() failed\n");
+		return false;
+	}
+	session->has_scanner = true;
+
+	session->step = (struct loop_step){
+		.description = "searching for sekiro.exe",
+		.timeout = session->timeout,
+		.tick_ns = LOOP_POLL_INTERVAL_NS,
+		.tick = discover,
+		.data = session,
+	};
+
+	return begin_step(session, PHASE_DISCOVERING);
+}
+
+int sekiropatch_fd(const struct sekiropatch *session)
+{
+	return session->loop.epoll_fd;
+}
+
+static void finish_step(struct sekiropatch *session, enum loop_status status)
+{
+	loop_end(&session->loop);
+
+	switch (session->phase) {
+	case PHASE_DISCOVERING:
+		process_scanner_free(&session->scanner);
+		session->has_scanner = false;
+		if (LOOP_DONE != status) {
+			set_step_error(session, status, "searching for sekiro.exe");
+			session->phase = PHASE_FAILED;
+			return;
+		}
+		attach(session);
+		return;
+	case PHASE_PATCHING:
+		if (!plan_finish_action(&session->plan, session->action, &session->context, status)) {
+			set_step_error(session, status, "patching");
+			fail(session);
+			return;
+		}
+		++session->action;
+		begin_action(session);
+		return;
+	case PHASE_SETTLING:
+		// Settling is over once its timeout is reached.
+		if (LOOP_TIMEOUT != status) {
+			set_step_error(session, status, "waiting for sekiro.exe to settle");
+			session->failed = true;
+		}
+		if (kill(session->pid, SIGCONT) == -1) {
+			perror("kill() failed");
+			set_error(session, "could not continue sekiro.exe");
+			session->failed = true;
+		}
+		session->phase = session->failed ? PHASE_FAILED : PHASE_DONE;
+		return;
+	default:
+		return;
+	}
+}
+
+// Handles whatever the descriptor signalled and moves on to the next step when one is over.
+enum sekiropatch_status sekiropatch_poll(struct sekiropatch *session)
+{
+	if (session->placement && !placement_update(session->placement)) {
+		fprintf(stderr, "placement_update() failed, running on any core\n");
+		placement_free(session->placement);
+		session->placement = NULL;
+	}
+
+	if (PHASE_DISCOVERING == session->phase || PHASE_PATCHING == session->phase ||
+	    PHASE_SETTLING == session->phase) {
+		enum loop_status status = loop_dispatch(&session->loop, &session->step, 0);
+		if (LOOP_CONTINUE != status) {
+			finish_step(session, status);
+		}
+	}
+
+	switch (session->phase) {
+	case PHASE_DONE:
+		return SEKIROPATCH_DONE;
+	case PHASE_FAILED:
+		return SEKIROPATCH_FAILED;
+	default:
+		return SEKIROPATCH_PENDING;
+	}
+}
+
+pid_t sekiropatch_pid(const struct sekiropatch *session)
+{
+	return session->pid;
+}
+
+const char *sekiropatch_error(const struct sekiropatch *session)
+{
+	return session->error;
+}
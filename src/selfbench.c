@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "selfbench.h"
+
+#include "fps.h"
+#include "plan.h"
+#include "profile.h"
+#include "resolution.h"
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// About the size of the game's .text.
+#define BENCH_BUFFER_SIZE (32 * 1024 * 1024)
+// The best of these counts, the first one also warms up the buffer.
+#define BENCH_ROUNDS 3
+
+// Every site the patches can look for, each only once.
+static size_t collect_sites(struct patch_plan *plan, const struct pattern_site **sites_out, size_t sites_size)
+{
+	if (!plan_fps(plan, 60.0f) || !plan_resolution(plan, 1920, 1920, 1080) ||
+	    !plan_resolution(plan, 1280, 1280, 720)) {
+		fprintf(stderr, "planning the patches failed\n");
+		return 0;
+	}
+
+	const struct pattern_site *all[MAX_PLAN_ACTIONS] = { 0 };
+	size_t all_length = plan_pattern_sites(plan, all, MAX_PLAN_ACTIONS);
+	size_t length = 0;
+	for (size_t i = 0; i < all_length && length < sites_size; ++i) {
+		bool seen = false;
+		for (size_t j = 0; j < length; ++j) {
+			seen = seen || sites_out[j] == all[i];
+		}
+		if (!seen) {
+			sites_out[length++] = all[i];
+		}
+	}
+
+	return length;
+}
+
+// Roughly the byte distribution of x86 code, plenty of the patterns' own bytes but no match in it.
+static void fill_buffer(uint8_t *buffer, size_t size)
+{
+	static const uint8_t common_bytes[] = { 0x00, 0x0f, 0x48, 0x89, 0x8b, 0xc7, 0xe8, 0xf3, 0xff, 0x4c };
+	// xorshift64*, the buffer only has to look the same on every run.
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	for (size_t i = 0; i < size; ++i) {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		uint64_t random = state * 0x2545f4914f6cdd1dULL;
+		buffer[i] = random & 0x100 ? common_bytes[(random >> 16) % sizeof(common_bytes)] : (uint8_t)random;
+	}
+}
+
+static void plant(const struct pattern_site *site, uint8_t *buffer, size_t position)
+{
+	for (size_t i = 0; i < site->pattern_bytes_length; ++i) {
+		if (!site->pattern_bytes[i].is_ignored) {
+			buffer[position + i] = site->pattern_bytes[i].value;
+		}
+	}
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// The best time the backend takes to find the site where the reference found it, false if it finds it elsewhere.
+static bool time_backend(const struct scan_backend *backend, const struct pattern_site *site, const uint8_t *buffer,
+			 size_t expected, uint64_t *ns_out)
+{
+	uint64_t best_ns = UINT64_MAX;
+	for (int round = 0; round < BENCH_ROUNDS; ++round) {
+		uint64_t start_ns = monotonic_ns();
+		size_t index = 0;
+		if (!backend->find(site->pattern_bytes, site->pattern_bytes_length, buffer, BENCH_BUFFER_SIZE, &index) ||
+		    index != expected) {
+			fprintf(stderr, "%s did not find the %s pattern where %s does\n", backend->name, site->name,
+				scan_backends[0].name);
+			return false;
+		}
+		uint64_t elapsed_ns = monotonic_ns() - start_ns;
+		best_ns = elapsed_ns < best_ns ? elapsed_ns : best_ns;
+	}
+	*ns_out = best_ns;
+
+	return true;
+}
+
+// Fills in total_ns for every backend, summed over every site. UINT64_MAX for the ones that can't run or got something
+// wrong.
+static bool time_backends(const struct pattern_site **sites, size_t sites_length, uint8_t *buffer, uint64_t *total_ns)
+{
+	for (size_t i = 0; i < scan_backends_length; ++i) {
+		total_ns[i] = scan_backend_supported(&scan_backends[i]) ? 0 : UINT64_MAX;
+	}
+
+	for (size_t i = 0; i < sites_length; ++i) {
+		// The pattern sits at the last place the scanners report, so every scan covers the whole buffer.
+		size_t expected = BENCH_BUFFER_SIZE - sites[i]->pattern_bytes_length - 1;
+		plant(sites[i], buffer, expected);
+		if (!scan_backends[0].find(sites[i]->pattern_bytes, sites[i]->pattern_bytes_length, buffer,
+					   BENCH_BUFFER_SIZE, &expected)) {
+			fprintf(stderr, "%s does not find the planted %s pattern\n", scan_backends[0].name, sites[i]->name);
+			return false;
+		}
+
+		for (size_t j = 0; j < scan_backends_length; ++j) {
+			uint64_t ns = 0;
+			if (UINT64_MAX == total_ns[j]) {
+				continue;
+			}
+			total_ns[j] = time_backend(&scan_backends[j], sites[i], buffer, expected, &ns) ? total_ns[j] + ns
+												: UINT64_MAX;
+		}
+	}
+
+	return true;
+}
+
+static bool report(const uint64_t *total_ns, size_t sites_length, bool save)
+{
+	const struct scan_backend *fastest = &scan_backends[0];
+	for (size_t i = 0; i < scan_backends_length; ++i) {
+		const struct scan_backend *backend = &scan_backends[i];
+		if (!scan_backend_supported(backend)) {
+			printf("%-12s not supported by this CPU\n", backend->name);
+			continue;
+		}
+		if (UINT64_MAX == total_ns[i]) {
+			printf("%-12s wrong results, skipped\n", backend->name);
+			continue;
+		}
+		printf("%-12s %8.2f ms %10.1f MiB/s\n", backend->name, total_ns[i] / 1e6,
+		       (double)BENCH_BUFFER_SIZE * sites_length / (1024 * 1024) / (total_ns[i] / 1e9));
+		if (total_ns[i] < total_ns[fastest - scan_backends]) {
+			fastest = backend;
+		}
+	}
+
+	printf("fastest is %s, using %s now\n", fastest->name, scan_selected()->name);
+	if (!save) {
+		return true;
+	}
+
+	if (!profile_save_scanner(fastest->name)) {
+		fprintf(stderr, "profile_save_scanner() failed\n");
+		return false;
+	}
+	printf("stored %s for this machine\n", fastest->name);
+
+	return true;
+}
+
+bool self_bench(bool save)
+{
+	struct patch_plan plan = { 0 };
+	const struct pattern_site *sites[MAX_PLAN_ACTIONS] = { 0 };
+	size_t sites_length = collect_sites(&plan, sites, MAX_PLAN_ACTIONS);
+	if (!sites_length) {
+		plan_free(&plan);
+		return false;
+	}
+
+	uint8_t *buffer = malloc(BENCH_BUFFER_SIZE);
+	if (!buffer) {
+		fprintf(stderr, "malloc() failed\n");
+		plan_free(&plan);
+		return false;
+	}
+	fill_buffer(buffer, BENCH_BUFFER_SIZE);
+	printf("%zu patterns in %d MiB, best of %d rounds\n", sites_length, BENCH_BUFFER_SIZE / (1024 * 1024),
+	       BENCH_ROUNDS);
+
+	uint64_t *total_ns = calloc(scan_backends_length, sizeof(uint64_t));
+	if (!total_ns) {
+		fprintf(stderr, "calloc() failed\n");
+		free(buffer);
+		plan_free(&plan);
+		return false;
+	}
+
+	bool success = time_backends(sites, sites_length, buffer, total_ns) && report(total_ns, sites_length, save);
+
+	free(total_ns);
+	free(buffer);
+	plan_free(&plan);
+
+	return success;
+}
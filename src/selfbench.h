@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Times every scanner this CPU can run on the patterns the patches look for, and stores the fastest one for this
+// machine if asked to.
+bool self_bench(bool save);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "sekiropatch.h"
+
+#include "loop.h"
+#include "plan.h"
+
+#include <stdbool.h>
+
+// What the command needs on top of the public API: a loop that handles SIGTERM and SIGINT, and its own actions.
+struct sekiropatch *session_new(bool handle_signals);
+struct patch_plan *session_plan(struct sekiropatch *session);
+struct loop *session_loop(struct sekiropatch *session);
+// Where the last patching wrote its values.
+const struct patch_targets *session_targets(struct sekiropatch *session);
+// Makes the calling thread nicer than the game while patching, and moves it off the cores the game is busy on. Not
+// something a library should do to the program it is in.
+void session_place_threads(struct sekiropatch *session);
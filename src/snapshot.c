@@ -0,0 +1,501 @@
+#define _GNU_SOURCE 1
+
+#include "snapshot.h"
+
+#include "loop.h"
+#include "plan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct captured_range {
+	size_t position;
+	size_t size;
+	uint8_t *previous;
+	uint8_t *current;
+	bool captured;
+};
+
+struct replay_page {
+	uint64_t address;
+	uint64_t timestamp_ns;
+	// NULL for a page that was all zeroes.
+	const uint8_t *data;
+};
+
+struct replay {
+	uint8_t *map;
+	size_t map_size;
+	struct replay_page *pages;
+	size_t pages_length;
+	uint64_t *timestamps;
+	size_t timestamps_length;
+	size_t current_timestamp;
+	off64_t position;
+	off64_t previous_read_position;
+	bool has_read;
+};
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static bool is_zero_page(const uint8_t *page)
+{
+	for (size_t i = 0; i < SNAPSHOT_PAGE_SIZE; ++i) {
+		if (page[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool write_page(FILE *out, uint64_t timestamp_ns, uint64_t address, const uint8_t *page)
+{
+	struct snapshot_record record = {
+		.timestamp_ns = timestamp_ns,
+		.address = address,
+		.flags = is_zero_page(page) ? SNAPSHOT_RECORD_ZERO : 0,
+	};
+	if (fwrite(&record, sizeof(record), 1, out) != 1) {
+		fprintf(stderr, "fwrite() failed\n");
+		return false;
+	}
+
+	if (!(record.flags & SNAPSHOT_RECORD_ZERO) && fwrite(page, SNAPSHOT_PAGE_SIZE, 1, out) != 1) {
+		fprintf(stderr, "fwrite() failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool capture_range(struct context *context, FILE *out, uint64_t timestamp_ns, struct captured_range *range)
+{
+	if (!seek_and_read_bytes(range->current, range->size, range->position, context->f)) {
+		fprintf(stderr, "seek_and_read_bytes() failed\n");
+		return false;
+	}
+
+	for (size_t offset = 0; offset < range->size; offset += SNAPSHOT_PAGE_SIZE) {
+		if (range->captured && !memcmp(range->previous + offset, range->current + offset, SNAPSHOT_PAGE_SIZE)) {
+			continue;
+		}
+
+		if (!write_page(out, timestamp_ns, range->position + offset, range->current + offset)) {
+			fprintf(stderr, "write_page() failed\n");
+			return false;
+		}
+	}
+
+	uint8_t *previous = range->previous;
+	range->previous = range->current;
+	range->current = previous;
+	range->captured = true;
+
+	return true;
+}
+
+struct capture {
+	struct context *context;
+	FILE *out;
+	uint32_t interval_ms;
+	// The first range holds the image headers, so a replay can find the sections too.
+	struct captured_range ranges[MAX_SECTIONS + 1];
+	size_t ranges_length;
+	uint64_t start_ns;
+	size_t captures;
+};
+
+static enum loop_status capture_tick(void *data)
+{
+	struct capture *capture = data;
+	uint64_t timestamp_ns = monotonic_ns() - capture->start_ns;
+	for (size_t i = 0; i < capture->ranges_length; ++i) {
+		if (!capture_range(capture->context, capture->out, timestamp_ns, &capture->ranges[i])) {
+			fprintf(stderr, "capture_range() failed\n");
+			return LOOP_FAILED;
+		}
+	}
+	++capture->captures;
+
+	return LOOP_CONTINUE;
+}
+
+static bool begin_capture(struct context *context, void *data, struct loop_step *step_out)
+{
+	struct capture *capture = data;
+	capture->context = context;
+
+	struct section_info sections[MAX_SECTIONS];
+	size_t sections_length = 0;
+	if (!find_sections(context->f, sections, MAX_SECTIONS, &sections_length)) {
+		fprintf(stderr, "find_sections() failed\n");
+		return false;
+	}
+
+	struct snapshot_header header = {
+		.magic = SNAPSHOT_MAGIC,
+		.version = SNAPSHOT_VERSION,
+		.page_size = SNAPSHOT_PAGE_SIZE,
+	};
+	if (fwrite(&header, sizeof(header), 1, capture->out) != 1) {
+		fprintf(stderr, "fwrite() failed\n");
+		return false;
+	}
+
+	capture->ranges[0] = (struct captured_range){ .position = IMAGE_BASE, .size = SNAPSHOT_PAGE_SIZE };
+	capture->ranges_length = 1;
+	for (size_t i = 0; i < sections_length; ++i) {
+		struct captured_range *range = &capture->ranges[capture->ranges_length++];
+		range->position = sections[i].position;
+		range->size = (sections[i].size + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE * SNAPSHOT_PAGE_SIZE;
+	}
+
+	for (size_t i = 0; i < capture->ranges_length; ++i) {
+		capture->ranges[i].previous = calloc(capture->ranges[i].size, sizeof(uint8_t));
+		capture->ranges[i].current = calloc(capture->ranges[i].size, sizeof(uint8_t));
+		if (!capture->ranges[i].previous || !capture->ranges[i].current) {
+			fprintf(stderr, "calloc() failed\n");
+			return false;
+		}
+	}
+
+	capture->start_ns = monotonic_ns();
+	// Capturing only ever ends with the timeout, without a description the loop does not complain about it.
+	*step_out = (struct loop_step){
+		.timeout = context->timeout,
+		.tick_ns = capture->interval_ms * 1000000L,
+		.tick = capture_tick,
+		.data = capture,
+	};
+
+	return true;
+}
+
+static bool finish_capture(struct context *context, void *data, enum loop_status status)
+{
+	struct capture *capture = data;
+	if (LOOP_TIMEOUT != status) {
+		return false;
+	}
+
+	if (fflush(capture->out) == EOF) {
+		perror("fflush() failed");
+		return false;
+	}
+
+	// Leave the game stopped like the patch commands do, it can only be detached from while stopped.
+	if (!loop_stop_tracee(context->loop)) {
+		fprintf(stderr, "loop_stop_tracee() failed\n");
+		return false;
+	}
+	fprintf(stderr, "captured %zu snapshots of %zu ranges\n", capture->captures, capture->ranges_length);
+
+	return true;
+}
+
+static void free_capture(void *data)
+{
+	struct capture *capture = data;
+	for (size_t i = 0; i < capture->ranges_length; ++i) {
+		free(capture->ranges[i].previous);
+		free(capture->ranges[i].current);
+	}
+	if (fclose(capture->out) == EOF) {
+		perror("fclose() failed");
+	}
+	free(capture);
+}
+
+bool main_capture(struct patch_plan *plan, int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "need at least 2 arguments to capture\n");
+		return false;
+	}
+
+	uint32_t interval_ms = 0;
+	if (!string_to_uint32(argv[1], 10, &interval_ms)) {
+		fprintf(stderr, "string_to_uint32() failed\n");
+		return false;
+	}
+
+	struct capture *capture = calloc(1, sizeof(struct capture));
+	if (!capture) {
+		fprintf(stderr, "calloc() failed\n");
+		return false;
+	}
+	capture->interval_ms = interval_ms;
+	capture->out = fopen(argv[0], "wb");
+	if (!capture->out) {
+		perror("fopen() failed");
+		free(capture);
+		return false;
+	}
+
+	struct plan_action action = {
+		.begin = begin_capture,
+		.finish = finish_capture,
+		.free = free_capture,
+		.data = capture,
+	};
+
+	return plan_add(plan, &action);
+}
+
+static int compare_replay_pages(const void *a, const void *b)
+{
+	const struct replay_page *left = a;
+	const struct replay_page *right = b;
+	if (left->address != right->address) {
+		return left->address < right->address ? -1 : 1;
+	}
+
+	return (left->timestamp_ns > right->timestamp_ns) - (left->timestamp_ns < right->timestamp_ns);
+}
+
+// Finds the newest contents of the page at address as of timestamp_ns, NULL if the page was never captured or was
+// all zeroes.
+static const uint8_t *replay_page_at(const struct replay *replay, uint64_t address, uint64_t timestamp_ns)
+{
+	size_t low = 0;
+	size_t high = replay->pages_length;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		const struct replay_page *page = &replay->pages[middle];
+		if (page->address < address || (page->address == address && page->timestamp_ns <= timestamp_ns)) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	if (!low || replay->pages[low - 1].address != address) {
+		return NULL;
+	}
+
+	return replay->pages[low - 1].data;
+}
+
+static ssize_t replay_read(void *cookie, char *buffer, size_t size)
+{
+	struct replay *replay = cookie;
+
+	// Every time the reader goes back to an address it has already read, it is polling again, so it gets to see
+	// the next capture. This makes a replay independent of how fast the machine is.
+	if (replay->has_read && replay->position <= replay->previous_read_position &&
+	    replay->current_timestamp + 1 < replay->timestamps_length) {
+		++replay->current_timestamp;
+	}
+	replay->has_read = true;
+	replay->previous_read_position = replay->position;
+	uint64_t timestamp_ns = replay->timestamps_length ? replay->timestamps[replay->current_timestamp] : 0;
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t address = replay->position + done;
+		uint64_t page_address = address / SNAPSHOT_PAGE_SIZE * SNAPSHOT_PAGE_SIZE;
+		size_t page_offset = address - page_address;
+		size_t length = SNAPSHOT_PAGE_SIZE - page_offset;
+		if (length > size - done) {
+			length = size - done;
+		}
+
+		const uint8_t *data = replay_page_at(replay, page_address, timestamp_ns);
+		if (data) {
+			memcpy(buffer + done, data + page_offset, length);
+		} else {
+			memset(buffer + done, 0, length);
+		}
+		done += length;
+	}
+	replay->position += done;
+
+	return done;
+}
+
+static ssize_t replay_write(void *cookie, const char *buffer, size_t size)
+{
+	struct replay *replay = cookie;
+	(void)buffer;
+
+	fprintf(stderr, "replay: write of %zu bytes at 0x%llx\n", size, (unsigned long long)replay->position);
+	replay->position += size;
+
+	return size;
+}
+
+static int replay_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct replay *replay = cookie;
+	switch (whence) {
+	case SEEK_SET:
+		replay->position = *offset;
+		break;
+	case SEEK_CUR:
+		replay->position += *offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	*offset = replay->position;
+
+	return 0;
+}
+
+static int replay_close(void *cookie)
+{
+	struct replay *replay = cookie;
+	int result = 0;
+	if (replay->map && munmap(replay->map, replay->map_size) == -1) {
+		perror("munmap() failed");
+		result = -1;
+	}
+	free(replay->pages);
+	free(replay->timestamps);
+	free(replay);
+
+	return result;
+}
+
+static bool index_replay(struct replay *replay)
+{
+	const struct snapshot_header *header = (const struct snapshot_header *)replay->map;
+	if (replay->map_size < sizeof(*header) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic))) {
+		fprintf(stderr, "not a snapshot file\n");
+		return false;
+	}
+	if (header->version != SNAPSHOT_VERSION || header->page_size != SNAPSHOT_PAGE_SIZE) {
+		fprintf(stderr, "unsupported snapshot version or page size\n");
+		return false;
+	}
+
+	size_t capacity = 0;
+	for (int pass = 0; pass < 2; ++pass) {
+		size_t offset = sizeof(*header);
+		size_t pages_length = 0;
+		size_t timestamps_length = 0;
+		uint64_t previous_timestamp_ns = 0;
+		while (offset + sizeof(struct snapshot_record) <= replay->map_size) {
+			struct snapshot_record record;
+			memcpy(&record, replay->map + offset, sizeof(record));
+			offset += sizeof(record);
+
+			const uint8_t *data = NULL;
+			if (!(record.flags & SNAPSHOT_RECORD_ZERO)) {
+				if (offset + SNAPSHOT_PAGE_SIZE > replay->map_size) {
+					// The capture was cut off in the middle of a page.
+					break;
+				}
+				data = replay->map + offset;
+				offset += SNAPSHOT_PAGE_SIZE;
+			}
+
+			if (pass) {
+				replay->pages[pages_length] = (struct replay_page){
+					.address = record.address,
+					.timestamp_ns = record.timestamp_ns,
+					.data = data,
+				};
+				if (!timestamps_length || record.timestamp_ns != previous_timestamp_ns) {
+					replay->timestamps[timestamps_length] = record.timestamp_ns;
+				}
+			}
+			if (!timestamps_length || record.timestamp_ns != previous_timestamp_ns) {
+				++timestamps_length;
+			}
+			previous_timestamp_ns = record.timestamp_ns;
+			++pages_length;
+		}
+
+		if (!pass) {
+			capacity = pages_length;
+			replay->pages = calloc(capacity ? capacity : 1, sizeof(struct replay_page));
+			replay->timestamps = calloc(timestamps_length ? timestamps_length : 1, sizeof(uint64_t));
+			if (!replay->pages || !replay->timestamps) {
+				fprintf(stderr, "calloc() failed\n");
+				return false;
+			}
+		} else {
+			replay->pages_length = pages_length;
+			replay->timestamps_length = timestamps_length;
+		}
+	}
+
+	qsort(replay->pages, replay->pages_length, sizeof(struct replay_page), compare_replay_pages);
+	fprintf(stderr, "replaying %zu pages over %zu captures\n", replay->pages_length, replay->timestamps_length);
+
+	return true;
+}
+
+static bool map_replay(struct replay *replay, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open() failed");
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("fstat() failed");
+		close(fd);
+		return false;
+	}
+	replay->map_size = st.st_size;
+
+	void *map = replay->map_size ? mmap(NULL, replay->map_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if (close(fd) == -1) {
+		perror("close() failed");
+	}
+	if (map == MAP_FAILED) {
+		perror("mmap() failed");
+		return false;
+	}
+	replay->map = map;
+
+	return true;
+}
+
+// Returns a stream that reads like /proc/<pid>/mem did while the snapshot was captured. Writes are only logged.
+FILE *open_replay(const char *path)
+{
+	struct replay *replay = calloc(1, sizeof(struct replay));
+	if (!replay) {
+		fprintf(stderr, "calloc() failed\n");
+		return NULL;
+	}
+
+	if (!map_replay(replay, path) || !index_replay(replay)) {
+		replay_close(replay);
+		return NULL;
+	}
+
+	cookie_io_functions_t functions = {
+		.read = replay_read,
+		.write = replay_write,
+		.seek = replay_seek,
+		.close = replay_close,
+	};
+	FILE *f = fopencookie(replay, "r+", functions);
+	if (!f) {
+		perror("fopencookie() failed");
+		replay_close(replay);
+		return NULL;
+	}
+
+	return f;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.h"
+#include "plan.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SNAPSHOT_MAGIC "SEKSNAP1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE_SIZE 4096
+
+#define SNAPSHOT_RECORD_ZERO 1
+
+// A snapshot file is a header followed by page records in capture order. Every record is followed by
+// SNAPSHOT_PAGE_SIZE bytes of page contents, unless it is flagged SNAPSHOT_RECORD_ZERO. A page only gets a record
+// when its contents differ from the previous capture, so the file can be cut off at any record and still be used.
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+};
+
+struct snapshot_record {
+	uint64_t timestamp_ns;
+	uint64_t address;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+bool main_capture(struct patch_plan *plan, int argc, char *argv[]);
+FILE *open_replay(const char *path);
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE 1
+
+#include "telemetry.h"
+
+#include "loop.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define HISTOGRAM_BUCKET_MS 0.5
+#define HISTOGRAM_BUCKETS 200
+
+struct frame_sample {
+	float delta;
+	uint32_t counter;
+};
+
+struct frame_statistics {
+	float *frame_times_ms;
+	size_t frame_times_length;
+	size_t samples;
+	// Deltas that were negative, NaN or infinite, most likely read from the wrong address.
+	size_t rejected;
+	uint32_t first_counter;
+	uint32_t last_counter;
+	double seconds;
+};
+
+static bool string_to_uint64(const char *s, uint64_t *value_out)
+{
+	int errno_stored = errno;
+	errno = 0;
+	char *endptr = NULL;
+	*value_out = strtoull(s, &endptr, 16);
+	if (errno) {
+		perror("strtoull() failed");
+		return false;
+	}
+	if (endptr == s) {
+		fprintf(stderr, "strtoull() failed, no digits were read\n");
+		return false;
+	}
+	errno = errno_stored;
+
+	return true;
+}
+
+static double monotonic_seconds(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+	float left = *(const float *)a;
+	float right = *(const float *)b;
+
+	return (left > right) - (left < right);
+}
+
+// Both fields are read with a single process_vm_readv(), the game is never stopped.
+static bool read_frame_sample(pid_t pid, const struct frame_sampling *sampling, struct frame_sample *sample_out)
+{
+	struct iovec local[] = {
+		{ .iov_base = &sample_out->delta, .iov_len = sizeof(sample_out->delta) },
+		{ .iov_base = &sample_out->counter, .iov_len = sizeof(sample_out->counter) },
+	};
+	struct iovec remote[] = {
+		{ .iov_base = (void *)(uintptr_t)sampling->delta_address, .iov_len = sizeof(sample_out->delta) },
+		{ .iov_base = (void *)(uintptr_t)sampling->counter_address, .iov_len = sizeof(sample_out->counter) },
+	};
+
+	ssize_t read = process_vm_readv(pid, local, 2, remote, 2, 0);
+	if (read == -1) {
+		perror("process_vm_readv() failed");
+		return false;
+	}
+	if ((size_t)read != sizeof(sample_out->delta) + sizeof(sample_out->counter)) {
+		fprintf(stderr, "process_vm_readv() read %zd bytes, expected %zu\n", read,
+			sizeof(sample_out->delta) + sizeof(sample_out->counter));
+		return false;
+	}
+
+	return true;
+}
+
+static float percentile(const float *sorted, size_t length, double fraction)
+{
+	size_t index = fraction * (length - 1) + 0.5;
+
+	return sorted[index];
+}
+
+static bool write_report(FILE *out, struct frame_statistics *statistics)
+{
+	uint32_t frames = statistics->last_counter - statistics->first_counter;
+	fprintf(out, "samples %zu\n", statistics->samples);
+	fprintf(out, "frames %" PRIu32 "\n", frames);
+	fprintf(out, "seconds %.3f\n", statistics->seconds);
+	fprintf(out, "achieved-fps %.2f\n", statistics->seconds > 0 ? frames / statistics->seconds : 0.0);
+	fprintf(out, "rejected %zu\n", statistics->rejected);
+
+	if (!statistics->frame_times_length) {
+		fprintf(out, "no frames were observed\n");
+		return !ferror(out);
+	}
+
+	float *sorted = statistics->frame_times_ms;
+	size_t length = statistics->frame_times_length;
+	qsort(sorted, length, sizeof(float), compare_floats);
+	fprintf(out, "frame-time-ms min %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n", sorted[0],
+		percentile(sorted, length, 0.5), percentile(sorted, length, 0.9), percentile(sorted, length, 0.99),
+		percentile(sorted, length, 0.999), sorted[length - 1]);
+
+	size_t histogram[HISTOGRAM_BUCKETS + 1] = { 0 };
+	for (size_t i = 0; i < length; ++i) {
+		// Compared before converting, a frame time past the last bucket may not fit a size_t.
+		double bucket = sorted[i] / HISTOGRAM_BUCKET_MS;
+		histogram[bucket < HISTOGRAM_BUCKETS ? (size_t)bucket : HISTOGRAM_BUCKETS] += 1;
+	}
+	fprintf(out, "histogram-ms count\n");
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		if (histogram[i]) {
+			fprintf(out, "%.1f %zu\n", i * HISTOGRAM_BUCKET_MS, histogram[i]);
+		}
+	}
+	if (histogram[HISTOGRAM_BUCKETS]) {
+		fprintf(out, ">%.1f %zu\n", HISTOGRAM_BUCKETS * HISTOGRAM_BUCKET_MS, histogram[HISTOGRAM_BUCKETS]);
+	}
+
+	return !ferror(out);
+}
+
+struct frame_sampler {
+	pid_t pid;
+	const struct frame_sampling *sampling;
+	struct frame_statistics *statistics;
+	size_t capacity;
+};
+
+static enum loop_status sample_frame(void *data)
+{
+	struct frame_sampler *sampler = data;
+	struct frame_statistics *statistics = sampler->statistics;
+	struct frame_sample sample = { 0 };
+	if (!read_frame_sample(sampler->pid, sampler->sampling, &sample)) {
+		// The game was most likely closed, report what we have.
+		fprintf(stderr, "read_frame_sample() failed, stopping sampling\n");
+		return LOOP_DONE;
+	}
+	statistics->samples += 1;
+
+	// The delta only tells something new if at least one frame went by since the last sample.
+	if (sample.counter != statistics->last_counter) {
+		statistics->last_counter = sample.counter;
+		float frame_time_ms = sample.delta * 1000.0f;
+		if (isfinite(frame_time_ms) && frame_time_ms >= 0) {
+			statistics->frame_times_ms[statistics->frame_times_length] = frame_time_ms;
+			statistics->frame_times_length += 1;
+		} else {
+			statistics->rejected += 1;
+		}
+	}
+
+	return statistics->samples < sampler->capacity ? LOOP_CONTINUE : LOOP_DONE;
+}
+
+static bool sample_frames_with_buffer(struct loop *loop, pid_t pid, const struct frame_sampling *sampling,
+				      struct frame_statistics *statistics, size_t capacity)
+{
+	struct frame_sample sample = { 0 };
+	if (!read_frame_sample(pid, sampling, &sample)) {
+		fprintf(stderr, "read_frame_sample() failed\n");
+		return false;
+	}
+	statistics->first_counter = sample.counter;
+	statistics->last_counter = sample.counter;
+
+	struct frame_sampler sampler = {
+		.pid = pid,
+		.sampling = sampling,
+		.statistics = statistics,
+		.capacity = capacity,
+	};
+	// The timer keeps the rate steady no matter how long a read takes. Whatever ends the sampling early, the samples
+	// so far still get reported.
+	struct loop_step step = {
+		.description = "sampling frames",
+		.timeout = -1,
+		.tick_ns = 1000000000L / sampling->rate_hz,
+		.tick = sample_frame,
+		.data = &sampler,
+	};
+	double start = monotonic_seconds();
+	if (capacity) {
+		loop_run(loop, &step);
+	}
+	statistics->seconds = monotonic_seconds() - start;
+
+	FILE *out = fopen(sampling->path, "w");
+	if (!out) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	bool success = write_report(out, statistics);
+	if (!success) {
+		fprintf(stderr, "write_report() failed\n");
+	}
+
+	if (fclose(out) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
+
+bool parse_frame_sampling(int argc, char *argv[], struct frame_sampling *sampling_out)
+{
+	if (argc < 5) {
+		fprintf(stderr, "need at least 5 arguments to sample frames\n");
+		return false;
+	}
+
+	sampling_out->path = argv[0];
+	if (!string_to_uint32(argv[1], 10, &sampling_out->rate_hz) || !sampling_out->rate_hz ||
+	    sampling_out->rate_hz > 100000) {
+		fprintf(stderr, "sampling rate needs to be between 1 and 100000 Hz\n");
+		return false;
+	}
+
+	if (!string_to_uint32(argv[2], 10, &sampling_out->seconds)) {
+		fprintf(stderr, "string_to_uint32() failed\n");
+		return false;
+	}
+
+	if (!string_to_uint64(argv[3], &sampling_out->delta_address) ||
+	    !string_to_uint64(argv[4], &sampling_out->counter_address)) {
+		fprintf(stderr, "string_to_uint64() failed\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool sample_frames(struct loop *loop, pid_t pid, const struct frame_sampling *sampling)
+{
+	size_t capacity = (size_t)sampling->rate_hz * sampling->seconds;
+	struct frame_statistics statistics = { 0 };
+	statistics.frame_times_ms = calloc(capacity ? capacity : 1, sizeof(float));
+	if (!statistics.frame_times_ms) {
+		fprintf(stderr, "calloc() failed\n");
+		return false;
+	}
+
+	bool success = sample_frames_with_buffer(loop, pid, sampling, &statistics, capacity);
+
+	free(statistics.frame_times_ms);
+
+	return success;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct loop;
+
+struct frame_sampling {
+	const char *path;
+	uint32_t rate_hz;
+	uint32_t seconds;
+	uint64_t delta_address;
+	uint64_t counter_address;
+};
+
+bool parse_frame_sampling(int argc, char *argv[], struct frame_sampling *sampling_out);
+bool sample_frames(struct loop *loop, pid_t pid, const struct frame_sampling *sampling);
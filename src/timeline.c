@@ -0,0 +1,212 @@
+#define _GNU_SOURCE 1
+
+#include "timeline.h"
+
+#include "fps.h"
+#include "loop.h"
+#include "resolution.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TIMELINE_LINE_LENGTH 256
+
+struct timeline_runner {
+	pid_t pid;
+	const struct patch_targets *targets;
+	const struct fps_timeline *timeline;
+	// Opened for the first entry, before the game is stopped for it. /proc/<pid>/mem only needs ptrace permission.
+	FILE *f;
+	size_t next;
+	uint64_t start_ns;
+};
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static bool parse_entry(char *line, struct timeline_entry *entry_out)
+{
+	char kind[16] = "";
+	int consumed = 0;
+	if (sscanf(line, "%lf %15s %n", &entry_out->seconds, kind, &consumed) != 2 || entry_out->seconds < 0) {
+		return false;
+	}
+
+	char trailing = '\0';
+	if (!strcmp(kind, "fps")) {
+		entry_out->kind = TIMELINE_FPS;
+		return sscanf(line + consumed, "%f %c", &entry_out->fps, &trailing) == 1;
+	}
+	if (!strcmp(kind, "resolution")) {
+		entry_out->kind = TIMELINE_RESOLUTION;
+		return sscanf(line + consumed, "%" SCNu32 " %" SCNu32 " %c", &entry_out->game_width,
+			      &entry_out->game_height, &trailing) == 2;
+	}
+
+	return false;
+}
+
+// Empty lines and lines starting with # are skipped, the times must not go back.
+static bool read_timeline(FILE *f, const char *path, struct fps_timeline *timeline_out)
+{
+	char line[TIMELINE_LINE_LENGTH] = "";
+	for (size_t line_number = 1; fgets(line, sizeof(line), f); ++line_number) {
+		char *start = line + strspn(line, " \t");
+		if (!*start || '\n' == *start || '#' == *start) {
+			continue;
+		}
+
+		if (timeline_out->entries_length == MAX_TIMELINE_ENTRIES) {
+			fprintf(stderr, "%s has more than %d entries\n", path, MAX_TIMELINE_ENTRIES);
+			return false;
+		}
+		struct timeline_entry *entry = &timeline_out->entries[timeline_out->entries_length];
+		if (!parse_entry(start, entry)) {
+			fprintf(stderr, "%s:%zu: expected <seconds> fps <fps> or <seconds> resolution <width> <height>\n",
+				path, line_number);
+			return false;
+		}
+		if (TIMELINE_FPS == entry->kind && !check_fps(entry->fps)) {
+			fprintf(stderr, "%s:%zu: fps out of range\n", path, line_number);
+			return false;
+		}
+		if (timeline_out->entries_length && entry->seconds < entry[-1].seconds) {
+			fprintf(stderr, "%s:%zu: goes back in time\n", path, line_number);
+			return false;
+		}
+		timeline_out->has_fps = timeline_out->has_fps || TIMELINE_FPS == entry->kind;
+		timeline_out->has_resolution = timeline_out->has_resolution || TIMELINE_RESOLUTION == entry->kind;
+		timeline_out->entries_length += 1;
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "fgets() failed\n");
+		return false;
+	}
+	if (!timeline_out->entries_length) {
+		fprintf(stderr, "%s has no entries\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+bool parse_fps_timeline(int argc, char *argv[], struct fps_timeline *timeline_out)
+{
+	if (argc < 1) {
+		fprintf(stderr, "need a timeline file\n");
+		return false;
+	}
+
+	FILE *f = fopen(argv[0], "r");
+	if (!f) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	*timeline_out = (struct fps_timeline){ 0 };
+	bool success = read_timeline(f, argv[0], timeline_out);
+
+	if (fclose(f) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
+
+static bool rewrite(struct timeline_runner *runner, const struct timeline_entry *entry)
+{
+	if (TIMELINE_FPS == entry->kind) {
+		return fps_rewrite(runner->f, runner->targets, entry->fps);
+	}
+
+	return resolution_rewrite(runner->f, runner->targets, entry->game_width, entry->game_height);
+}
+
+static bool apply_entry(struct timeline_runner *runner, const struct timeline_entry *entry)
+{
+	if (!runner->f) {
+		runner->f = open_process_memory(runner->pid);
+		if (!runner->f) {
+			fprintf(stderr, "open_process_memory() failed\n");
+			return false;
+		}
+	}
+
+	uint64_t stop_ns = monotonic_ns();
+	int signal = 0;
+	if (!loop_seize(runner->pid, &signal)) {
+		fprintf(stderr, "loop_seize() failed\n");
+		return false;
+	}
+
+	bool success = rewrite(runner, entry);
+	if (!loop_unseize(runner->pid, signal)) {
+		fprintf(stderr, "loop_unseize() failed\n");
+		return false;
+	}
+	double stopped_us = (monotonic_ns() - stop_ns) / 1e3;
+
+	if (TIMELINE_FPS == entry->kind) {
+		printf("%10.3f s fps %g, stopped for %.1f us\n", entry->seconds, entry->fps, stopped_us);
+	} else {
+		printf("%10.3f s resolution %" PRIu32 "x%" PRIu32 ", stopped for %.1f us\n", entry->seconds,
+		       entry->game_width, entry->game_height, stopped_us);
+	}
+	fflush(stdout);
+
+	return success;
+}
+
+static enum loop_status apply_due_entries(void *data)
+{
+	struct timeline_runner *runner = data;
+	const struct fps_timeline *timeline = runner->timeline;
+	for (; runner->next < timeline->entries_length; ++runner->next) {
+		const struct timeline_entry *entry = &timeline->entries[runner->next];
+		if (monotonic_ns() - runner->start_ns < (uint64_t)(entry->seconds * 1e9)) {
+			return LOOP_CONTINUE;
+		}
+		if (!apply_entry(runner, entry)) {
+			fprintf(stderr, "apply_entry() failed\n");
+			return LOOP_FAILED;
+		}
+	}
+
+	return LOOP_DONE;
+}
+
+bool run_fps_timeline(struct loop *loop, pid_t pid, const struct patch_targets *targets,
+		      const struct fps_timeline *timeline)
+{
+	struct timeline_runner runner = {
+		.pid = pid,
+		.targets = targets,
+		.timeline = timeline,
+		.start_ns = monotonic_ns(),
+	};
+	// Checking the clock every millisecond is nothing next to the writes, and keeps the steps on time.
+	struct loop_step step = {
+		.description = "running the fps timeline",
+		.timeout = -1,
+		.tick_ns = LOOP_POLL_INTERVAL_NS,
+		.tick = apply_due_entries,
+		.data = &runner,
+	};
+	enum loop_status status = loop_run(loop, &step);
+
+	if (runner.f && fclose(runner.f) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return LOOP_DONE == status;
+}
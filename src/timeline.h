@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MAX_TIMELINE_ENTRIES 256
+
+enum timeline_kind {
+	TIMELINE_FPS,
+	TIMELINE_RESOLUTION,
+};
+
+// One line of a timeline file, "<seconds> fps <fps>" or "<seconds> resolution <game-width> <game-height>".
+struct timeline_entry {
+	// Since the game was patched.
+	double seconds;
+	enum timeline_kind kind;
+	float fps;
+	uint32_t game_width;
+	uint32_t game_height;
+};
+
+struct fps_timeline {
+	struct timeline_entry entries[MAX_TIMELINE_ENTRIES];
+	size_t entries_length;
+	bool has_fps;
+	bool has_resolution;
+};
+
+struct loop;
+
+bool parse_fps_timeline(int argc, char *argv[], struct fps_timeline *timeline_out);
+// Rewrites the patched values as the timeline says, the patterns aren't looked for again.
+bool run_fps_timeline(struct loop *loop, pid_t pid, const struct patch_targets *targets,
+		      const struct fps_timeline *timeline);
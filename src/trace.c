@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const struct trace_event_info event_infos[TRACE_EVENTS_LENGTH] = {
+	[TRACE_ATTACH] = { "attach", { "pid" }, 0 },
+	[TRACE_DETACH] = { "detach", { "pid" }, 0 },
+	[TRACE_STOP] = { "stop", { "pid", "wait_ns" }, 0 },
+	[TRACE_CONTINUE] = { "continue", { "pid", "signal" }, 0 },
+	[TRACE_STEP_END] = { "step-end", { "status" }, 0 },
+	[TRACE_TICK] = { "tick", { "pending" }, 0 },
+	[TRACE_READ] = { "read", { "position", "size", "ok" }, 1 },
+	[TRACE_MATCH] = { "match", { "site", "position" }, 2 },
+	[TRACE_WRITE] = { "write", { "position", "size", "ok" }, 1 },
+	[TRACE_TRAP] = { "trap", { "hits", "due" }, 1 },
+	[TRACE_ROLLBACK] = { "rollback", { "writes", "sites" }, 0 },
+};
+
+// Writers only ever bump head and fill the slot it gave them, nothing waits on anything. A dump that races a writer
+// may get a half written record, which is fine for a trace.
+static struct trace_record records[TRACE_CAPACITY];
+static atomic_uint_fast64_t head;
+static atomic_bool enabled;
+static atomic_bool initialized;
+static char path[PATH_MAX];
+
+static void dump_at_exit(void)
+{
+	trace_dump();
+}
+
+// Tracing stays off unless the environment names a file to dump to, every emit is a single load then.
+void trace_init(void)
+{
+	if (atomic_exchange(&initialized, true)) {
+		return;
+	}
+
+	const char *name = getenv(TRACE_ENVIRONMENT_VARIABLE);
+	if (!name || !*name) {
+		return;
+	}
+	if (strlen(name) >= sizeof(path)) {
+		fprintf(stderr, "%s is too long, not tracing\n", TRACE_ENVIRONMENT_VARIABLE);
+		return;
+	}
+	strcpy(path, name);
+
+	if (atexit(dump_at_exit)) {
+		fprintf(stderr, "atexit() failed, not tracing\n");
+		return;
+	}
+	atomic_store(&enabled, true);
+}
+
+bool trace_enabled(void)
+{
+	return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+void trace_emit(enum trace_event event, uint64_t arg0, uint64_t arg1, uint64_t arg2)
+{
+	if (!trace_enabled()) {
+		return;
+	}
+
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint_fast64_t index = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+	records[index & (TRACE_CAPACITY - 1)] = (struct trace_record){
+		.ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec,
+		.event = event,
+		.args = { arg0, arg1, arg2 },
+	};
+}
+
+// Writes what the ring holds, oldest first, replacing the previous dump.
+bool trace_dump(void)
+{
+	if (!trace_enabled()) {
+		return true;
+	}
+
+	uint64_t written = atomic_load(&head);
+	uint64_t length = written < TRACE_CAPACITY ? written : TRACE_CAPACITY;
+	struct trace_header header = {
+		.version = TRACE_VERSION,
+		.record_size = sizeof(struct trace_record),
+		.records_length = length,
+		.dropped = written - length,
+	};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+	FILE *out = fopen(path, "wb");
+	if (!out) {
+		perror("fopen() failed");
+		return false;
+	}
+
+	bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+	for (uint64_t i = written - length; success && i < written; ++i) {
+		success = fwrite(&records[i & (TRACE_CAPACITY - 1)], sizeof(struct trace_record), 1, out) == 1;
+	}
+	if (!success) {
+		fprintf(stderr, "fwrite() failed\n");
+	}
+
+	if (fclose(out) == EOF) {
+		perror("fclose() failed");
+		return false;
+	}
+
+	return success;
+}
+
+const struct trace_event_info *trace_event_info(uint32_t event)
+{
+	return event < TRACE_EVENTS_LENGTH ? &event_infos[event] : NULL;
+}
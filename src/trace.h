@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_ENVIRONMENT_VARIABLE "SEKIROFPSUNLOCK_TRACE"
+// A power of two, the oldest records get overwritten once it is full.
+#define TRACE_CAPACITY 16384
+#define TRACE_ARGS 3
+#define TRACE_MAGIC "SFUTRACE"
+#define TRACE_VERSION 1
+
+enum trace_event {
+	TRACE_ATTACH,
+	TRACE_DETACH,
+	TRACE_STOP,
+	TRACE_CONTINUE,
+	TRACE_STEP_END,
+	TRACE_TICK,
+	TRACE_READ,
+	TRACE_MATCH,
+	TRACE_WRITE,
+	TRACE_TRAP,
+	TRACE_ROLLBACK,
+	TRACE_EVENTS_LENGTH,
+};
+
+struct trace_record {
+	// CLOCK_MONOTONIC.
+	uint64_t ns;
+	uint32_t event;
+	uint32_t reserved;
+	uint64_t args[TRACE_ARGS];
+};
+
+// Starts a dump, records_length records follow it oldest first.
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t records_length;
+	// Overwritten before the dump.
+	uint64_t dropped;
+};
+
+// How tracedecode prints an event, args without a name aren't printed.
+struct trace_event_info {
+	const char *name;
+	const char *args[TRACE_ARGS];
+	// Bit i prints args[i] in hex.
+	unsigned hex;
+};
+
+void trace_init(void);
+bool trace_enabled(void);
+void trace_emit(enum trace_event event, uint64_t arg0, uint64_t arg1, uint64_t arg2);
+bool trace_dump(void);
+const struct trace_event_info *trace_event_info(uint32_t event);
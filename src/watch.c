@@ -0,0 +1,102 @@
+#define _GNU_SOURCE 1
+
+#include "watch.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#if defined(__x86_64__)
+
+#include <stddef.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+
+#define DEBUG_REGISTER(index) (offsetof(struct user, u_debugreg) + (index) * sizeof(((struct user *)0)->u_debugreg[0]))
+#define DR6_HITS 0xfUL
+// R/W of 01 breaks on data writes, LEN of 10 covers 8 bytes.
+#define DR7_WRITE_8(slot) ((1UL << ((slot) * 2)) | (0x1UL << (16 + (slot) * 4)) | (0x2UL << (18 + (slot) * 4)))
+#define DR7_SLOT_MASK(slot) ((3UL << ((slot) * 2)) | (0xfUL << (16 + (slot) * 4)))
+
+static bool peek_debug_register(pid_t tid, size_t index, unsigned long *value_out)
+{
+	errno = 0;
+	long value = ptrace(PTRACE_PEEKUSER, tid, (void *)DEBUG_REGISTER(index), NULL);
+	if (value == -1 && errno) {
+		perror("ptrace(PTRACE_PEEKUSER, ...) failed");
+		return false;
+	}
+	*value_out = value;
+
+	return true;
+}
+
+static bool poke_debug_register(pid_t tid, size_t index, unsigned long value)
+{
+	if (ptrace(PTRACE_POKEUSER, tid, (void *)DEBUG_REGISTER(index), (void *)value) == -1) {
+		perror("ptrace(PTRACE_POKEUSER, ...) failed");
+		return false;
+	}
+
+	return true;
+}
+
+// The address has to be in place before DR7 enables the slot, the kernel checks it against the length then.
+bool watch_set(pid_t tid, size_t slot, uint64_t address)
+{
+	if (slot >= MAX_WATCHPOINTS || address % WATCHPOINT_SIZE) {
+		fprintf(stderr, "can't watch 0x%llx in slot %zu\n", (unsigned long long)address, slot);
+		return false;
+	}
+
+	unsigned long dr7 = 0;
+	if (!peek_debug_register(tid, 7, &dr7) || !poke_debug_register(tid, slot, address)) {
+		return false;
+	}
+
+	return poke_debug_register(tid, 7, (dr7 & ~DR7_SLOT_MASK(slot)) | DR7_WRITE_8(slot));
+}
+
+bool watch_clear_all(pid_t tid)
+{
+	return poke_debug_register(tid, 7, 0) && poke_debug_register(tid, 6, 0);
+}
+
+bool watch_take_hits(pid_t tid, unsigned *slots_out)
+{
+	unsigned long dr6 = 0;
+	if (!peek_debug_register(tid, 6, &dr6)) {
+		return false;
+	}
+	*slots_out = dr6 & DR6_HITS;
+
+	return !*slots_out || poke_debug_register(tid, 6, 0);
+}
+
+#else
+
+bool watch_set(pid_t tid, size_t slot, uint64_t address)
+{
+	(void)tid;
+	(void)slot;
+	(void)address;
+	fprintf(stderr, "watchpoints are only supported on x86-64\n");
+
+	return false;
+}
+
+bool watch_clear_all(pid_t tid)
+{
+	(void)tid;
+
+	return true;
+}
+
+bool watch_take_hits(pid_t tid, unsigned *slots_out)
+{
+	(void)tid;
+	*slots_out = 0;
+
+	return true;
+}
+
+#endif
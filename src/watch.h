@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// DR0 to DR3.
+#define MAX_WATCHPOINTS 4
+// Watchpoints cover an aligned quadword.
+#define WATCHPOINT_SIZE 8
+
+// Hardware write watchpoints through the debug registers of one stopped tracee thread. Only x86-64 has them, every
+// function fails elsewhere.
+bool watch_set(pid_t tid, size_t slot, uint64_t address);
+bool watch_clear_all(pid_t tid);
+// Which slots fired since the last call, as bits, and forgets about them.
+bool watch_take_hits(pid_t tid, unsigned *slots_out);